@@ -6,8 +6,17 @@
 #include "camera.h"
 #include "shader.h"
 #include "mesh.h"
-
-#include <sys/stat.h>
+#include "texture.h"
+
+#include <sys/stat.h>
+#include <mutex>
+#include "jobs.h"
+
+//sse2 is always available in x64 (and in x86 when enabled), the scalar path is used anywhere else
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#define ANIM_USE_SSE
+	#include <emmintrin.h>
+#endif
 
 Skeleton::Skeleton()
 {
@@ -40,7 +49,6 @@ void Skeleton::computeFinalBoneMatrices( std::vector<Matrix44>& bone_matrices, M
 	updateGlobalMatrices();
 
 	bone_matrices.resize(mesh->bones_info.size());
-	#pragma omp for  
 	for (int i = 0; i < mesh->bones_info.size(); ++i)
 	{
 		BoneInfo& bone_info = mesh->bones_info[i];
@@ -79,7 +87,6 @@ void blendSkeleton(Skeleton* a, Skeleton* b, float w, Skeleton* result, uint8 la
 	}
 
 	//blend bones locally
-	#pragma omp for  
 	for (int i = 0; i < result->num_bones; ++i)
 	{
 		Skeleton::Bone& bone = result->bones[i];
@@ -87,7 +94,6 @@ void blendSkeleton(Skeleton* a, Skeleton* b, float w, Skeleton* result, uint8 la
 		Skeleton::Bone& boneB = b->bones[i];
 		if ( layer != 0xFF && !(bone.layer & layer) ) //not in the same layer
 			continue;
-		#pragma omp for  
 		for (int j = 0; j < 16; ++j)
 			bone.model.m[j] = lerp( boneA.model.m[j], boneB.model.m[j], w);
 	}
@@ -146,6 +152,25 @@ void Skeleton::updateGlobalMatrices()
 	}
 }
 
+void Skeleton::computeGlobalMatrices(const Matrix44* local_matrices, Matrix44* global_matrices) const
+{
+	global_matrices[0] = local_matrices[0];
+	//order dependant
+	for (int i = 1; i < num_bones; ++i)
+		global_matrices[i] = local_matrices[i] * global_matrices[ bones[i].parent ];
+}
+
+void Skeleton::computeBoneRemap(Mesh* mesh, std::vector<int>& remap)
+{
+	assert(mesh);
+	remap.resize(mesh->bones_info.size());
+	for (int i = 0; i < mesh->bones_info.size(); ++i)
+	{
+		auto it = bones_by_name.find(mesh->bones_info[i].name);
+		remap[i] = it == bones_by_name.end() ? -1 : it->second;
+	}
+}
+
 void Skeleton::assignLayer( Bone* bone, uint8 layer )
 {
 	if (!bone)
@@ -165,20 +190,292 @@ Animation::Animation()
 {
 	duration = 0.0f;
 	keyframes = NULL;
+	ranges = NULL;
 	num_keyframes = 0;
 	num_animated_bones = 0;
+	num_lanes = 0;
+	num_chunks = 0;
+	chunks = NULL;
+	chunk_offsets = NULL;
+	chunks_data = NULL;
+	mapped_data = NULL;
+	mapped_size = 0;
 }
 
 Animation::~Animation()
 {
 	if (keyframes)
 		delete[] keyframes;
+	if (ranges)
+		delete[] ranges;
+	if (chunks)
+	{
+		releaseChunks(-1);
+		delete[] chunks;
+		delete[] chunk_offsets;
+	}
+	unmapFile(mapped_data, mapped_size);
+}
+
+//bone matrices use row vectors: the rows are the scaled axis and m[12..14] the translation
+static void decomposeBoneMatrix(const Matrix44& m, Vector3& translation, Quaternion& rotation, float& scale)
+{
+	translation.set(m.m[12], m.m[13], m.m[14]);
+	Vector3 axis_x(m.m[0], m.m[1], m.m[2]);
+	Vector3 axis_y(m.m[4], m.m[5], m.m[6]);
+	Vector3 axis_z(m.m[8], m.m[9], m.m[10]);
+	float sx = axis_x.length();
+	float sy = axis_y.length();
+	float sz = axis_z.length();
+	scale = (sx + sy + sz) / 3.0f; //skeletons only use uniform scales
+	axis_x = axis_x * (1.0f / sx);
+	axis_y = axis_y * (1.0f / sy);
+	axis_z = axis_z * (1.0f / sz);
+
+	//inverse of Quaternion::toMatrix
+	float trace = axis_x.x + axis_y.y + axis_z.z;
+	if (trace > 0)
+	{
+		float s = sqrt(trace + 1.0f) * 2.0f;
+		rotation.set((axis_y.z - axis_z.y) / s, (axis_z.x - axis_x.z) / s, (axis_x.y - axis_y.x) / s, 0.25f * s);
+	}
+	else if (axis_x.x > axis_y.y && axis_x.x > axis_z.z)
+	{
+		float s = sqrt(1.0f + axis_x.x - axis_y.y - axis_z.z) * 2.0f;
+		rotation.set(0.25f * s, (axis_x.y + axis_y.x) / s, (axis_z.x + axis_x.z) / s, (axis_y.z - axis_z.y) / s);
+	}
+	else if (axis_y.y > axis_z.z)
+	{
+		float s = sqrt(1.0f + axis_y.y - axis_x.x - axis_z.z) * 2.0f;
+		rotation.set((axis_x.y + axis_y.x) / s, 0.25f * s, (axis_y.z + axis_z.y) / s, (axis_z.x - axis_x.z) / s);
+	}
+	else
+	{
+		float s = sqrt(1.0f + axis_z.z - axis_x.x - axis_y.y) * 2.0f;
+		rotation.set((axis_z.x + axis_x.z) / s, (axis_y.z + axis_z.y) / s, 0.25f * s, (axis_x.y - axis_y.x) / s);
+	}
+	rotation.normalize();
+}
+
+//same as Quaternion::toMatrix with the scale and translation
+static void composeBoneMatrix(Matrix44& m, const float* tracks, int stride)
+{
+	float x = tracks[Animation::TRACK_QX * stride];
+	float y = tracks[Animation::TRACK_QY * stride];
+	float z = tracks[Animation::TRACK_QZ * stride];
+	float w = tracks[Animation::TRACK_QW * stride];
+	float s = tracks[Animation::TRACK_SCALE * stride];
+	float xx = x * x * 2.0f, yy = y * y * 2.0f, zz = z * z * 2.0f;
+	float xy = x * y * 2.0f, xz = x * z * 2.0f, yz = y * z * 2.0f;
+	float wx = w * x * 2.0f, wy = w * y * 2.0f, wz = w * z * 2.0f;
+	m.m[0] = (1.0f - yy - zz) * s;
+	m.m[1] = (xy + wz) * s;
+	m.m[2] = (xz - wy) * s;
+	m.m[3] = 0;
+	m.m[4] = (xy - wz) * s;
+	m.m[5] = (1.0f - xx - zz) * s;
+	m.m[6] = (yz + wx) * s;
+	m.m[7] = 0;
+	m.m[8] = (xz + wy) * s;
+	m.m[9] = (yz - wx) * s;
+	m.m[10] = (1.0f - xx - yy) * s;
+	m.m[11] = 0;
+	m.m[12] = tracks[Animation::TRACK_TX * stride];
+	m.m[13] = tracks[Animation::TRACK_TY * stride];
+	m.m[14] = tracks[Animation::TRACK_TZ * stride];
+	m.m[15] = 1;
+}
+
+void Animation::setKeyframes(const Matrix44* matrices)
+{
+	num_lanes = (num_animated_bones + 3) & ~3;
+	if (keyframes)
+		delete[] keyframes;
+	if (ranges)
+		delete[] ranges;
+	keyframes = new uint16[num_keyframes * NUM_TRACKS * num_lanes];
+	ranges = new float[2 * NUM_TRACKS * num_lanes];
+	float* mins = ranges;
+	float* steps = ranges + NUM_TRACKS * num_lanes;
+
+	//decomposed first to know the range of every track
+	std::vector<float> values(num_keyframes * num_animated_bones * NUM_TRACKS);
+	for (int k = 0; k < num_keyframes; ++k)
+		for (int i = 0; i < num_animated_bones; ++i)
+		{
+			Vector3 t;
+			Quaternion q;
+			float s;
+			decomposeBoneMatrix(matrices[k * num_animated_bones + i], t, q, s);
+			float* v = &values[(k * num_animated_bones + i) * NUM_TRACKS];
+			//same hemisphere as the previous keyframe, so the interpolation takes the short path
+			if (k > 0)
+			{
+				float* prev = v - num_animated_bones * NUM_TRACKS;
+				if (q.x * prev[TRACK_QX] + q.y * prev[TRACK_QY] + q.z * prev[TRACK_QZ] + q.w * prev[TRACK_QW] < 0)
+					q = q * -1.0f;
+			}
+			v[TRACK_TX] = t.x;
+			v[TRACK_TY] = t.y;
+			v[TRACK_TZ] = t.z;
+			v[TRACK_QX] = q.x;
+			v[TRACK_QY] = q.y;
+			v[TRACK_QZ] = q.z;
+			v[TRACK_QW] = q.w;
+			v[TRACK_SCALE] = s;
+		}
+
+	for (int track = 0; track < NUM_TRACKS; ++track)
+		for (int i = 0; i < num_lanes; ++i)
+		{
+			int index = track * num_lanes + i;
+			if (i >= num_animated_bones) //padding, decompressed as identity
+			{
+				mins[index] = (track == TRACK_QW || track == TRACK_SCALE) ? 1.0f : 0.0f;
+				steps[index] = 0.0f;
+				continue;
+			}
+			float min_value = 1e10;
+			float max_value = -1e10;
+			for (int k = 0; k < num_keyframes; ++k)
+			{
+				float v = values[(k * num_animated_bones + i) * NUM_TRACKS + track];
+				min_value = v < min_value ? v : min_value;
+				max_value = v > max_value ? v : max_value;
+			}
+			//constant tracks are not stored
+			if (max_value == min_value)
+			{
+				mins[index] = min_value;
+				steps[index] = 0.0f;
+				continue;
+			}
+			if (track >= TRACK_QX && track <= TRACK_QW)
+			{
+				min_value = -1.0f;
+				max_value = 1.0f;
+			}
+			mins[index] = min_value;
+			steps[index] = (max_value - min_value) / 65535.0f;
+		}
+
+	//quantize
+	for (int k = 0; k < num_keyframes; ++k)
+		for (int track = 0; track < NUM_TRACKS; ++track)
+		{
+			uint16* keyframe = keyframes + (k * NUM_TRACKS + track) * num_lanes;
+			for (int i = 0; i < num_lanes; ++i)
+			{
+				int index = track * num_lanes + i;
+				if (i >= num_animated_bones || steps[index] == 0.0f)
+				{
+					keyframe[i] = 0;
+					continue;
+				}
+				float v = values[(k * num_animated_bones + i) * NUM_TRACKS + track];
+				keyframe[i] = (uint16)clamp((int)((v - mins[index]) / steps[index] + 0.5f), 0, 65535);
+			}
+		}
+}
+
+void Animation::sampleTracks(int keyframe, int keyframe2, float f, float* output) const
+{
+	const uint16* k = getKeyframe(keyframe);
+	const uint16* k2 = getKeyframe(keyframe2);
+	const float* mins = ranges;
+	const float* steps = ranges + NUM_TRACKS * num_lanes;
+
+#ifdef ANIM_USE_SSE
+	__m128i zero = _mm_setzero_si128();
+	__m128 vf = _mm_set1_ps(f);
+	__m128 sign_bit = _mm_set1_ps(-0.0f);
+	for (int lane = 0; lane < num_lanes; lane += 4)
+	{
+		//decompress 4 bones of both keyframes
+		__m128 a[NUM_TRACKS];
+		__m128 b[NUM_TRACKS];
+		for (int track = 0; track < NUM_TRACKS; ++track)
+		{
+			int offset = track * num_lanes + lane;
+			__m128 qa = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i*)(k + offset)), zero));
+			__m128 qb = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i*)(k2 + offset)), zero));
+			__m128 min_value = _mm_loadu_ps(mins + offset);
+			__m128 step = _mm_loadu_ps(steps + offset);
+			a[track] = _mm_add_ps(min_value, _mm_mul_ps(qa, step));
+			b[track] = _mm_add_ps(min_value, _mm_mul_ps(qb, step));
+		}
+
+		//nlerp, by the short path (only needed when looping from the last keyframe to the first)
+		__m128 dot = _mm_mul_ps(a[TRACK_QX], b[TRACK_QX]);
+		dot = _mm_add_ps(dot, _mm_mul_ps(a[TRACK_QY], b[TRACK_QY]));
+		dot = _mm_add_ps(dot, _mm_mul_ps(a[TRACK_QZ], b[TRACK_QZ]));
+		dot = _mm_add_ps(dot, _mm_mul_ps(a[TRACK_QW], b[TRACK_QW]));
+		__m128 flip = _mm_and_ps(_mm_cmplt_ps(dot, _mm_setzero_ps()), sign_bit);
+		for (int track = TRACK_QX; track <= TRACK_QW; ++track)
+			b[track] = _mm_xor_ps(b[track], flip);
+
+		__m128 result[NUM_TRACKS];
+		for (int track = 0; track < NUM_TRACKS; ++track)
+			result[track] = _mm_add_ps(a[track], _mm_mul_ps(_mm_sub_ps(b[track], a[track]), vf));
+
+		__m128 length = _mm_mul_ps(result[TRACK_QX], result[TRACK_QX]);
+		length = _mm_add_ps(length, _mm_mul_ps(result[TRACK_QY], result[TRACK_QY]));
+		length = _mm_add_ps(length, _mm_mul_ps(result[TRACK_QZ], result[TRACK_QZ]));
+		length = _mm_add_ps(length, _mm_mul_ps(result[TRACK_QW], result[TRACK_QW]));
+		__m128 inv_length = _mm_div_ps(_mm_set1_ps(1.0f), _mm_sqrt_ps(length));
+		for (int track = TRACK_QX; track <= TRACK_QW; ++track)
+			result[track] = _mm_mul_ps(result[track], inv_length);
+
+		for (int track = 0; track < NUM_TRACKS; ++track)
+			_mm_storeu_ps(output + track * num_lanes + lane, result[track]);
+	}
+#else
+	for (int i = 0; i < num_lanes; ++i)
+	{
+		float a[NUM_TRACKS];
+		float b[NUM_TRACKS];
+		for (int track = 0; track < NUM_TRACKS; ++track)
+		{
+			int offset = track * num_lanes + i;
+			a[track] = mins[offset] + k[offset] * steps[offset];
+			b[track] = mins[offset] + k2[offset] * steps[offset];
+		}
+		float dot = a[TRACK_QX] * b[TRACK_QX] + a[TRACK_QY] * b[TRACK_QY] + a[TRACK_QZ] * b[TRACK_QZ] + a[TRACK_QW] * b[TRACK_QW];
+		if (dot < 0)
+			for (int track = TRACK_QX; track <= TRACK_QW; ++track)
+				b[track] = -b[track];
+		float length = 0;
+		for (int track = 0; track < NUM_TRACKS; ++track)
+		{
+			a[track] = lerp(a[track], b[track], f);
+			if (track >= TRACK_QX && track <= TRACK_QW)
+				length += a[track] * a[track];
+		}
+		length = sqrt(length);
+		for (int track = TRACK_QX; track <= TRACK_QW; ++track)
+			a[track] /= length;
+		for (int track = 0; track < NUM_TRACKS; ++track)
+			output[track * num_lanes + i] = a[track];
+	}
+#endif
 }
 
 void Animation::assignTime(float t, bool loop, bool interpolate, uint8 layers)
 {
-	assert(keyframes && skeleton.num_bones);
+	assert((keyframes || chunks) && skeleton.num_bones);
 
+	Matrix44 local_matrices[128];
+	for (int i = 0; i < skeleton.num_bones; ++i)
+		local_matrices[i] = skeleton.bones[i].model;
+	sampleLocalMatrices(t, loop, local_matrices, layers);
+	for (int i = 0; i < skeleton.num_bones; ++i)
+		skeleton.bones[i].model = local_matrices[i];
+
+	skeleton.updateGlobalMatrices();
+}
+
+void Animation::sampleLocalMatrices(float t, bool loop, Matrix44* local_matrices, uint8 layers) const
+{
 	if (loop)
 	{
 		t = fmod(t, duration);
@@ -194,22 +491,16 @@ void Animation::assignTime(float t, bool loop, bool interpolate, uint8 layers)
 		index2 = 0;
 	float f = v - floor(v);
 
-	Matrix44* k = keyframes + index * num_animated_bones;
-	Matrix44* k2 = keyframes + index2 * num_animated_bones;
-
-	//compute local bones
-	#pragma omp for  
+	//every bone interpolated at once, then the local matrices of the ones in the layers
+	float tracks[NUM_TRACKS * 128];
+	sampleTracks(index, index2, f, tracks);
 	for (int i = 0; i < num_animated_bones; ++i)
 	{
 		int bone_index = bones_map[i];
-		Skeleton::Bone& bone = skeleton.bones[bone_index];
-		if (layers != 0xFF && !(bone.layer & layers))
+		if (layers != 0xFF && !(skeleton.bones[bone_index].layer & layers))
 			continue;
-		for (int j = 0; j < 16; ++j)
-			bone.model.m[j] = lerp(k[i].m[j], k2[i].m[j], f);
+		composeBoneMatrix(local_matrices[bone_index], tracks + i, num_lanes);
 	}
-
-	skeleton.updateGlobalMatrices();
 }
 
 
@@ -217,6 +508,13 @@ void Animation::operator = (Animation* anim)
 {
 	memcpy(this, anim, sizeof(Animation));
 	this->keyframes = NULL;
+	this->ranges = NULL;
+	this->num_chunks = 0;
+	this->chunks = NULL;
+	this->chunk_offsets = NULL;
+	this->chunks_data = NULL;
+	this->mapped_data = NULL;
+	this->mapped_size = 0;
 }
 
 bool Animation::load(const char* filename)
@@ -264,11 +562,44 @@ struct sAnimHeader {
 	int num_keyframes;
 	int num_bones;
 	int8 bones_map[128];
+	int num_chunks;
+	int keys_per_chunk;
 	char extra[16];
 };
 
+//linear interpolation of the quantized keys a and b (b > a) at key j
+static uint16 interpolateKey(int a, uint16 va, int b, uint16 vb, int j)
+{
+	return (uint16)(va + ((int)vb - (int)va) * (j - a) / (float)(b - a) + 0.5f);
+}
+
+//the keys of one track in a chunk that can rebuild the others by linear interpolation within max_error
+static void reduceKeys(const uint16* values, int count, float step, float max_error, std::vector<uint8>& kept)
+{
+	kept.clear();
+	kept.push_back(0);
+	int a = 0;
+	while (a < count - 1)
+	{
+		//extend the segment while every key inside is close enough to the line
+		int b = a + 1;
+		while (b + 1 < count)
+		{
+			bool fits = true;
+			for (int j = a + 1; j <= b && fits; ++j)
+				fits = fabs((float)interpolateKey(a, values[a], b + 1, values[b + 1], j) - values[j]) * step <= max_error;
+			if (!fits)
+				break;
+			b++;
+		}
+		kept.push_back(b);
+		a = b;
+	}
+}
+
 bool Animation::writeABIN(const char* filename)
 {
+	assert(keyframes && "only the clips in memory can be written");
 	std::string s_filename = filename;
 	s_filename += ".abin";
 
@@ -291,6 +622,8 @@ bool Animation::writeABIN(const char* filename)
 	header.num_keyframes = num_keyframes;
 	header.num_bones = skeleton.num_bones;
 	memcpy( header.bones_map, bones_map, sizeof(bones_map)  );
+	header.keys_per_chunk = KEYS_PER_CHUNK;
+	header.num_chunks = num_keyframes > 1 ? (num_keyframes - 1 + KEYS_PER_CHUNK - 1) / KEYS_PER_CHUNK : 1;
 
 	//write header
 	fwrite((void*)&header, sizeof(sAnimHeader), 1, f);
@@ -298,8 +631,40 @@ bool Animation::writeABIN(const char* filename)
 	//write skeleton
 	fwrite((void*)skeleton.bones, sizeof(skeleton.bones), 1, f);
 
-	//write keyframes
-	fwrite((void*)keyframes, sizeof(Matrix44) * num_keyframes * num_animated_bones, 1, f);
+	//write ranges
+	fwrite((void*)ranges, sizeof(float) * 2 * NUM_TRACKS * num_lanes, 1, f);
+
+	//compress every chunk: for every track that is not constant, the number of keys, their index and their values
+	const float* steps = ranges + NUM_TRACKS * num_lanes;
+	int stride = NUM_TRACKS * num_lanes;
+	std::vector<uint32> offsets(1, 0);
+	std::vector<uint8> data;
+	std::vector<uint16> values(KEYS_PER_CHUNK + 1);
+	std::vector<uint8> kept;
+	for (int c = 0; c < header.num_chunks; ++c)
+	{
+		int start = c * KEYS_PER_CHUNK;
+		int count = num_keyframes - start < KEYS_PER_CHUNK + 1 ? num_keyframes - start : KEYS_PER_CHUNK + 1;
+		for (int index = 0; index < stride; ++index)
+		{
+			if (steps[index] == 0.0f)
+				continue;
+			for (int k = 0; k < count; ++k)
+				values[k] = keyframes[(start + k) * stride + index];
+			reduceKeys(&values[0], count, steps[index], max_error, kept);
+			data.push_back((uint8)kept.size());
+			data.insert(data.end(), kept.begin(), kept.end());
+			for (int k = 0; k < kept.size(); ++k)
+			{
+				uint16 v = values[kept[k]];
+				data.insert(data.end(), (uint8*)&v, (uint8*)&v + sizeof(uint16));
+			}
+		}
+		offsets.push_back(data.size());
+	}
+	fwrite((void*)&offsets[0], sizeof(uint32) * offsets.size(), 1, f);
+	if (data.size())
+		fwrite((void*)&data[0], data.size(), 1, f);
 
 	fclose(f);
 	return true;
@@ -307,25 +672,19 @@ bool Animation::writeABIN(const char* filename)
 
 bool Animation::loadABIN(const char* filename)
 {
-	FILE *f;
 	assert(filename);
 
-	struct stat stbuffer;
-
-	stat(filename, &stbuffer);
-	f = fopen(filename, "rb");
-	if (f == NULL)
+	//mapped, the keyframes are read from it when sampled
+	size_t size = 0;
+	char* data = (char*)mapFile(filename, size);
+	if (data == NULL)
 		return false;
 
-	unsigned int size = (unsigned int)stbuffer.st_size;
-	char* data = new char[size];
-	fread(data, size, 1, f);
-	fclose(f);
-
 	//watermark
-	if (memcmp(data, "ABIN", 4) != 0)
+	if (size < 4 + sizeof(sAnimHeader) || memcmp(data, "ABIN", 4) != 0)
 	{
 		std::cout << "[ERROR] loading BIN: invalid content: " << filename << std::endl;
+		unmapFile(data, size);
 		return false;
 	}
 
@@ -334,9 +693,39 @@ bool Animation::loadABIN(const char* filename)
 	memcpy(&header, pos, sizeof(sAnimHeader));
 	pos += sizeof(sAnimHeader);
 
-	if (header.version != ANIM_BIN_VERSION || header.header_bytes != sizeof(sAnimHeader))
+	if (header.version != ANIM_BIN_VERSION || header.header_bytes != sizeof(sAnimHeader) || header.keys_per_chunk != KEYS_PER_CHUNK)
 	{
 		std::cout << "[WARN] loading BIN: old version: " << filename << std::endl;
+		unmapFile(data, size);
+		return false;
+	}
+
+	//everything is read from the mapping, a damaged file is rebuilt from the .skanim instead of reading past it
+	bool valid = header.num_bones >= 0 && header.num_bones <= 128 && header.num_animated_bones >= 0 && header.num_animated_bones <= 128 &&
+		header.num_keyframes >= 0 && header.num_chunks == (header.num_keyframes > 1 ? (header.num_keyframes - 1 + KEYS_PER_CHUNK - 1) / KEYS_PER_CHUNK : 1);
+	for (int i = 0; i < header.num_animated_bones && valid; ++i)
+		valid = header.bones_map[i] >= 0 && header.bones_map[i] < header.num_bones;
+	int header_lanes = (header.num_animated_bones + 3) & ~3;
+	size_t tables_size = sizeof(skeleton.bones) + sizeof(float) * 2 * NUM_TRACKS * header_lanes + sizeof(uint32) * (header.num_chunks + 1);
+	valid = valid && size - (pos - data) >= tables_size;
+	if (valid)
+	{
+		//the offsets of the chunks go in order and the last one is the end of their data
+		const char* table = pos + sizeof(skeleton.bones) + sizeof(float) * 2 * NUM_TRACKS * header_lanes;
+		uint32 prev_offset = 0;
+		for (int i = 0; i <= header.num_chunks && valid; ++i)
+		{
+			uint32 offset;
+			memcpy(&offset, table + sizeof(uint32) * i, sizeof(uint32));
+			valid = offset >= prev_offset;
+			prev_offset = offset;
+		}
+		valid = valid && size - (pos - data) - tables_size >= prev_offset;
+	}
+	if (!valid)
+	{
+		std::cout << "[ERROR] loading BIN: truncated or damaged file: " << filename << std::endl;
+		unmapFile(data, size);
 		return false;
 	}
 
@@ -352,17 +741,31 @@ bool Animation::loadABIN(const char* filename)
 	memcpy( skeleton.bones, pos, sizeof(skeleton.bones) );
 	pos += sizeof(skeleton.bones);
 
-	//extract keyframes
-	assert(keyframes == NULL);
-	keyframes = new Matrix44[num_keyframes * num_animated_bones];
-	memcpy( keyframes, pos, sizeof(Matrix44)*num_keyframes * num_animated_bones );
-	pos += sizeof(Matrix44) * num_keyframes * num_animated_bones;
+	//extract ranges and the chunks table, the chunks stay in the file
+	assert(keyframes == NULL && ranges == NULL && chunks == NULL);
+	num_lanes = (num_animated_bones + 3) & ~3;
+	ranges = new float[2 * NUM_TRACKS * num_lanes];
+	memcpy( ranges, pos, sizeof(float) * 2 * NUM_TRACKS * num_lanes );
+	pos += sizeof(float) * 2 * NUM_TRACKS * num_lanes;
+	num_chunks = header.num_chunks;
+	chunk_offsets = new uint32[num_chunks + 1];
+	memcpy( chunk_offsets, pos, sizeof(uint32) * (num_chunks + 1) );
+	pos += sizeof(uint32) * (num_chunks + 1);
+	chunks_data = (const uint8*)pos;
+
+	chunks = new sChunk[num_chunks];
+	for (int i = 0; i < num_chunks; ++i)
+	{
+		chunks[i].keys.store(NULL);
+		chunks[i].last_used.store(0);
+	}
+	mapped_data = data;
+	mapped_size = size;
 
 	//compute bone names map
 	for (int i = 0; i < skeleton.num_bones; ++i)
 		skeleton.bones_by_name[ skeleton.bones[i].name ] = i;
 
-	delete[] data;
 	return true;
 }
 
@@ -396,6 +799,7 @@ bool Animation::loadSKANIM(const char* filename)
 	num_animated_bones = 0;
 
 	int current_keyframe = 0;
+	std::vector<Matrix44> matrices; //compressed once everything is read
 
 	while (*pos)
 	{
@@ -433,13 +837,13 @@ bool Animation::loadSKANIM(const char* filename)
 				bones_map[j] = bones_map_info[j];
 			num_animated_bones = (int)bones_map_info.size();
 			assert(keyframes == NULL);
-			keyframes = new Matrix44[num_animated_bones * num_keyframes];
+			matrices.resize(num_animated_bones * num_keyframes);
 		}
 		else if (type == 'K')
 		{
 			pos = fetchWord(pos, word);
 			//float time = atof(word);
-			Matrix44* k = keyframes + current_keyframe * num_animated_bones;
+			Matrix44* k = &matrices[0] + current_keyframe * num_animated_bones;
 			current_keyframe++;
 			for (int j = 0; j < num_animated_bones; ++j)
 				pos = fetchMatrix44(pos, *(k + j));
@@ -468,7 +872,11 @@ bool Animation::loadSKANIM(const char* filename)
 		skeleton.assignLayer(skeleton.getBone("mixamorig_LeftShoulder"), LEFT_ARM);
 	}
 
-	assignTime(0); //reset pose
+	if (matrices.size())
+	{
+		setKeyframes(&matrices[0]);
+		assignTime(0); //reset pose
+	}
 
 	delete[] data;
 	return true;
@@ -496,3 +904,421 @@ Animation* Animation::Get(const char* filename)
 	sAnimationsLoaded[filename] = anim;
 	return anim;
 }
+
+float Animation::max_error = 0.0005f;
+long Animation::s_frame = 0;
+
+//only taken when a chunk has to be decompressed
+static std::mutex chunks_mutex;
+
+const uint16* Animation::getKeyframe(int keyframe) const
+{
+	if (keyframes)
+		return keyframes + keyframe * NUM_TRACKS * num_lanes;
+
+	int chunk = keyframe / KEYS_PER_CHUNK;
+	if (chunk >= num_chunks)
+		chunk = num_chunks - 1;
+	sChunk& c = chunks[chunk];
+	c.last_used.store(s_frame, std::memory_order_relaxed);
+	const uint16* keys = c.keys.load();
+	if (!keys)
+		keys = decompressChunk(chunk);
+	return keys + (keyframe - chunk * KEYS_PER_CHUNK) * NUM_TRACKS * num_lanes;
+}
+
+const uint16* Animation::decompressChunk(int chunk) const
+{
+	std::lock_guard<std::mutex> lock(chunks_mutex);
+	sChunk& c = chunks[chunk];
+	if (c.keys.load()) //decompressed by another thread meanwhile
+		return c.keys.load();
+
+	//the constant tracks are 0 (the min), the others are interpolated between the stored keys
+	int stride = NUM_TRACKS * num_lanes;
+	uint16* keys = new uint16[(KEYS_PER_CHUNK + 1) * stride];
+	memset(keys, 0, sizeof(uint16) * (KEYS_PER_CHUNK + 1) * stride);
+	const float* steps = ranges + stride;
+	const uint8* pos = chunks_data + chunk_offsets[chunk];
+	const uint8* end = chunks_data + chunk_offsets[chunk + 1];
+	for (int index = 0; index < stride; ++index)
+	{
+		if (steps[index] == 0.0f)
+			continue;
+		//loadABIN only checked the offsets, a damaged chunk is left incomplete instead of reading past it
+		int num = pos < end ? *pos++ : 0;
+		bool valid = num > 0 && end - pos >= num * (1 + (int)sizeof(uint16));
+		for (int i = 0; i < num && valid; ++i)
+			valid = pos[i] <= KEYS_PER_CHUNK && (i == 0 || pos[i] > pos[i - 1]);
+		if (!valid)
+		{
+			std::cout << "[ERROR] damaged animation chunk: " << chunk << std::endl;
+			break;
+		}
+		const uint8* indices = pos;
+		pos += num;
+		uint16 a_value, b_value;
+		memcpy(&a_value, pos, sizeof(uint16));
+		keys[indices[0] * stride + index] = a_value;
+		for (int i = 1; i < num; ++i)
+		{
+			memcpy(&b_value, pos + i * sizeof(uint16), sizeof(uint16));
+			int a = indices[i - 1];
+			int b = indices[i];
+			for (int j = a + 1; j <= b; ++j)
+				keys[j * stride + index] = interpolateKey(a, a_value, b, b_value, j);
+			a_value = b_value;
+		}
+		pos += num * sizeof(uint16);
+	}
+
+	c.keys.store(keys);
+	return keys;
+}
+
+void Animation::releaseChunks(int max_frames)
+{
+	for (int i = 0; i < num_chunks; ++i)
+	{
+		uint16* keys = chunks[i].keys.load();
+		if (!keys || (max_frames >= 0 && s_frame - chunks[i].last_used.load() <= max_frames))
+			continue;
+		chunks[i].keys.store(NULL);
+		delete[] keys;
+	}
+}
+
+void Animation::ReleaseUnusedChunks(int max_frames)
+{
+	for (auto it = sAnimationsLoaded.begin(); it != sAnimationsLoaded.end(); ++it)
+		it->second->releaseChunks(max_frames);
+	s_frame++;
+}
+
+int AnimationSystem::getRemap(Mesh* mesh, Animation* animation)
+{
+	for (int i = 0; i < remaps.size(); ++i)
+		if (remaps[i].mesh == mesh && remaps[i].skeleton == &animation->skeleton)
+			return i;
+
+	sRemap remap;
+	remap.mesh = mesh;
+	remap.skeleton = &animation->skeleton;
+	animation->skeleton.computeBoneRemap(mesh, remap.bones);
+	remap.offsets.resize(mesh->bones_info.size());
+	for (int i = 0; i < mesh->bones_info.size(); ++i)
+		remap.offsets[i] = mesh->bind_matrix * mesh->bones_info[i].bind_pose;
+	remaps.push_back(remap);
+	return remaps.size() - 1;
+}
+
+int AnimationSystem::addInstance(Mesh* mesh, Animation* animation)
+{
+	assert(mesh && animation && mesh->bones_info.size());
+	meshes.push_back(mesh);
+	animations_a.push_back(animation);
+	animations_b.push_back(NULL);
+	times_a.push_back(0.0f);
+	times_b.push_back(0.0f);
+	blend_weights.push_back(0.0f);
+	blend_layers.push_back(0xFF);
+	remap_indices.push_back(getRemap(mesh, animation));
+	palette_offsets.push_back(palettes.size());
+	palettes.resize(palettes.size() + mesh->bones_info.size());
+	return meshes.size() - 1;
+}
+
+void AnimationSystem::setAnimation(int instance, Animation* a, Animation* b, float blend, uint8 layers)
+{
+	assert(a && (!b || b->skeleton.num_bones == a->skeleton.num_bones) && "skeleton must contain the same number of bones");
+	animations_a[instance] = a;
+	animations_b[instance] = b;
+	blend_weights[instance] = clamp(blend, 0.0f, 1.0f);
+	blend_layers[instance] = layers;
+	remap_indices[instance] = getRemap(meshes[instance], a);
+}
+
+void AnimationSystem::setTime(int instance, float time_a, float time_b)
+{
+	times_a[instance] = time_a;
+	times_b[instance] = time_b;
+}
+
+static void updateAnimationRange(void* data, int start, int end)
+{
+	((AnimationSystem*)data)->updateRange(start, end);
+}
+
+void AnimationSystem::update(float dt)
+{
+	int num_instances = meshes.size();
+	for (int i = 0; i < num_instances; ++i)
+	{
+		times_a[i] += dt;
+		times_b[i] += dt;
+	}
+
+	//the instances are independent, not worth a job for less than a few characters
+	JobSystem::parallelFor(updateAnimationRange, this, num_instances, 16);
+}
+
+void AnimationSystem::updateRange(int start, int end)
+{
+	Matrix44 local_a[128];
+	Matrix44 local_b[128];
+	Matrix44 global_matrices[128];
+
+	for (int i = start; i < end; ++i)
+	{
+		Animation* a = animations_a[i];
+		Animation* b = animations_b[i];
+		const Skeleton& skeleton = a->skeleton;
+
+		//sample, starting from the rest pose for the bones without keyframes
+		for (int j = 0; j < skeleton.num_bones; ++j)
+			local_a[j] = skeleton.bones[j].model;
+		a->sampleLocalMatrices(times_a[i], true, local_a);
+
+		//blend locally (as blendSkeleton)
+		if (b && blend_weights[i] > 0.0f)
+		{
+			float w = blend_weights[i];
+			uint8 layer = blend_layers[i];
+			for (int j = 0; j < skeleton.num_bones; ++j)
+				local_b[j] = local_a[j];
+			b->sampleLocalMatrices(times_b[i], true, local_b);
+			for (int j = 0; j < skeleton.num_bones; ++j)
+			{
+				if (layer != 0xFF && !(skeleton.bones[j].layer & layer))
+					continue;
+				for (int k = 0; k < 16; ++k)
+					local_a[j].m[k] = lerp(local_a[j].m[k], local_b[j].m[k], w);
+			}
+		}
+
+		skeleton.computeGlobalMatrices(local_a, global_matrices);
+
+		//skinning palette
+		sRemap& remap = remaps[remap_indices[i]];
+		Matrix44* palette = &palettes[palette_offsets[i]];
+		for (int j = 0; j < remap.bones.size(); ++j)
+			palette[j] = remap.bones[j] == -1 ? remap.offsets[j] : remap.offsets[j] * global_matrices[remap.bones[j]];
+	}
+}
+
+std::map<std::string, VertexAnimation*> VertexAnimation::sLoaded;
+
+VertexAnimation::VertexAnimation()
+{
+	num_vertices = num_frames = 0;
+	fps = 30.0f;
+	width = rows_per_frame = 0;
+	positions_texture = NULL;
+	normals_texture = NULL;
+}
+
+VertexAnimation::~VertexAnimation()
+{
+	if (positions_texture)
+		delete positions_texture;
+	if (normals_texture)
+		delete normals_texture;
+}
+
+bool VertexAnimation::bake(Mesh* mesh, Animation* animation, float fps)
+{
+	assert(mesh && animation);
+	bool interleaved = mesh->interleaved.size() > 0;
+	int n = interleaved ? (int)mesh->interleaved.size() : (int)mesh->vertices.size();
+	if (!n || mesh->bones.size() != n || mesh->weights.size() != n || mesh->bones_info.empty())
+	{
+		std::cout << "[ERROR] VertexAnimation: the mesh must have bones and weights for every vertex" << std::endl;
+		return false;
+	}
+
+	num_vertices = n;
+	this->fps = fps;
+	num_frames = (int)(animation->duration * fps);
+	if (num_frames < 1)
+		num_frames = 1;
+	width = n < 2048 ? n : 2048;
+	rows_per_frame = (n + width - 1) / width;
+
+	//the palette of every frame from an animation system with only this instance
+	AnimationSystem system;
+	int instance = system.addInstance(mesh, animation);
+
+	std::vector<Vector3> frame_positions(num_frames * n);
+	std::vector<Vector3> frame_normals(num_frames * n);
+	min.set(1e10, 1e10, 1e10);
+	max.set(-1e10, -1e10, -1e10);
+	for (int f = 0; f < num_frames; ++f)
+	{
+		system.setTime(instance, f / fps);
+		system.updateRange(0, 1);
+		Matrix44* palette = system.getPalette(instance);
+
+		for (int i = 0; i < n; ++i)
+		{
+			//blend the bones that affect this vertex (as the skinning shader)
+			Matrix44 skin;
+			memset(skin.m, 0, sizeof(skin.m));
+			Vector4ub& bones = mesh->bones[i];
+			Vector4& weights = mesh->weights[i];
+			for (int k = 0; k < 16; ++k)
+				skin.m[k] = palette[bones.x].m[k] * weights.x + palette[bones.y].m[k] * weights.y + palette[bones.z].m[k] * weights.z + palette[bones.w].m[k] * weights.w;
+
+			Vector3 position = skin * (interleaved ? mesh->interleaved[i].vertex : mesh->vertices[i]);
+			Vector3 normal = skin.rotateVector(interleaved ? mesh->interleaved[i].normal : (mesh->normals.size() ? mesh->normals[i] : Vector3(0, 1, 0)));
+			frame_positions[f * n + i] = position;
+			frame_normals[f * n + i] = normal.normalize();
+			min.set(position.x < min.x ? position.x : min.x, position.y < min.y ? position.y : min.y, position.z < min.z ? position.z : min.z);
+			max.set(position.x > max.x ? position.x : max.x, position.y > max.y ? position.y : max.y, position.z > max.z ? position.z : max.z);
+		}
+	}
+
+	//quantize, the rows of every frame padded to the width
+	Vector3 size = max - min;
+	Vector3 inv_size(size.x ? 1.0 / size.x : 0.0, size.y ? 1.0 / size.y : 0.0, size.z ? 1.0 / size.z : 0.0);
+	int frame_texels = width * rows_per_frame;
+	positions.assign(num_frames * frame_texels * 4, 0);
+	normals.assign(num_frames * frame_texels * 4, 0);
+	for (int f = 0; f < num_frames; ++f)
+		for (int i = 0; i < n; ++i)
+		{
+			Vector3 p = (frame_positions[f * n + i] - min) * inv_size;
+			Vector3 N = frame_normals[f * n + i];
+			int texel = (f * frame_texels + i) * 4;
+			positions[texel] = (uint16)(clamp(p.x, 0.0f, 1.0f) * 65535.0f + 0.5f);
+			positions[texel + 1] = (uint16)(clamp(p.y, 0.0f, 1.0f) * 65535.0f + 0.5f);
+			positions[texel + 2] = (uint16)(clamp(p.z, 0.0f, 1.0f) * 65535.0f + 0.5f);
+			positions[texel + 3] = 65535;
+			normals[texel] = (uint8)(clamp(N.x * 0.5f + 0.5f, 0.0f, 1.0f) * 255.0f + 0.5f);
+			normals[texel + 1] = (uint8)(clamp(N.y * 0.5f + 0.5f, 0.0f, 1.0f) * 255.0f + 0.5f);
+			normals[texel + 2] = (uint8)(clamp(N.z * 0.5f + 0.5f, 0.0f, 1.0f) * 255.0f + 0.5f);
+			normals[texel + 3] = 255;
+		}
+
+	upload(&positions[0], &normals[0]);
+	return true;
+}
+
+void VertexAnimation::upload(const void* positions_data, const void* normals_data)
+{
+	if (positions_texture)
+		delete positions_texture;
+	if (normals_texture)
+		delete normals_texture;
+	positions_texture = new Texture(width, num_frames * rows_per_frame, GL_RGBA, GL_UNSIGNED_SHORT, false, (Uint8*)positions_data, GL_RGBA16);
+	normals_texture = new Texture(width, num_frames * rows_per_frame, GL_RGBA, GL_UNSIGNED_BYTE, false, (Uint8*)normals_data, GL_RGBA8);
+}
+
+struct sVATHeader {
+	int version;
+	int header_bytes;
+	int num_vertices;
+	int num_frames;
+	float fps;
+	int width;
+	int rows_per_frame;
+	Vector3 min;
+	Vector3 max;
+};
+
+bool VertexAnimation::save(const char* filename)
+{
+	assert(positions.size() && "only baked animations can be saved");
+	FILE* f = fopen(filename, "wb");
+	if (f == NULL)
+	{
+		std::cout << "[ERROR] cannot write VAT: " << filename << std::endl;
+		return false;
+	}
+
+	//watermark
+	fwrite("VATX", sizeof(char), 4, f);
+
+	sVATHeader header;
+	header.version = VAT_BIN_VERSION;
+	header.header_bytes = sizeof(header);
+	header.num_vertices = num_vertices;
+	header.num_frames = num_frames;
+	header.fps = fps;
+	header.width = width;
+	header.rows_per_frame = rows_per_frame;
+	header.min = min;
+	header.max = max;
+	fwrite((void*)&header, sizeof(sVATHeader), 1, f);
+
+	fwrite((void*)&positions[0], sizeof(uint16) * positions.size(), 1, f);
+	fwrite((void*)&normals[0], sizeof(uint8) * normals.size(), 1, f);
+	fclose(f);
+	return true;
+}
+
+bool VertexAnimation::load(const char* filename)
+{
+	size_t size = 0;
+	char* data = (char*)mapFile(filename, size);
+	if (!data)
+		return false;
+
+	sVATHeader header;
+	if (size < 4 + sizeof(sVATHeader) || memcmp(data, "VATX", 4) != 0)
+	{
+		std::cout << "[ERROR] loading VAT: invalid content: " << filename << std::endl;
+		unmapFile(data, size);
+		return false;
+	}
+	memcpy(&header, data + 4, sizeof(sVATHeader));
+	int texels = header.width * header.rows_per_frame * header.num_frames;
+	if (header.version != VAT_BIN_VERSION || header.header_bytes != sizeof(sVATHeader) || size != 4 + sizeof(sVATHeader) + texels * 4 * (sizeof(uint16) + sizeof(uint8)))
+	{
+		std::cout << "[WARN] loading VAT: old version: " << filename << std::endl;
+		unmapFile(data, size);
+		return false;
+	}
+
+	num_vertices = header.num_vertices;
+	num_frames = header.num_frames;
+	fps = header.fps;
+	width = header.width;
+	rows_per_frame = header.rows_per_frame;
+	min = header.min;
+	max = header.max;
+
+	//the textures are uploaded directly from the mapped file
+	char* pos = data + 4 + sizeof(sVATHeader);
+	upload(pos, pos + texels * 4 * sizeof(uint16));
+	unmapFile(data, size);
+	return true;
+}
+
+VertexAnimation* VertexAnimation::Get(const char* filename, Mesh* mesh, Animation* animation, float fps)
+{
+	assert(filename);
+	auto it = sLoaded.find(filename);
+	if (it != sLoaded.end())
+		return it->second;
+
+	double time = getTime();
+	std::cout << " + VAT loading: " << filename << " ... ";
+	VertexAnimation* vat = new VertexAnimation();
+	if (!vat->load(filename))
+	{
+		std::cout << "[Baking] ... ";
+		if (!mesh || !animation || !vat->bake(mesh, animation, fps))
+		{
+			delete vat;
+			return NULL;
+		}
+		vat->save(filename);
+		//not needed anymore, they are in the textures
+		vat->positions.clear();
+		vat->normals.clear();
+	}
+
+	std::cout << "[OK] Frames: " << vat->num_frames << " Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
+	sLoaded[filename] = vat;
+	return vat;
+}
@@ -1,10 +1,13 @@
 #pragma once
 
 #include "mesh.h"
+#include <atomic>
 
 class Camera;
+class Texture;
 
-#define ANIM_BIN_VERSION 3
+#define ANIM_BIN_VERSION 5
+#define VAT_BIN_VERSION 1
 
 //defined layers for every body
 enum BODY_LAYERS {
@@ -46,6 +49,8 @@ public:
 	Matrix44& getBoneMatrix(const char* name, bool local = true); //returns the local matrix of a bone
 	void applyTransformToBones(const char* root, Matrix44 transform); //given a bone name and matrix, it multiplies the matrix to the bone
 	void updateGlobalMatrices(); //updates the list of global matrices according to the local matrices
+	void computeGlobalMatrices(const Matrix44* local_matrices, Matrix44* global_matrices) const; //the same for any pose of this skeleton
+	void computeBoneRemap(Mesh* mesh, std::vector<int>& remap); //index in this skeleton of every bone of the mesh (-1 if missing)
 
 	void renderSkeleton(Camera* camera, Matrix44 model, Vector4 color = Vector4(0.5, 0, 0.5, 1), bool render_points = false); //renders the skeleton with lines
 	void computeFinalBoneMatrices(std::vector<Matrix44>& bones, Mesh* mesh); //fills the std::vector with the bones ready for the shader
@@ -67,13 +72,49 @@ public:
 	int num_keyframes;
 	int8 bones_map[128]; //maps from keyframe data index to bone
 
-	Matrix44* keyframes;
+	//keyframes compressed to 16 bytes per bone: translation, uniform scale and rotation (quaternion), every
+	//track quantized to 16 bits in its own range. Stored by track (SoA) with the bones rounded up to groups
+	//of 4, so assignTime decompresses and interpolates 4 bones at once
+	enum { TRACK_TX, TRACK_TY, TRACK_TZ, TRACK_QX, TRACK_QY, TRACK_QZ, TRACK_QW, TRACK_SCALE, NUM_TRACKS };
+	int num_lanes;	//num_animated_bones rounded up to 4
+	uint16* keyframes;	//num_keyframes * NUM_TRACKS * num_lanes, NULL when streamed from the file
+	float* ranges;	//min of every track and bone (NUM_TRACKS * num_lanes) followed by the step of every value (0 if constant)
+
+	//clips loaded from an ABIN are streamed: the file is mapped and the keyframes are decompressed by chunks
+	//of time when sampled. In the file the constant tracks are not stored and every chunk only keeps the keys
+	//needed to rebuild the rest by linear interpolation within max_error
+	enum { KEYS_PER_CHUNK = 32 };
+	struct sChunk {
+		std::atomic<uint16*> keys;	//KEYS_PER_CHUNK + 1 keyframes (the last one is the first of the next chunk), NULL if not resident
+		std::atomic<long> last_used;	//s_frame when it was sampled
+	};
+	int num_chunks;
+	sChunk* chunks;
+	uint32* chunk_offsets;	//num_chunks + 1, from chunks_data
+	const uint8* chunks_data;	//in the mapped file
+	void* mapped_data;
+	size_t mapped_size;
+
+	static float max_error;	//of the key reduction when writing, in the units of the track
+	static long s_frame;
 
 	Animation();
 	~Animation();	//we need the dtor to remove the keyframes memory
 
+	//compresses the keyframes from full matrices (num_keyframes * num_animated_bones)
+	void setKeyframes(const Matrix44* matrices);
+	//decompressed tracks of every bone interpolated between two keyframes, output is NUM_TRACKS * num_lanes
+	void sampleTracks(int keyframe, int keyframe2, float f, float* output) const;
+	//NUM_TRACKS * num_lanes quantized values, decompresses its chunk if needed (thread safe)
+	const uint16* getKeyframe(int keyframe) const;
+	const uint16* decompressChunk(int chunk) const;
+	//frees the chunks not sampled in the last frames, only when nobody is sampling
+	void releaseChunks(int max_frames);
+
 	//change the skeleton to the given pose according to time
 	void assignTime(float time, bool loop = true, bool interpolate = true, uint8 layers = 0xFF);
+	//the same without modifying the animation, only the animated bones in the layers are written (indexed by skeleton bone)
+	void sampleLocalMatrices(float time, bool loop, Matrix44* local_matrices, uint8 layers = 0xFF) const;
 
 	//storage
 	bool load(const char* filename);
@@ -83,8 +124,86 @@ public:
 
 	static std::map<std::string, Animation*> sAnimationsLoaded;
 	static Animation* Get(const char* filename);
+	//once per frame after sampling, so the memory depends on the clips being played
+	static void ReleaseUnusedChunks(int max_frames = 60);
 
 	//copy operator to copy the keyframes
 	void operator = (Animation* anim);
 };
 
+//Animates many characters at once. Every instance samples one animation (or blends two of them), computes the
+//hierarchy and the skinning palette of its mesh. The data of the instances is stored by component and the
+//instances are split between several threads
+class AnimationSystem {
+public:
+	//bones of a mesh mapped to the bones of a skeleton, computed once instead of searching them by name every frame
+	struct sRemap {
+		Mesh* mesh;
+		const Skeleton* skeleton;
+		std::vector<int> bones;
+		std::vector<Matrix44> offsets;	//bind_matrix * bind_pose of every bone
+	};
+
+	std::vector<Mesh*> meshes;
+	std::vector<Animation*> animations_a;
+	std::vector<Animation*> animations_b;	//NULL if not blending
+	std::vector<float> times_a;
+	std::vector<float> times_b;
+	std::vector<float> blend_weights;
+	std::vector<uint8> blend_layers;
+	std::vector<int> remap_indices;
+	std::vector<int> palette_offsets;	//where the palette of every instance starts
+	std::vector<Matrix44> palettes;	//ready for the shader (u_bones)
+	std::vector<sRemap> remaps;
+
+	int addInstance(Mesh* mesh, Animation* animation);
+	void setAnimation(int instance, Animation* a, Animation* b = NULL, float blend = 0.0f, uint8 layers = 0xFF);
+	void setTime(int instance, float time_a, float time_b = 0.0f);
+
+	//advances the time of every instance and computes their palettes
+	void update(float dt);
+	void updateRange(int start, int end);
+
+	Matrix44* getPalette(int instance) { return &palettes[palette_offsets[instance]]; }
+	int getPaletteSize(int instance) { return (int)meshes[instance]->bones_info.size(); }
+
+	int getRemap(Mesh* mesh, Animation* animation);
+};
+
+//An animation of a skinned mesh baked as the position and normal of every vertex in every frame, so it can be
+//played in the vertex shader without skeleton (for crowds). Vertex i of frame f is the texel
+//(i % width, f * rows_per_frame + i / width), positions are normalized inside the bounds of all the frames
+class VertexAnimation {
+public:
+	int num_vertices;
+	int num_frames;
+	float fps;
+	int width;
+	int rows_per_frame;
+	Vector3 min;
+	Vector3 max;
+
+	Texture* positions_texture;	//RGBA16
+	Texture* normals_texture;	//RGBA8, (normal + 1) / 2
+
+	//only while baking, to save them
+	std::vector<uint16> positions;
+	std::vector<uint8> normals;
+
+	VertexAnimation();
+	~VertexAnimation();
+
+	float getDuration() const { return num_frames / fps; }
+
+	//skins every frame in the cpu, the mesh must have bones and weights
+	bool bake(Mesh* mesh, Animation* animation, float fps = 30.0f);
+	void upload(const void* positions_data, const void* normals_data);
+
+	//storage
+	bool save(const char* filename);
+	bool load(const char* filename);
+
+	//loaded from the file or baked (and saved) if the file doesnt exist
+	static std::map<std::string, VertexAnimation*> sLoaded;
+	static VertexAnimation* Get(const char* filename, Mesh* mesh, Animation* animation, float fps = 30.0f);
+};
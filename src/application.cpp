@@ -83,8 +83,7 @@ Application::Application(int window_width, int window_height, SDL_Window* window
 			light->color = col;
 			light->intensity = 2.5;
 			light->name = "randomPoint" + std::to_string(counter);
-			scene->entities.push_back(light); light->scene = scene;
-			scene->lights.push_back((GTR::LightEntity*)light);
+			scene->addEntity(light);
 			counter++;
 		}
 	}
@@ -175,10 +174,17 @@ void Application::update(double seconds_elapsed)
 		}
 	}
 
+	//hot reload of the shaders when the atlas is saved
+	Shader::ReloadAtlasIfChanged();
+	Shader::FlushBinaryCache();
+
 	//move up or down the camera using Q and E
 	if (Input::isKeyPressed(SDL_SCANCODE_Q)) camera->moveGlobal(Vector3(0.0f, -1.0f, 0.0f) * speed);
 	if (Input::isKeyPressed(SDL_SCANCODE_E)) camera->moveGlobal(Vector3(0.0f, 1.0f, 0.0f) * speed);
 
+	//load the cells of the world around the camera and unload the far ones
+	scene->partition.update(scene, camera, seconds_elapsed);
+
 	//to navigate with the mouse fixed in the middle
 	SDL_ShowCursor(!mouse_locked);
 #ifndef SKIP_IMGUI
@@ -256,6 +262,7 @@ void Application::renderDebugGizmo()
 	ImGuiIO& io = ImGui::GetIO();
 	ImGuizmo::SetRect(0, 0, io.DisplaySize.x, io.DisplaySize.y);
 	ImGuizmo::Manipulate(camera->view_matrix.m, camera->projection_matrix.m, mCurrentGizmoOperation, mCurrentGizmoMode, matrix.m, NULL, useSnap ? &snap.x : NULL);
+	scene->updateEntity(selected_entity);
 #endif
 }
 
@@ -279,6 +286,11 @@ void Application::renderDebugGUI(void)
 		ImGui::TreePop();
 	}
 
+	if (scene->partition.enabled && ImGui::TreeNode(&scene->partition, "World Partition")) {
+		scene->partition.renderInMenu();
+		ImGui::TreePop();
+	}
+
 	//add info to the debug panel about the camera
 	if (ImGui::TreeNode(camera, "Camera")) {
 		camera->renderInMenu();
@@ -298,6 +310,7 @@ void Application::renderDebugGUI(void)
 		if (ImGui::TreeNode(entity, entity->name.c_str()))
 		{
 			entity->renderInMenu();
+			scene->updateEntity(entity);
 			ImGui::TreePop();
 		}
 
@@ -399,6 +412,5 @@ void Application::onResize(int width, int height)
 	camera->aspect =  width / (float)height;
 	window_width = width;
 	window_height = height;
-	renderer->resizeFBOs();
 }
 
@@ -3,11 +3,19 @@
 #include <cmath>
 #include <cassert>
 #include <algorithm>
+#include <cstring>
 
 #include "../utils.h"
+#include "../jobs.h"
 #include "hdre.h"
 
+#if defined(__F16C__) || defined(__AVX2__)
+	#include <immintrin.h>
+	#define HDRE_USE_F16C
+#endif
+
 std::map<std::string, HDRE*> HDRE::s_loaded_hdres;
+bool HDRE::save_cooked = false;
 
 HDRE::HDRE()
 {
@@ -24,6 +32,10 @@ HDRE::HDRE(const char* filename)
 void HDRE::init()
 {
     data = nullptr;
+    data_h = nullptr;
+    mapped_data = nullptr;
+    mapped_size = 0;
+    owns_data_h = false;
     width = height = 0;
     levels = N_MAX_LEVELS;
 
@@ -101,61 +113,79 @@ short* HDRE::getFaceh(int level, int face)
 }
 
 
+int HDRE::getLevelSize(int level)
+{
+	if (level == 0)
+		return width;
+	if (this->header.version > 2.0)
+		return width >> level;
+	return std::max(8, width >> level);
+}
+
+size_t HDRE::getDataSize()
+{
+	// Per channel & Per face
+	size_t dataSize = 0;
+	for (int i = 0; i < N_LEVELS; i++)
+	{
+		size_t w = getLevelSize(i);
+		dataSize += w * w * N_FACES * header.numChannels;
+	}
+	return dataSize;
+}
+
 bool HDRE::load(const char* filename)
 {
 	assert(filename);
 
-	FILE *f = fopen(filename,"rb");
-	if (f == nullptr)
+	//the file is mapped, faces point directly inside it so nothing is copied
+	size_t size = 0;
+	void* mapped = mapFile(filename, size);
+	if (mapped == nullptr)
 		return false;
 
-	sHDREHeader HDREHeader;
+	if (size < sizeof(sHDREHeader))
+	{
+		unmapFile(mapped, size);
+		return false;
+	}
 
-	fread(&HDREHeader, sizeof(sHDREHeader), 1, f);
+	sHDREHeader HDREHeader;
+	memcpy(&HDREHeader, mapped, sizeof(sHDREHeader));
 
-	if (HDREHeader.type != 3) {
+	if (HDREHeader.type != HDRE_TYPE_FLOAT && HDREHeader.type != HDRE_TYPE_HALF) {
         printf("HDRE Header has wrong type: %d\n", HDREHeader.type);
+        unmapFile(mapped, size);
         throw ("ArrayType not supported. Please export in Float32Array.");
     }
 
+    clean();
+    this->mapped_data = mapped;
+    this->mapped_size = size;
     this->header = HDREHeader;
 
-	int width = HDREHeader.width;
-	int height = HDREHeader.height;
-
-	this->width = width;
-	this->height = height;
+	this->width = HDREHeader.width;
+	this->height = HDREHeader.height;
 
-	int dataSize = 0;
-	int w = width;
-
-	// Get number of floats inside the HDRE
-	// Per channel & Per face
-	for (int i = 0; i < N_LEVELS; i++)
+	// Get number of values inside the HDRE
+	size_t dataSize = getDataSize();
+	size_t valueSize = HDREHeader.type == HDRE_TYPE_HALF ? sizeof(short) : sizeof(float);
+	if (HDREHeader.headerSize + dataSize * valueSize > size)
 	{
-		int mip_level = i + 1;
-		dataSize += w * w * N_FACES * HDREHeader.numChannels;
-
-		//w = std::max(8, (int)(width / pow(2.0, mip_level)));
-		w = fmax(8, (int)(width / pow(2.0, mip_level)));
-
-		if (this->header.version > 2.0)
-			w = (int)(width / pow(2.0, mip_level));
+		printf("HDRE file is truncated: %s\n", filename);
+		clean();
+		return false;
 	}
 
-	this->data = new float[dataSize];
-
-	fseek(f, HDREHeader.headerSize, SEEK_SET);
-
-	fread(this->data, sizeof(float) * dataSize, 1, f);
-	fclose(f);
+	char* pixels = (char*)mapped + HDREHeader.headerSize;
+	if (HDREHeader.type == HDRE_TYPE_HALF)
+		this->data_h = (short*)pixels;
+	else
+		this->data = (float*)pixels;
 
 	// get separated levels
 
-	w = width;
-	int mapOffset = 0;
-    int mapPrevOffset = 0;
-
+	int w = width;
 	int nFullMips = 0;
 	while (w)
     {
@@ -164,79 +194,153 @@ bool HDRE::load(const char* filename)
     }
 	assert(nFullMips <= N_MAX_LEVELS);
 	levels = nFullMips;
-	w = width;
     printf("Load %d mips of HDRE texture\n", nFullMips);
 
-    int i;
-    for (i = 0; i < N_LEVELS; i++)
+	size_t mapOffset = 0;
+    for (int i = 0; i < N_LEVELS; i++)
 	{
-		int mip_level = i + 1;
-		int faceSize = w * w * HDREHeader.numChannels;
-		int mapSize = faceSize * N_FACES;
-
-		int faceOffset = 0;
+		w = getLevelSize(i);
+		size_t faceSize = (size_t)w * w * HDREHeader.numChannels;
 
 		for (int j = 0; j < N_FACES; j++)
 		{
-			// allocate memory
-			this->pixels_f[i][j] = new float[faceSize];
+			if (this->data)
+				this->pixels_f[i][j] = this->data + mapOffset;
+			else
+				this->pixels_h[i][j] = this->data_h + mapOffset;
+			mapOffset += faceSize;
+		}
+	}
+	std::cout << std::endl << " + '" << filename << "' (v" << this->header.version << ") loaded successfully" << std::endl;
+	return true;
+}
 
-			// set data
-			for (int k = 0; k < faceSize; k++) {
+struct sHalfConversion {
+	const float* src;
+	short* dst;
+};
 
-				float value = this->data[mapOffset + faceOffset + k];
+static void convertRangeToHalf(void* data, int start, int end)
+{
+	sHalfConversion* conversion = (sHalfConversion*)data;
+	convertFloatsToHalf(conversion->src + start, conversion->dst + start, end - start);
+}
 
-				this->pixels_f[i][j][k] = value;
-			}
+bool HDRE::convertToHalf()
+{
+	if (this->data_h)
+		return true;
+	if (!this->data)
+		return false;
 
-			// update face offset
-			faceOffset += faceSize;
-		}
+	size_t dataSize = getDataSize();
+	this->data_h = new short[dataSize];
+	this->owns_data_h = true;
+	//all the levels and faces are consecutive, converted by blocks in parallel
+	sHalfConversion conversion;
+	conversion.src = this->data;
+	conversion.dst = this->data_h;
+	JobSystem::parallelFor(convertRangeToHalf, &conversion, (int)dataSize, 1 << 18);
+
+	//same layout as the float data
+	for (int i = 0; i < N_LEVELS; i++)
+		for (int j = 0; j < N_FACES; j++)
+			this->pixels_h[i][j] = this->data_h + (this->pixels_f[i][j] - this->data);
+	return true;
+}
 
-		// update level offset
-		mapPrevOffset = mapOffset;
-		mapOffset += mapSize;
-		// reassign width for next level
-		//w = std::max(8, (int)(width / pow(2.0, mip_level)));
-		w = fmax(8, (int)(width / pow(2.0, mip_level)));
+bool HDRE::saveHalf(const char* filename)
+{
+	if (!convertToHalf())
+		return false;
 
-		if (this->header.version > 2.0)
-			w = (int)(width / pow(2.0, mip_level));
-	}
-	std::cout << std::endl << " + '" << filename << "' (v" << this->header.version << ") loaded successfully" << std::endl;
+	FILE* f = fopen(filename, "wb");
+	if (f == nullptr)
+		return false;
+
+	sHDREHeader cooked = this->header;
+	cooked.type = HDRE_TYPE_HALF;
+	cooked.bitsPerChannel = 16;
+	cooked.headerSize = sizeof(sHDREHeader);
+
+	fwrite(&cooked, sizeof(sHDREHeader), 1, f);
+	fwrite(this->data_h, sizeof(short), getDataSize(), f);
+	fclose(f);
+	std::cout << " + Cooked HDRE saved: " << filename << std::endl;
 	return true;
 }
 
 bool HDRE::clean()
 {
-	try
+	//faces point inside the data blocks, nothing to delete per face
+	if (owns_data_h)
+		delete[] data_h;
+	unmapFile(mapped_data, mapped_size);
+
+	data = nullptr;
+	data_h = nullptr;
+	mapped_data = nullptr;
+	mapped_size = 0;
+	owns_data_h = false;
+
+	for (int j = 0; j < N_FACES; j++)
 	{
-		if (data)
-			delete data;
-
-        for (int j = 0; j < N_FACES; j++)
-        {
-            for (int i = 0; i < N_LEVELS; i++)
-            {
-				delete pixels_h[i][j];
-				pixels_h[i][j] = nullptr;
-			}
-            for (int i = 0; i < N_LEVELS; i++)
-            {
-                delete pixels_f[i][j];
-                pixels_f[i][j] = nullptr;
-            }
+		for (int i = 0; i < N_MAX_LEVELS; i++)
+		{
+			pixels_h[i][j] = nullptr;
+			pixels_f[i][j] = nullptr;
 		}
-
-		return true;
 	}
-	catch (const std::exception&)
+
+	return true;
+}
+
+static inline unsigned short floatToHalf(float value)
+{
+	unsigned int f;
+	memcpy(&f, &value, sizeof(float));
+	unsigned int sign = (f >> 16) & 0x8000;
+	int exponent = (int)((f >> 23) & 0xff) - 127 + 15;
+	unsigned int mantissa = f & 0x007fffff;
+
+	if (((f >> 23) & 0xff) == 0xff) //inf or nan
+		return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+	if (exponent >= 31) //too big, clamp to inf
+		return sign | 0x7c00;
+	if (exponent <= 0) //denormal or zero
 	{
-		std::cout << std::endl << "Error cleaning" << std::endl;
-		return false;
+		if (exponent < -10)
+			return sign;
+		mantissa |= 0x00800000;
+		int shift = 14 - exponent;
+		unsigned int half_mantissa = mantissa >> shift;
+		unsigned int rest = mantissa & ((1u << shift) - 1);
+		unsigned int halfway = 1u << (shift - 1);
+		if (rest > halfway || (rest == halfway && (half_mantissa & 1))) //round to nearest even
+			half_mantissa++;
+		return sign | half_mantissa;
 	}
 
-	return false;
+	unsigned int half = sign | (exponent << 10) | (mantissa >> 13);
+	unsigned int rest = mantissa & 0x1fff;
+	if (rest > 0x1000 || (rest == 0x1000 && (half & 1))) //round to nearest even, the carry goes to the exponent
+		half++;
+	return half;
+}
+
+void convertFloatsToHalf(const float* src, short* dst, size_t num)
+{
+	size_t i = 0;
+#ifdef HDRE_USE_F16C
+	for (; i + 8 <= num; i += 8)
+	{
+		__m256 v = _mm256_loadu_ps(src + i);
+		__m128i h = _mm256_cvtps_ph(v, _MM_FROUND_TO_NEAREST_INT);
+		_mm_storeu_si128((__m128i*)(dst + i), h);
+	}
+#endif
+	for (; i < num; ++i)
+		dst[i] = (short)floatToHalf(src[i]);
 }
 
 HDRE* HDRE::Get(const char* filename)
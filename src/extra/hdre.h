@@ -4,6 +4,10 @@
 #define N_LEVELS 6
 #define N_FACES 6
 
+//array types stored in the header
+#define HDRE_TYPE_HALF 2	//Uint16Array with half floats (cooked files)
+#define HDRE_TYPE_FLOAT 3	//Float32Array
+
 #include <string>
 #include <map>
 
@@ -48,7 +52,12 @@ class HDRE {
 private:
 
     std::string filename;
-	float* data; // only f32 now
+	float* data; // f32 data, points inside the mapped file
+	short* data_h; // f16 data, inside the mapped file (cooked) or converted by us
+
+	void* mapped_data; // the whole file mapped in memory
+	size_t mapped_size;
+	bool owns_data_h;
 
     float* pixels_f[N_MAX_LEVELS][N_FACES]; // Xpos, Xneg, Ypos, Yneg, Zpos, Zneg
     short* pixels_h[N_MAX_LEVELS][N_FACES]; // Xpos, Xneg, Ypos, Yneg, Zpos, Zneg
@@ -56,9 +65,12 @@ private:
 
 	bool clean();
 	void init();
+	int getLevelSize(int level);	// face width of a level
+	size_t getDataSize();			// number of values stored for all the levels
 
 public:
 	static std::map<std::string, HDRE*> s_loaded_hdres;
+	static bool save_cooked; //write the .half version when converting
 
 	sHDREHeader header;
 	int width;
@@ -72,6 +84,11 @@ public:
 	bool load(const char* filename);
 	//bool load(void* data, int size);
 
+	//converts the f32 faces to f16 (SIMD if F16C is available), halves the upload size
+	bool convertToHalf();
+	//writes a cooked version that stores the half floats directly
+	bool saveHalf(const char* filename);
+
 	// useful methods
 	float getMaxLuminance() { return this->header.maxLuminance; };
 	float* getSHCoeffs()
@@ -96,3 +113,6 @@ public:
 
 	static HDRE* Get(const char* filename);
 };
+
+//float to half float conversion, used by HDRE::convertToHalf
+void convertFloatsToHalf(const float* src, short* dst, size_t num);
@@ -51,7 +51,7 @@ void FBO::freeTextures()
 	owns_textures = false;
 }
 
-bool FBO::create( int width, int height, int num_textures, int format, int type, bool use_depth_texture)
+bool FBO::create( int width, int height, int num_textures, int format, int type, bool use_depth_texture, bool full_precision)
 {
 	assert(glGetError() == GL_NO_ERROR);
 	assert(width && height);
@@ -60,10 +60,12 @@ bool FBO::create( int width, int height, int num_textures, int format, int type,
 
 	num_color_textures = num_textures;
 
+	unsigned int internal_format = full_precision ? 0 : Texture::getTargetInternalFormat(format, type);
+
 	std::vector<Texture*> textures(4);
 	for (int i = 0; i < num_textures; ++i)
 	{
-		Texture* colortex = textures[i] = new Texture(width, height, format, type, false); //,NULL, format == GL_RGBA ? GL_RGBA8 : GL_RGB8 
+		Texture* colortex = textures[i] = new Texture(width, height, format, type, false, NULL, internal_format); //,NULL, format == GL_RGBA ? GL_RGBA8 : GL_RGB8 
 		glBindTexture(colortex->texture_type, colortex->texture_id);	//we activate this id to tell opengl we are going to use this texture
 		glTexParameteri(colortex->texture_type, GL_TEXTURE_MAG_FILTER, GL_NEAREST);	//set the min filter
 		glTexParameteri(colortex->texture_type, GL_TEXTURE_MIN_FILTER, GL_NEAREST);   //set the mag filter
@@ -80,6 +82,33 @@ bool FBO::create( int width, int height, int num_textures, int format, int type,
 	return setTextures(textures, depth_texture);
 }
 
+bool FBO::create(int width, int height, int num_textures, const int* formats, const int* types, const int* internal_formats, bool use_depth_texture)
+{
+	assert(glGetError() == GL_NO_ERROR);
+	assert(width && height);
+	assert(num_textures > 0 && num_textures < 5); //too many
+	freeTextures();
+
+	num_color_textures = num_textures;
+
+	std::vector<Texture*> textures(num_textures);
+	for (int i = 0; i < num_textures; ++i)
+	{
+		Texture* colortex = textures[i] = new Texture(width, height, formats[i], types[i], false, NULL, internal_formats[i]);
+		glBindTexture(colortex->texture_type, colortex->texture_id);
+		glTexParameteri(colortex->texture_type, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(colortex->texture_type, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(colortex->texture_type, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(colortex->texture_type, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	}
+
+	Texture* depth_texture = NULL;
+	if (use_depth_texture)
+		depth_texture = new Texture(width, height, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, false);
+	owns_textures = true;
+	return setTextures(textures, depth_texture, -1, false);
+}
+
 bool FBO::setTexture(Texture* texture, int cubemap_face )
 {
 	std::vector<Texture*> textures;
@@ -93,7 +122,7 @@ bool FBO::setTexture(Texture* texture, int cubemap_face )
 	return true;
 }
 
-bool FBO::setTextures(std::vector<Texture*> textures, Texture* depth_texture, int cubemap_face)
+bool FBO::setTextures(std::vector<Texture*> textures, Texture* depth_texture, int cubemap_face, bool same_format)
 {
 	assert(textures.size() >= 0 && textures.size() <= 4);
 	assert(glGetError() == GL_NO_ERROR);
@@ -142,7 +171,7 @@ bool FBO::setTextures(std::vector<Texture*> textures, Texture* depth_texture, in
 	{
 		Texture* texture = i < textures.size() ? textures[i] : NULL;
 		assert(!texture || (texture->width == width && texture->height == height)); //incorrect size, textures must have same size
-		assert(!texture || (texture->type == type && texture->format == format)); //incorrect texture format
+		assert(!texture || !same_format || (texture->type == type && texture->format == format)); //incorrect texture format
 
 		if (texture)
 		{
@@ -24,9 +24,13 @@ public:
 	FBO();
 	~FBO();
 
-	bool create(int width, int height, int num_textures = 1, int format = GL_RGB, int type = GL_UNSIGNED_BYTE, bool use_depth_texture = true );
+	//float targets use the compact formats of Texture::getTargetInternalFormat unless full_precision is set
+	bool create(int width, int height, int num_textures = 1, int format = GL_RGB, int type = GL_UNSIGNED_BYTE, bool use_depth_texture = true, bool full_precision = false );
+	//every texture with its own format, type and internal format (GL_RGB10_A2, GL_R11F_G11F_B10F...)
+	bool create(int width, int height, int num_textures, const int* formats, const int* types, const int* internal_formats, bool use_depth_texture = true);
 	bool setTexture(Texture* texture, int cubemap_face = -1);
-	bool setTextures(std::vector<Texture*> textures, Texture* depth = NULL, int cubemap_face = -1);
+	//same_format: all the textures must have the format and type of the first one (checked in debug)
+	bool setTextures(std::vector<Texture*> textures, Texture* depth = NULL, int cubemap_face = -1, bool same_format = true);
 	bool setDepthOnly(int width, int height); //use this for shadowmaps
 	
 	void bind();
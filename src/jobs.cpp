@@ -0,0 +1,329 @@
+#include "jobs.h"
+
+#include <cassert>
+#include <iostream>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+struct sJobQueue {
+	std::mutex mutex;
+	std::deque<sJob> jobs;
+};
+
+static std::vector<sJobQueue*> queues;	//0 is the main thread, then one per worker
+static std::vector<std::thread> workers;
+static std::atomic<bool> running(false);
+static std::atomic<int> num_pending(0);	//in all the queues
+static std::mutex sleep_mutex;
+static std::condition_variable sleep_condition;
+static thread_local int thread_index = 0;	//the threads that are not workers use the queue of the main thread
+static std::thread::id main_thread_id;	//the one that called Init, the only one that can use GL
+
+//jobs whose dependency is not done yet, out of the queues so the workers can sleep meanwhile
+static std::mutex blocked_mutex;
+static std::vector<sJob> blocked_jobs;
+
+static sJobQueue main_thread_jobs;	//GL work
+
+static char* frame_memory = NULL;
+static size_t frame_memory_size = 0;
+static std::atomic<size_t> frame_memory_used(0);
+static std::mutex frame_overflow_mutex;
+static std::vector<char*> frame_overflow;	//allocated when the frame memory is full, freed in beginFrame
+
+//before Init everything runs in the thread that calls it
+static bool isMainThread()
+{
+	return !queues.size() || std::this_thread::get_id() == main_thread_id;
+}
+
+static bool isReady(const sJob& job)
+{
+	return !job.dependency || job.dependency->isDone();
+}
+
+static void pushJob(const sJob& job)
+{
+	sJobQueue* queue = queues[thread_index];
+	{
+		std::lock_guard<std::mutex> lock(queue->mutex);
+		queue->jobs.push_back(job);
+	}
+	num_pending++;
+
+	//locked so a worker cannot go to sleep between checking num_pending and waiting
+	{
+		std::lock_guard<std::mutex> lock(sleep_mutex);
+	}
+	sleep_condition.notify_one();
+}
+
+//queues the blocked jobs that can start now
+static void releaseBlockedJobs()
+{
+	std::vector<sJob> ready;
+	{
+		std::lock_guard<std::mutex> lock(blocked_mutex);
+		for (int i = 0; i < blocked_jobs.size(); ++i)
+		{
+			if (!isReady(blocked_jobs[i]))
+				continue;
+			ready.push_back(blocked_jobs[i]);
+			blocked_jobs.erase(blocked_jobs.begin() + i);
+			--i;
+		}
+	}
+	for (int i = 0; i < ready.size(); ++i)
+		pushJob(ready[i]);
+}
+
+static void executeJob(const sJob& job)
+{
+	job.function(job.data, job.start, job.end);
+	if (job.counter && --job.counter->value == 0)
+		releaseBlockedJobs();
+}
+
+//the newest of the own queue, its data is probably in the cache, or the oldest of the others
+static bool popJob(sJob& job)
+{
+	int num_queues = queues.size();
+	for (int i = 0; i < num_queues; ++i)
+	{
+		sJobQueue* queue = queues[(thread_index + i) % num_queues];
+		std::lock_guard<std::mutex> lock(queue->mutex);
+		int num_jobs = queue->jobs.size();
+		for (int k = 0; k < num_jobs; ++k)
+		{
+			int index = i == 0 ? num_jobs - 1 - k : k;
+			if (!isReady(queue->jobs[index]))
+				continue;
+			job = queue->jobs[index];
+			queue->jobs.erase(queue->jobs.begin() + index);
+			num_pending--;
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool popMainThreadJob(sJob& job)
+{
+	std::lock_guard<std::mutex> lock(main_thread_jobs.mutex);
+	for (int k = 0; k < main_thread_jobs.jobs.size(); ++k)
+	{
+		if (!isReady(main_thread_jobs.jobs[k]))
+			continue;
+		job = main_thread_jobs.jobs[k];
+		main_thread_jobs.jobs.erase(main_thread_jobs.jobs.begin() + k);
+		return true;
+	}
+	return false;
+}
+
+static void workerLoop(int index)
+{
+	thread_index = index;
+	while (running)
+	{
+		sJob job;
+		if (popJob(job))
+		{
+			executeJob(job);
+			continue;
+		}
+
+		//another thread took the job meanwhile, the blocked ones are not counted
+		if (num_pending.load() > 0)
+		{
+			std::this_thread::yield();
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock(sleep_mutex);
+		if (running && num_pending.load() == 0)
+			sleep_condition.wait(lock);
+	}
+}
+
+void JobSystem::Init(int num_workers, size_t frame_memory_bytes)
+{
+	assert(!running && "already initialized");
+	if (num_workers <= 0)
+		num_workers = (int)std::thread::hardware_concurrency() - 1;
+	if (num_workers < 0)
+		num_workers = 0;
+
+	frame_memory = new char[frame_memory_bytes];
+	frame_memory_size = frame_memory_bytes;
+	frame_memory_used.store(0);
+
+	main_thread_id = std::this_thread::get_id();
+	running = true;
+	for (int i = 0; i <= num_workers; ++i)
+		queues.push_back(new sJobQueue());
+	for (int i = 1; i <= num_workers; ++i)
+		workers.push_back(std::thread(workerLoop, i));
+
+	std::cout << " + Job system: " << num_workers << " workers" << std::endl;
+}
+
+void JobSystem::Shutdown()
+{
+	{
+		std::lock_guard<std::mutex> lock(sleep_mutex);
+		running = false;
+	}
+	sleep_condition.notify_all();
+	for (int i = 0; i < workers.size(); ++i)
+		workers[i].join();
+	workers.clear();
+
+	for (int i = 0; i < queues.size(); ++i)
+		delete queues[i];
+	queues.clear();
+	assert(blocked_jobs.empty() && "jobs waiting for a dependency that never finished");
+	blocked_jobs.clear();
+
+	beginFrame();
+	delete[] frame_memory;
+	frame_memory = NULL;
+	frame_memory_size = 0;
+}
+
+int JobSystem::getNumThreads()
+{
+	return queues.size() ? (int)queues.size() : 1;
+}
+
+void JobSystem::run(JobFunction function, void* data, int start, int end, JobCounter* counter, JobCounter* dependency)
+{
+	sJob job;
+	job.function = function;
+	job.data = data;
+	job.start = start;
+	job.end = end;
+	job.counter = counter;
+	job.dependency = dependency;
+
+	//not initialized, everything runs in order in this thread
+	if (!queues.size())
+	{
+		assert(isReady(job) && "the dependency is not done and there are no workers");
+		function(data, start, end);
+		return;
+	}
+
+	if (counter)
+		counter->value++;
+
+	//checked with the lock, releaseBlockedJobs takes it after the dependency is done
+	if (dependency)
+	{
+		std::lock_guard<std::mutex> lock(blocked_mutex);
+		if (!isReady(job))
+		{
+			blocked_jobs.push_back(job);
+			return;
+		}
+	}
+	pushJob(job);
+}
+
+void JobSystem::parallelForAsync(JobFunction function, void* data, int count, int batch_size, JobCounter* counter, JobCounter* dependency)
+{
+	if (batch_size <= 0)
+		batch_size = (count + getNumThreads() - 1) / getNumThreads();
+	for (int start = 0; start < count; start += batch_size)
+		run(function, data, start, start + batch_size < count ? start + batch_size : count, counter, dependency);
+}
+
+void JobSystem::parallelFor(JobFunction function, void* data, int count, int batch_size)
+{
+	if (count <= 0)
+		return;
+	if (batch_size <= 0)
+		batch_size = (count + getNumThreads() - 1) / getNumThreads();
+
+	//a single range is not worth a job
+	if (batch_size >= count || !queues.size())
+	{
+		for (int start = 0; start < count; start += batch_size)
+			function(data, start, start + batch_size < count ? start + batch_size : count);
+		return;
+	}
+
+	JobCounter counter;
+	for (int start = batch_size; start < count; start += batch_size)
+		run(function, data, start, start + batch_size < count ? start + batch_size : count, &counter);
+	function(data, 0, batch_size);
+	wait(&counter);
+}
+
+void JobSystem::wait(JobCounter* counter)
+{
+	assert(counter);
+	while (!counter->isDone())
+	{
+		sJob job;
+		if (popJob(job))
+			executeJob(job);
+		else if (isMainThread() && popMainThreadJob(job))	//a job could be waiting for GL work
+			executeJob(job);
+		else
+			std::this_thread::yield();
+	}
+}
+
+void JobSystem::runOnMainThread(JobFunction function, void* data, int start, int end, JobCounter* counter)
+{
+	sJob job;
+	job.function = function;
+	job.data = data;
+	job.start = start;
+	job.end = end;
+	job.counter = counter;
+	job.dependency = NULL;
+
+	if (counter)
+		counter->value++;
+	std::lock_guard<std::mutex> lock(main_thread_jobs.mutex);
+	main_thread_jobs.jobs.push_back(job);
+}
+
+void JobSystem::runMainThreadJobs()
+{
+	assert(isMainThread());
+	sJob job;
+	while (popMainThreadJob(job))
+		executeJob(job);
+}
+
+void* JobSystem::frameAlloc(size_t size)
+{
+	//aligned for any type, also SIMD
+	size = (size + 15) & ~(size_t)15;
+	size_t offset = frame_memory_used.fetch_add(size);
+	if (offset + size <= frame_memory_size)
+		return frame_memory + offset;
+
+	//full, still works but the frame memory should be larger
+	std::lock_guard<std::mutex> lock(frame_overflow_mutex);
+	if (frame_overflow.empty())
+		std::cout << "[WARN] Job system: frame memory full (" << frame_memory_size / 1024 << "KB)" << std::endl;
+	char* block = new char[size];
+	frame_overflow.push_back(block);
+	return block;
+}
+
+void JobSystem::beginFrame()
+{
+	frame_memory_used.store(0);
+	std::lock_guard<std::mutex> lock(frame_overflow_mutex);
+	for (int i = 0; i < frame_overflow.size(); ++i)
+		delete[] frame_overflow[i];
+	frame_overflow.clear();
+}
@@ -0,0 +1,58 @@
+/*  Job system: one worker thread per core, each one with its own queue. Workers take the newest jobs of their queue
+	and, when it is empty, steal the oldest ones from the others. The thread waiting for a job runs jobs meanwhile.
+	GL can only be used from the main thread, so GL work goes to a separate queue run by the main loop.
+*/
+
+#ifndef JOBS_H
+#define JOBS_H
+
+#include <atomic>
+#include <cstddef>
+
+//a job works on the range [start, end) of whatever data points to
+typedef void (*JobFunction)(void* data, int start, int end);
+
+//jobs not finished yet: incremented when they are added and decremented when they finish.
+//wait for it or use it as the dependency of other jobs
+class JobCounter {
+public:
+	std::atomic<int> value;
+	JobCounter() { value.store(0); }
+	bool isDone() const { return value.load() == 0; }
+};
+
+struct sJob {
+	JobFunction function;
+	void* data;
+	int start;
+	int end;
+	JobCounter* counter;	//can be NULL
+	JobCounter* dependency;	//it does not start until this one is done, can be NULL
+};
+
+class JobSystem {
+public:
+	//0 workers: one per core besides the main thread
+	static void Init(int num_workers = 0, size_t frame_memory_size = 16 * 1024 * 1024);
+	static void Shutdown();
+	static int getNumThreads();	//workers and main thread
+
+	static void run(JobFunction function, void* data, int start = 0, int end = 0, JobCounter* counter = NULL, JobCounter* dependency = NULL);
+	//splits [0, count) in ranges of batch_size, one range per thread if 0
+	static void parallelForAsync(JobFunction function, void* data, int count, int batch_size, JobCounter* counter, JobCounter* dependency = NULL);
+	//the same, but this thread does the first range and waits for the rest
+	static void parallelFor(JobFunction function, void* data, int count, int batch_size = 0);
+	//runs other jobs until it is done
+	static void wait(JobCounter* counter);
+
+	//from any thread, run by the main thread in runMainThreadJobs (once per frame) or while it waits
+	static void runOnMainThread(JobFunction function, void* data, int start = 0, int end = 0, JobCounter* counter = NULL);
+	static void runMainThreadJobs();
+
+	//memory for the jobs of one frame, it is not freed, beginFrame reuses all of it
+	static void* frameAlloc(size_t size);
+	template<typename T> static T* frameAlloc(int count) { return (T*)frameAlloc(sizeof(T) * count); }
+	static void beginFrame();	//main thread, when no job uses the memory of the last frame
+};
+
+#endif
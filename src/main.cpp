@@ -15,6 +15,8 @@
 #include "utils.h"
 #include "input.h"
 #include "application.h"
+#include "jobs.h"
+#include "shader.h"
 
 #include <iostream> //to output
 
@@ -127,6 +129,10 @@ void mainLoop(SDL_Window* window)
 
 	while (!app->must_exit)
 	{
+		//the frame memory of the jobs is reused, and the GL work they queued is done
+		JobSystem::beginFrame();
+		JobSystem::runMainThreadJobs();
+
 		//render frame
 		app->render();
 		if (app->render_gui)
@@ -244,6 +250,9 @@ int main(int argc, char **argv)
 
 	Input::init(window);
 
+	//workers for the jobs, before anything can use them
+	JobSystem::Init();
+
 	//launch the application (app is a global variable)
 	app = new Application(window_width, window_height, window);
 
@@ -258,6 +267,9 @@ int main(int argc, char **argv)
 	ImGui::DestroyContext();
 	#endif
 
+	JobSystem::Shutdown();
+	Shader::FlushBinaryCache(true);
+
 	SDL_GL_DeleteContext(glcontext);
 	SDL_DestroyWindow(window);
 	SDL_Quit();
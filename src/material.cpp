@@ -7,6 +7,12 @@
 using namespace GTR;
 
 std::map<std::string, Material*> Material::sMaterials;
+std::vector<TexturePool*> Material::sTexturePools;
+std::vector<Material*> Material::sPooledMaterials;
+GLuint Material::sMaterialsUBO = 0;
+
+//pools bound in the current pooled pass, to skip binding them again
+static TexturePool* sBoundPools[NUM_POOL_CHANNELS];
 
 Material* Material::Get(const char* name)
 {
@@ -38,6 +44,9 @@ Material::~Material()
 		if (it != sMaterials.end())
 			sMaterials.erase(it);
 	}
+
+	if (pool_id != -1)
+		sPooledMaterials[pool_id] = NULL;
 }
 
 void Material::Release()
@@ -55,6 +64,7 @@ void Material::Release()
 		delete m;
 	}
 	sMaterials.clear();
+	ReleaseTexturePools();
 }
 
 
@@ -74,6 +84,8 @@ void Material::renderInMenu()
 		ImGui::Image((void*)(intptr_t)color_texture.texture->texture_id, ImVec2(w, w * aspect));
 		ImGui::TreePop();
 	}
+	if (pool_id != -1)
+		updatePooledData();
 #endif
 }
 
@@ -83,8 +95,8 @@ void GTR::Material::uploadToShader(Shader* shader, bool apply_linear_correction,
 	if (apply_linear_correction)
 	{
 		final_color.x = pow(color.x, gamma);
-		final_color.y = pow(color.x, gamma);
-		final_color.z = pow(color.y, gamma);
+		final_color.y = pow(color.y, gamma);
+		final_color.z = pow(color.z, gamma);
 		final_color.w = pow(color.w, gamma);
 	}
 	//Color
@@ -140,3 +152,198 @@ void GTR::Material::uploadToShader(Shader* shader, bool apply_linear_correction,
 	//this is used to say which is the alpha threshold to what we should not paint a pixel on the screen (to cut polygons according to texture alpha)
 	shader->setUniform("u_alpha_cutoff", alpha_mode == GTR::eAlphaMode::MASK ? alpha_cutoff : 0);
 }
+
+TexturePool::~TexturePool()
+{
+	if (texture_array)
+		delete texture_array;
+}
+
+int TexturePool::getLayer(Texture* texture)
+{
+	for (int i = 0; i < textures.size(); ++i)
+		if (textures[i] == texture)
+			return i;
+	return -1;
+}
+
+void TexturePool::build()
+{
+	assert(textures.size() && "empty pool");
+
+	if (!texture_array)
+		texture_array = new Texture();
+	texture_array->createArray(width, height, textures.size(), format, GL_UNSIGNED_BYTE, true);
+
+	for (int i = 0; i < textures.size(); ++i)
+		textures[i]->copyToLayer(texture_array, i);
+
+	if (texture_array->mipmaps)
+		texture_array->generateMipmaps();
+}
+
+//only plain 2D textures of 8 bits can be copied to a pool
+static bool canBePooled(Texture* texture)
+{
+	return texture && texture->texture_type == GL_TEXTURE_2D && texture->type == GL_UNSIGNED_BYTE && texture->texture_id &&
+		(texture->format == GL_RGB || texture->format == GL_RGBA);
+}
+
+void Material::BuildTexturePools(std::vector<Material*>& materials)
+{
+	ReleaseTexturePools();
+
+	GLint max_layers = 256;
+	glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &max_layers);
+
+	for (int i = 0; i < materials.size(); ++i)
+	{
+		Material* material = materials[i];
+		if (material->pool_id != -1) //repeated
+			continue;
+		if (sPooledMaterials.size() >= MAX_POOLED_MATERIALS)
+		{
+			std::cout << "[WARN] Too many materials for the pools, the rest will use the old path" << std::endl;
+			break;
+		}
+
+		//a texture that cannot be pooled would be missing in the pooled shader, so the whole material uses the old path
+		bool poolable = true;
+		for (int j = 0; j < NUM_POOL_CHANNELS; ++j)
+		{
+			Texture* texture = material->getPoolTexture((ePoolChannel)j);
+			if (texture && !canBePooled(texture))
+				poolable = false;
+		}
+		if (!poolable)
+			continue;
+
+		for (int j = 0; j < NUM_POOL_CHANNELS; ++j)
+		{
+			material->pools[j] = NULL;
+			material->layers[j] = -1;
+
+			Texture* texture = material->getPoolTexture((ePoolChannel)j);
+			if (!texture)
+				continue;
+
+			//find a pool with the same size and format and space left
+			TexturePool* pool = NULL;
+			for (int k = 0; k < sTexturePools.size(); ++k)
+			{
+				TexturePool* p = sTexturePools[k];
+				if (p->width == (int)texture->width && p->height == (int)texture->height && p->format == texture->format &&
+					(p->getLayer(texture) != -1 || p->textures.size() < max_layers))
+				{
+					pool = p;
+					break;
+				}
+			}
+			if (!pool)
+			{
+				pool = new TexturePool((int)texture->width, (int)texture->height, texture->format);
+				sTexturePools.push_back(pool);
+			}
+
+			int layer = pool->getLayer(texture);
+			if (layer == -1)
+			{
+				layer = pool->textures.size();
+				pool->textures.push_back(texture);
+			}
+			material->pools[j] = pool;
+			material->layers[j] = layer;
+		}
+
+		material->pool_id = sPooledMaterials.size();
+		sPooledMaterials.push_back(material);
+	}
+
+	for (int i = 0; i < sTexturePools.size(); ++i)
+		sTexturePools[i]->build();
+
+	//the buffer always has room for all the materials so new data can be uploaded without resizing it
+	if (sMaterialsUBO == 0)
+	{
+		glGenBuffers(1, &sMaterialsUBO);
+		glBindBuffer(GL_UNIFORM_BUFFER, sMaterialsUBO);
+		glBufferData(GL_UNIFORM_BUFFER, sizeof(sMaterialData) * MAX_POOLED_MATERIALS, NULL, GL_DYNAMIC_DRAW);
+		glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	}
+
+	for (int i = 0; i < sPooledMaterials.size(); ++i)
+		sPooledMaterials[i]->updatePooledData();
+
+	std::cout << " + Texture pools: " << sPooledMaterials.size() << " materials in " << sTexturePools.size() << " pools" << std::endl;
+}
+
+void Material::ReleaseTexturePools()
+{
+	for (int i = 0; i < sPooledMaterials.size(); ++i)
+		if (sPooledMaterials[i])
+			sPooledMaterials[i]->pool_id = -1;
+	sPooledMaterials.clear();
+
+	for (int i = 0; i < sTexturePools.size(); ++i)
+		delete sTexturePools[i];
+	sTexturePools.clear();
+}
+
+void Material::BeginPooledPass(Shader* shader)
+{
+	assert(sMaterialsUBO && "BuildTexturePools must be called first");
+	glBindBufferBase(GL_UNIFORM_BUFFER, MATERIALS_UBO_BINDING, sMaterialsUBO);
+	shader->setUniformBlock("u_materials_block", MATERIALS_UBO_BINDING);
+
+	//samplers always point to their slots even if nothing is bound yet
+	shader->setUniform1("u_color_pool", POOLS_FIRST_SLOT + POOL_COLOR);
+	shader->setUniform1("u_emissive_pool", POOLS_FIRST_SLOT + POOL_EMISSIVE);
+	shader->setUniform1("u_normal_pool", POOLS_FIRST_SLOT + POOL_NORMAL);
+	shader->setUniform1("u_metallic_roughness_pool", POOLS_FIRST_SLOT + POOL_METALLIC_ROUGHNESS);
+	memset(sBoundPools, 0, sizeof(sBoundPools));
+}
+
+Texture* Material::getPoolTexture(ePoolChannel channel)
+{
+	switch (channel)
+	{
+	case POOL_COLOR: return color_texture.texture;
+	case POOL_EMISSIVE: return emissive_texture.texture;
+	case POOL_NORMAL: return normal_texture.texture;
+	case POOL_METALLIC_ROUGHNESS: return metallic_roughness_texture.texture;
+	case NUM_POOL_CHANNELS: break;
+	}
+	return NULL;
+}
+
+void Material::updatePooledData()
+{
+	assert(pool_id != -1);
+
+	sMaterialData data;
+	data.color = color;
+	data.emissive_factor = Vector4(emissive_factor, alpha_mode == GTR::eAlphaMode::MASK ? alpha_cutoff : 0);
+	for (int i = 0; i < NUM_POOL_CHANNELS; ++i)
+		data.layers[i] = layers[i];
+
+	glBindBuffer(GL_UNIFORM_BUFFER, sMaterialsUBO);
+	glBufferSubData(GL_UNIFORM_BUFFER, sizeof(sMaterialData) * pool_id, sizeof(sMaterialData), &data);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+}
+
+void Material::uploadPooledToShader(Shader* shader)
+{
+	assert(pool_id != -1);
+
+	shader->setUniform("u_material_id", pool_id);
+
+	static const char* pool_names[NUM_POOL_CHANNELS] = { "u_color_pool", "u_emissive_pool", "u_normal_pool", "u_metallic_roughness_pool" };
+	for (int i = 0; i < NUM_POOL_CHANNELS; ++i)
+	{
+		TexturePool* pool = pools[i];
+		if (!pool || pool == sBoundPools[i])
+			continue;
+		shader->setUniform(pool_names[i], pool->texture_array, POOLS_FIRST_SLOT + i);
+		sBoundPools[i] = pool;
+	}
+}
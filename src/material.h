@@ -5,11 +5,16 @@
 #include <cassert>
 #include <map>
 #include <string>
+#include <vector>
 
 //forward declaration
 class Mesh;
 class Texture;
 
+#define MAX_POOLED_MATERIALS 256	//must fit in GL_MAX_UNIFORM_BLOCK_SIZE (16KB minimum)
+#define MATERIALS_UBO_BINDING 0
+#define POOLS_FIRST_SLOT 10			//texture slots used by the pools
+
 namespace GTR {
 
 	enum eAlphaMode {
@@ -35,6 +40,38 @@ namespace GTR {
 		Sampler() { texture = NULL; uv_channel = 0; }
 	};
 
+	//channels that can be read from a texture pool
+	enum ePoolChannel {
+		POOL_COLOR,
+		POOL_EMISSIVE,
+		POOL_NORMAL,
+		POOL_METALLIC_ROUGHNESS,
+		NUM_POOL_CHANNELS
+	};
+
+	//textures with the same size and format stored as layers of one GL_TEXTURE_2D_ARRAY
+	class TexturePool {
+	public:
+		int width;
+		int height;
+		unsigned int format;
+		Texture* texture_array;
+		std::vector<Texture*> textures; //one per layer
+
+		TexturePool(int w, int h, unsigned int f) : width(w), height(h), format(f), texture_array(NULL) {}
+		~TexturePool();
+
+		int getLayer(Texture* texture);
+		void build(); //creates the array and copies every texture to its layer
+	};
+
+	//material properties as stored in the materials uniform buffer (std140)
+	struct sMaterialData {
+		Vector4 color;
+		Vector4 emissive_factor;	//w: alpha cutoff
+		int layers[4];				//layer per channel, -1 if it has no texture
+	};
+
 	//this class contains all info relevant of how something must be rendered
 	class Material {
 	public:
@@ -65,9 +102,15 @@ namespace GTR {
 		Sampler occlusion_texture;	//which areas receive ambient light
 		Sampler normal_texture;	//normalmap
 
+		//texture pools, filled by BuildTexturePools
+		int pool_id;	//index in the materials buffer, -1 if not pooled
+		TexturePool* pools[NUM_POOL_CHANNELS];
+		int layers[NUM_POOL_CHANNELS];
+
 		//ctors
-		Material() : alpha_mode(NO_ALPHA), alpha_cutoff(0.5), color(1, 1, 1, 1), _zMin(0.0f), _zMax(1.0f), two_sided(false), roughness_factor(1), metallic_factor(0) {
+		Material() : alpha_mode(NO_ALPHA), alpha_cutoff(0.5), color(1, 1, 1, 1), _zMin(0.0f), _zMax(1.0f), two_sided(false), roughness_factor(1), metallic_factor(0), pool_id(-1) {
 			//color_texture = emissive_texture = metallic_roughness_texture = occlusion_texture = normal_texture = NULL;
+			memset(pools, 0, sizeof(pools));
 		}
 		Material(Texture* texture) : Material() { color_texture.texture = texture; }
 		virtual ~Material();
@@ -77,5 +120,18 @@ namespace GTR {
 		void renderInMenu();
 
 		void uploadToShader(Shader* shader, bool apply_linear_correction = false, float gamma = 2.2);
+
+		//texture pools: materials read their textures from arrays and their properties from a buffer,
+		//so draws sharing the pools only upload the material id
+		static std::vector<TexturePool*> sTexturePools;
+		static std::vector<Material*> sPooledMaterials;
+		static GLuint sMaterialsUBO;
+		static void BuildTexturePools(std::vector<Material*>& materials);
+		static void ReleaseTexturePools();
+		static void BeginPooledPass(Shader* shader); //call before a batch of uploadPooledToShader
+
+		Texture* getPoolTexture(ePoolChannel channel);
+		void updatePooledData(); //upload the properties again after changing them
+		void uploadPooledToShader(Shader* shader);
 	};
 };
\ No newline at end of file
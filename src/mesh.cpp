@@ -305,11 +305,7 @@ void Mesh::drawCall(unsigned int primitive, int submesh_id, int num_instances)
 		{
 			assert(indices_vbo_id && "indices must be uploaded to the GPU");
 			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
-			#ifdef OPENGL_ES3
-				glDrawElementsInstanced(primitive, size, GL_UNSIGNED_INT, (void*)(start + sizeof(Vector3u)), num_instances);
-            #else
-				assert(0 && "not supported in OpenGL ES2");
-            #endif
+			glDrawElementsInstanced(primitive, size, GL_UNSIGNED_INT, (void*)(start * sizeof(Vector3u)), num_instances);
 			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 		}
 		else
@@ -331,11 +327,7 @@ void Mesh::drawCall(unsigned int primitive, int submesh_id, int num_instances)
 	{
 		if (num_instances > 0)
 		{
-			#ifdef OPENGL_ES3
-				glDrawArraysInstanced(primitive, start, size, num_instances);
-            #else
-				assert(0 && "not supported in OpenGL ES2");
-            #endif
+			glDrawArraysInstanced(primitive, start, size, num_instances);
 		}
 		else
 			glDrawArrays(primitive, start, size);
@@ -11,12 +11,18 @@
 #include "extra/hdre.h"
 #include "application.h"
 #include "sphericalharmonics.h"
+#include "jobs.h"
 
 #include <algorithm>
 
 using namespace GTR;
 
-Renderer::Renderer() {
+//macro names of the permutation flags, same order as the bits
+static const char* gbuffers_flag_names[] = { "HAS_NORMAL", "HAS_METALLIC_ROUGHNESS", "IS_EMISSOR", "LAST_PASS", "APPLY_DITHERING" };
+static const char* deferred_flag_names[] = { "LINEAR_CORRECTION", "HAS_SSAO", "APPLY_IRRADIANCE", "IS_EMISSOR", "RENDER_SHADOWS" };
+#define NUM_PERMUTATION_FLAGS 5
+
+Renderer::Renderer() : graph(&rt_pool) {
 	lights = Scene::instance->lights;
 	irr = Scene::instance->irr;
 	irr->placeProbes();
@@ -27,10 +33,9 @@ Renderer::Renderer() {
 	pipeline_mode = ePipelineMode::DEFERRED;
 	renderer_cond = eRendererCondition::REND_COND_NONE;
 	post_fx = ePostFX::FX_MOTION_BLUR;
-	color_buffer = new Texture(Application::instance->window_width, Application::instance->window_height, GL_RGB, GL_HALF_FLOAT);
+	post_fx_stack.push_back(FX_MOTION_BLUR);
 	quality = eQuality::LOW;
 	fbo.create(1024, 1024);
-	ssao_fbo.create(Application::instance->window_width, Application::instance->window_height, 1, GL_RGBA, GL_UNSIGNED_BYTE, false);
 	light_camera = 0;
 	//limited to 4 lights
 	shadow_singlepass.create(4 * 512, 512);
@@ -40,10 +45,25 @@ Renderer::Renderer() {
 	noise_texture = NULL;
 	irr_fbo = NULL;
 	lut_texture = NULL;
+	palette_texture = NULL;
+	skinned_instances_vbo = 0;
+	render_width = Application::instance->window_width;
+	render_height = Application::instance->window_height;
+	memset(gpu_time_queries, 0, sizeof(gpu_time_queries));
+	memset(gpu_time_issued, 0, sizeof(gpu_time_issued));
+	gpu_time_next = 0;
+	gpu_time_measuring = false;
+	frames_since_scale_change = 0;
+	frame_number = 0;
+	taa_index = 0;
+	taa_history_valid = false;
 }
 
 void Renderer::renderToFBO(GTR::Scene* scene, Camera* camera)
 {
+	//the same bones are used by the shadowmaps and the gbuffers
+	updateSkinnedEntities(scene);
+
 	if ( render_mode == SHOW_SHADOWMAP && pipeline_mode == FORWARD )
 	{
 		//create the shadow maps for each light
@@ -69,12 +89,24 @@ void Renderer::renderToFBO(GTR::Scene* scene, Camera* camera)
 		}
 	}
 	else {
+		updateResolutionScale();
+		gpu_time_measuring = !gpu_time_issued[gpu_time_next];
+		if (gpu_time_measuring)
+			glBeginQuery(GL_TIME_ELAPSED, gpu_time_queries[gpu_time_next]);
+
 		if (render_deferred_mode == DEFERRED_SHADOWMAP && pipeline_mode == DEFERRED)
 		{
 			//create the shadow maps for each light
 			createShadowMapsUsingForward(scene, camera);
 		}
 		renderScene(scene, camera);
+
+		if (gpu_time_measuring)
+		{
+			glEndQuery(GL_TIME_ELAPSED);
+			gpu_time_issued[gpu_time_next] = true;
+			gpu_time_next = (gpu_time_next + 1) % NUM_GPU_TIME_QUERIES;
+		}
 	}
 
 	//render light meshes if anyone is set to visible
@@ -82,6 +114,52 @@ void Renderer::renderToFBO(GTR::Scene* scene, Camera* camera)
 
 	if(!freeze_prev_vp)
 		vp_previous = camera->viewprojection_matrix;
+
+	rt_pool.endFrame();
+	frame_number++;
+}
+
+void Renderer::updateResolutionScale()
+{
+	if (gpu_time_queries[0] == 0)
+		glGenQueries(NUM_GPU_TIME_QUERIES, gpu_time_queries);
+
+	//the queries of the previous frames from the oldest, only read when ready so the cpu never waits for the gpu
+	for (int i = 0; i < NUM_GPU_TIME_QUERIES; ++i)
+	{
+		int index = (gpu_time_next + i) % NUM_GPU_TIME_QUERIES;
+		if (!gpu_time_issued[index])
+			continue;
+		GLint available = 0;
+		glGetQueryObjectiv(gpu_time_queries[index], GL_QUERY_RESULT_AVAILABLE, &available);
+		if (!available)
+			break; //the newer ones are not ready either
+		GLuint64 nanoseconds = 0;
+		glGetQueryObjectui64v(gpu_time_queries[index], GL_QUERY_RESULT, &nanoseconds);
+		gpu_ms = nanoseconds / 1000000.0;
+		gpu_time_issued[index] = false;
+	}
+
+	if (!use_dynamic_resolution)
+	{
+		resolution_scale = 1.0;
+		return;
+	}
+
+	//steps of 5% and some frames between changes, so the targets are not recreated every frame
+	frames_since_scale_change++;
+	if (frames_since_scale_change < 15)
+		return;
+	float scale = resolution_scale;
+	if (gpu_ms > target_gpu_ms * 1.05)
+		scale = clamp(resolution_scale - 0.05f, min_resolution_scale, 1.0f);
+	else if (gpu_ms < target_gpu_ms * 0.8)
+		scale = clamp(resolution_scale + 0.05f, min_resolution_scale, 1.0f);
+	if (scale != resolution_scale)
+	{
+		resolution_scale = scale;
+		frames_since_scale_change = 0;
+	}
 }
 
 void Renderer::renderScene(GTR::Scene* scene, Camera* camera)
@@ -117,29 +195,52 @@ struct compareAlpha {
 	}
 };
 
-void Renderer::createRenderCalls(GTR::Scene* scene, Camera* camera) {
-	// prepre the vector
-	render_calls.clear();
-	bool isAlpha = false;
+//a range of the scene components to render calls, every range has its own list
+struct sRenderCallsJob {
+	Renderer* renderer;
+	SceneComponents* components;
+	Camera* camera;
+	int batch_size;
+};
 
-	for (int i = 0; i < scene->entities.size(); ++i)
+static void createRenderCallsRange(void* data, int start, int end)
+{
+	sRenderCallsJob* job = (sRenderCallsJob*)data;
+	SceneComponents& components = *job->components;
+	std::vector<renderCall>& output = job->renderer->render_call_batches[start / job->batch_size];
+	output.clear();
+
+	//the prefabs outside the frustum are skipped as a whole
+	for (int i = start; i < end; ++i)
 	{
-		BaseEntity* ent = scene->entities[i];
-		if (!ent->visible)
+		if (!components.visible[i] || !components.prefabs[i])
 			continue;
-		
-		isAlpha = false;
-		
-		if (ent->entity_type == PREFAB)
-		{
-			PrefabEntity* pent = (GTR::PrefabEntity*)ent;
-			if (pent->prefab)
-			{
-				//create the render calls
-				prefabToNode(ent->model, pent->prefab, camera, pent->nearest_reflection_probe);
-			}
-		}
+
+		BoundingBox& bounds = components.world_bounds[i];
+		if (job->camera && !job->camera->testBoxInFrustum(bounds.center, bounds.halfsize))
+			continue;
+
+		//create the render calls
+		job->renderer->prefabToNode(components.models[i], components.prefabs[i], job->camera, output, components.reflection_probes[i]);
 	}
+}
+
+void Renderer::createRenderCalls(GTR::Scene* scene, Camera* camera) {
+	// prepre the vector
+	render_calls.clear();
+
+	//culled and converted in parallel, joined in the same order
+	sRenderCallsJob job;
+	job.renderer = this;
+	job.components = &scene->components;
+	job.camera = camera;
+	job.batch_size = 64;
+	int num_batches = (scene->components.size() + job.batch_size - 1) / job.batch_size;
+	if (render_call_batches.size() < num_batches)
+		render_call_batches.resize(num_batches);
+	JobSystem::parallelFor(createRenderCallsRange, &job, scene->components.size(), job.batch_size);
+	for (int i = 0; i < num_batches; ++i)
+		render_calls.insert(render_calls.end(), render_call_batches[i].begin(), render_call_batches[i].end());
 
 	// sort render calls
 	if (camera) {
@@ -156,21 +257,21 @@ float Renderer::computeDistanceToCamera(Matrix44 node_model, Mesh* mesh, Vector3
 }
 
 //renders all the prefab
-void Renderer::prefabToNode(const Matrix44& model, GTR::Prefab* prefab, Camera* camera, sReflectionProbe* _nearest_reflection_probe)
+void Renderer::prefabToNode(const Matrix44& model, GTR::Prefab* prefab, Camera* camera, std::vector<renderCall>& output, sReflectionProbe* _nearest_reflection_probe)
 {
 	assert(prefab && "PREFAB IS NULL");
 	//assign the model to the root node
-	nodeToRenderCall(model, &prefab->root, camera, _nearest_reflection_probe);
+	nodeToRenderCall(model, &prefab->root, camera, output, _nearest_reflection_probe);
 }
 
 //renders a node of the prefab and its children
-void Renderer::nodeToRenderCall(const Matrix44& prefab_model, GTR::Node* node, Camera* camera, sReflectionProbe* _nearest_reflection_probe)
+void Renderer::nodeToRenderCall(const Matrix44& parent_model, GTR::Node* node, Camera* camera, std::vector<renderCall>& output, sReflectionProbe* _nearest_reflection_probe)
 {
 	if (!node->visible)
 		return;
 
-	//compute global matrix
-	Matrix44 node_model = node->getGlobalMatrix(true) * prefab_model;
+	//compute global matrix, not stored in the node because other jobs can be reading the same prefab
+	Matrix44 node_model = node->model * parent_model;
 
 	//does this node have a mesh? then we must render it
 	if (node->mesh && node->material)
@@ -187,13 +288,13 @@ void Renderer::nodeToRenderCall(const Matrix44& prefab_model, GTR::Node* node, C
 			rc.nearest_reflection_probe = _nearest_reflection_probe;
 			if(camera)
 				rc.distance_to_camera = computeDistanceToCamera(node_model, node->mesh, camera->eye);
-			render_calls.push_back(rc);
+			output.push_back(rc);
 		}
 	}
 
 	//iterate recursively with children
 	for (int i = 0; i < node->children.size(); ++i)
-		nodeToRenderCall(prefab_model, node->children[i], camera, _nearest_reflection_probe);
+		nodeToRenderCall(node_model, node->children[i], camera, output, _nearest_reflection_probe);
 }
 
 void Renderer::renderForward(GTR::Scene* scene, std::vector< renderCall >& data, Camera* camera, ePipelineMode pipeline, eRenderMode mode)
@@ -219,33 +320,239 @@ void Renderer::renderForward(GTR::Scene* scene, std::vector< renderCall >& data,
 	}
 }
 
+//packed gbuffers (see gbufferPacking in the atlas), 12 bytes per pixel:
+//albedo + roughness, octahedral normal + metallic, emissive
+static void createGBuffers(FBO& fbo, int width, int height)
+{
+	static const int formats[3] = { GL_RGBA, GL_RGBA, GL_RGB };
+	static const int types[3] = { GL_UNSIGNED_BYTE, GL_UNSIGNED_BYTE, GL_FLOAT };
+	static const int internal_formats[3] = { GL_RGBA8, GL_RGB10_A2, GL_R11F_G11F_B10F };
+	fbo.create(width, height, 3, formats, types, internal_formats);
+}
+
+static void setBilinearFilter(Texture* texture)
+{
+	glBindTexture(texture->texture_type, texture->texture_id);
+	glTexParameteri(texture->texture_type, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(texture->texture_type, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glBindTexture(texture->texture_type, 0);
+}
+
+//low discrepancy sequence for the subpixel jitter
+static float halton(int index, int base)
+{
+	float result = 0.0;
+	float f = 1.0;
+	while (index > 0)
+	{
+		f /= base;
+		result += f * (index % base);
+		index /= base;
+	}
+	return result;
+}
+
 void Renderer::renderDeferred(GTR::Scene* scene, std::vector< renderCall >& data, Camera* camera)
 {
-	//create buffers
-	if (gbuffers_fbo.fbo_id == 0)
+	int window_w = Application::instance->window_width;
+	int window_h = Application::instance->window_height;
+	//the temporal upsample needs the tonemapped frame, so it is only done with the linear correction
+	bool upsample = use_dynamic_resolution && linear_correction;
+	float scale = upsample ? resolution_scale : 1.0;
+	render_width = window_w * scale;
+	render_height = window_h * scale;
+
+	//the gbuffers are kept between frames (the size is checked here instead of when resizing)
+	if (gbuffers_fbo.fbo_id == 0 || gbuffers_fbo.width != render_width || gbuffers_fbo.height != render_height)
+		createGBuffers(gbuffers_fbo, render_width, render_height);
+
+	//subpixel offset of the projection, a different one every frame so the history accumulates the missing samples
+	Matrix44 vp = camera->viewprojection_matrix;
+	Matrix44 jittered_vp = vp;
+	Vector2 jitter_uv(0, 0);
+	if (upsample)
+	{
+		int index = frame_number % 8 + 1;
+		Vector2 offset(halton(index, 2) - 0.5, halton(index, 3) - 0.5);
+		jitter_uv.set(offset.x / render_width, offset.y / render_height);
+		Matrix44 jitter;
+		jitter.m[12] = jitter_uv.x * 2.0;
+		jitter.m[13] = jitter_uv.y * 2.0;
+		jittered_vp = vp * jitter;
+
+		if (taa_history[0].fbo_id == 0 || taa_history[0].width != window_w || taa_history[0].height != window_h)
+		{
+			for (int i = 0; i < 2; ++i)
+			{
+				taa_history[i].create(window_w, window_h, 1, GL_RGBA, GL_UNSIGNED_BYTE, false);
+				setBilinearFilter(taa_history[i].color_textures[0]);
+			}
+			taa_history_valid = false;
+		}
+	}
+	else
+		taa_history_valid = false;
+
+	//declare the frame
+	graph.clear();
+	int gbuffers = graph.importTarget("gbuffers", &gbuffers_fbo);
+	int ao = graph.createTarget("ao", scale, GL_RGB, GL_UNSIGNED_BYTE);
+	int illumination = graph.createTarget("illumination", scale, GL_RGB, GL_FLOAT);
+	int gamma = graph.createTarget("gamma", scale, GL_RGBA, GL_UNSIGNED_BYTE);
+	int upsampled = graph.importTarget("upsampled", upsample ? &taa_history[taa_index] : NULL);
+
+	int pass = graph.addPass(PASS_GBUFFERS);
+	graph.write(pass, gbuffers);
+
+	//only computed if someone reads the ao
+	pass = graph.addPass(PASS_SSAO);
+	graph.read(pass, gbuffers);
+	graph.write(pass, ao);
+
+	if (show_gbuffers)
+	{
+		pass = graph.addPass(PASS_SHOW_GBUFFERS);
+		graph.read(pass, gbuffers);
+		graph.write(pass, RenderGraph::SCREEN);
+	}
+	else if (show_ao)
+	{
+		pass = graph.addPass(PASS_SHOW_AO);
+		graph.read(pass, ao);
+		graph.write(pass, RenderGraph::SCREEN);
+	}
+	else if (show_irradiance_coeffs && probes_texture != NULL)
 	{
-		//careful when resizing the window
-		gbuffers_fbo.create(Application::instance->window_width, 
-							Application::instance->window_height,
-							3,	//num textures
-							GL_RGBA,
-							GL_FLOAT);	//precision
+		pass = graph.addPass(PASS_SHOW_IRRADIANCE);
+		graph.read(pass, gbuffers);
+		graph.write(pass, RenderGraph::SCREEN);
+	}
+	else
+	{
+		pass = graph.addPass(PASS_ILLUMINATION);
+		graph.read(pass, gbuffers);
+		if (use_ssao)
+			graph.read(pass, ao);
+		graph.write(pass, illumination);
+
+		if (!linear_correction)
+		{
+			pass = graph.addPass(PASS_PRESENT);
+			graph.read(pass, illumination);
+			graph.write(pass, RenderGraph::SCREEN);
+		}
+		else
+		{
+			pass = graph.addPass(PASS_TONEMAP);
+			graph.read(pass, illumination);
+			graph.write(pass, gamma);
+
+			int final_color = gamma;
+			if (upsample)
+			{
+				pass = graph.addPass(PASS_UPSAMPLE);
+				graph.read(pass, gamma);
+				graph.read(pass, gbuffers); //depth
+				graph.write(pass, upsampled);
+				final_color = upsampled;
+			}
+
+			//the post fx are applied at the window resolution
+			pass = graph.addPass(PASS_POSTFX);
+			graph.read(pass, final_color);
+			graph.read(pass, gbuffers); //depth
+			graph.write(pass, RenderGraph::SCREEN);
+		}
 
-		decals_fbo.create(Application::instance->window_width,
-			Application::instance->window_height,
-			3,	//num textures
-			GL_RGBA,
-			GL_FLOAT);	//precision
+		if (render_deferred_mode == DEFERRED_SHADOWMAP && show_depth_camera)
+		{
+			pass = graph.addPass(PASS_SHOW_SHADOWMAP);
+			graph.write(pass, RenderGraph::SCREEN);
+		}
 	}
 
-	if (illumination_fbo.fbo_id == 0)
+	graph.compile();
+
+	//the passes that write the screen draw over it
+	glClearColor(scene->background_color.x, scene->background_color.y, scene->background_color.z, 1.0);
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+	//and execute it
+	ao_buffer = NULL;
+	for (int i = 0; i < graph.passes.size(); ++i)
 	{
-		illumination_fbo.create(Application::instance->window_width, Application::instance->window_height,
-			1, 			//three textures
-			GL_RGB, 		//three channels
-			GL_FLOAT, //1 byte
-			true);	//depth texture
+		if (!graph.beginPass(i))
+			continue;
+
+		glDisable(GL_BLEND);
+		glDisable(GL_DEPTH_TEST);
+
+		//the scene is rendered with the jittered projection, the rest with the real one
+		int id = graph.passes[i].id;
+		bool jittered = id == PASS_GBUFFERS || id == PASS_SSAO || id == PASS_ILLUMINATION;
+		camera->viewprojection_matrix = jittered ? jittered_vp : vp;
+
+		switch (id)
+		{
+		case PASS_GBUFFERS:
+			fillGBuffers(scene, data, camera);
+			break;
+		case PASS_SSAO:
+			ssao.apply(gbuffers_fbo.depth_texture, gbuffers_fbo.color_textures[1], camera, vp_previous, graph.getFBO(ao), frame_number);
+			ao_buffer = graph.getTexture(ao);
+			break;
+		case PASS_SHOW_GBUFFERS:
+			renderGBuffers(camera);
+			break;
+		case PASS_SHOW_AO:
+			graph.getTexture(ao)->toViewport();
+			break;
+		case PASS_SHOW_IRRADIANCE:
+			renderIrradianceCoeffs(camera);
+			break;
+		case PASS_ILLUMINATION:
+			renderIllumination(scene, data, camera, graph.getFBO(illumination));
+			break;
+		case PASS_PRESENT:
+			graph.getTexture(illumination)->toViewport();
+			break;
+		case PASS_TONEMAP:
+			if (use_tone_mapper && auto_exposure.enabled)
+			{
+				auto_exposure.update(graph.getTexture(illumination), Application::instance->elapsed_time);
+				tone_mapper.average_lum = auto_exposure.average_lum;
+			}
+			applyToneMapper(graph.getTexture(illumination), graph.getFBO(gamma));
+			break;
+		case PASS_UPSAMPLE:
+			applyTemporalUpsample(graph.getTexture(gamma), jittered_vp, jitter_uv, graph.getFBO(upsampled));
+			//this frame output is the history of the next one
+			taa_index = (taa_index + 1) % 2;
+			taa_history_valid = true;
+			break;
+		case PASS_POSTFX:
+			if (apply_post_fx)
+				renderPostFX(camera, graph.getTexture(upsample ? upsampled : gamma));
+			else
+				graph.getTexture(upsample ? upsampled : gamma)->toViewport();
+			break;
+		case PASS_SHOW_SHADOWMAP:
+			if (light_camera < lights.size())
+				lights[light_camera]->renderShadowFBO(Shader::Get("depth"));
+			break;
+		}
+
+		graph.endPass(i);
 	}
+	ao_buffer = NULL;
+	camera->viewprojection_matrix = vp;
+}
+
+void Renderer::fillGBuffers(GTR::Scene* scene, std::vector< renderCall >& data, Camera* camera)
+{
+	//before binding the gbuffers, building the pools copies textures with other framebuffers
+	if (use_texture_pools && !texture_pools_built)
+		buildTexturePools(scene);
 
 	gbuffers_fbo.bind();
 	glClearColor(scene->background_color.x, scene->background_color.y, scene->background_color.z, 1.0);
@@ -257,142 +564,151 @@ void Renderer::renderDeferred(GTR::Scene* scene, std::vector< renderCall >& data
 
 	checkGLErrors();
 
+	//materials in the pools share the same shader and textures, only the material id changes between them
+	Shader* pooled_shader = NULL;
+	if (use_texture_pools)
+		pooled_shader = Shader::Get("gbuffers_pooled");
+	bool pooled_enabled = false;
+
 	for (int i = 0; i < data.size(); i++)
 	{
 		renderCall& rc = data[i];
-		renderMeshWithMaterial(rc.model, rc.mesh, rc.material, camera, NULL, NO_PIPELINE, SHOW_NONE, rc.nearest_reflection_probe);
+		if (pooled_shader && rc.material->pool_id != -1)
+		{
+			if (!pooled_enabled)
+			{
+				pooled_shader->enable();
+				pooled_shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
+				pooled_shader->setUniform("u_camera_position", camera->eye);
+				pooled_shader->setUniform("u_linear_correction", linear_correction);
+				pooled_shader->setUniform("u_gamma", tone_mapper.gamma);
+				Material::BeginPooledPass(pooled_shader);
+				pooled_enabled = true;
+			}
+			renderMeshPooled(rc.model, rc.mesh, rc.material, pooled_shader, rc.nearest_reflection_probe);
+		}
+		else
+		{
+			renderMeshWithMaterial(rc.model, rc.mesh, rc.material, camera, NULL, NO_PIPELINE, SHOW_NONE, rc.nearest_reflection_probe);
+			pooled_enabled = false; //another shader was used
+		}
 	}
 
-	gbuffers_fbo.unbind();
+	if (pooled_enabled)
+		pooled_shader->disable();
+	glDisable(GL_BLEND);
 
-	//--------------------
-	gbuffers_fbo.color_textures[0]->copyTo(decals_fbo.color_textures[0]);
-	gbuffers_fbo.color_textures[1]->copyTo(decals_fbo.color_textures[1]);
-	gbuffers_fbo.color_textures[2]->copyTo(decals_fbo.color_textures[2]);
-	decals_fbo.bind();
-	gbuffers_fbo.depth_texture->copyTo(NULL);
+	renderSkinnedEntities(camera, false);
+	renderCrowds(scene, camera, false);
+
+	//decals are drawn directly over the albedo of the gbuffers
 	renderDecals(scene, camera);
-	decals_fbo.unbind();
-	decals_fbo.color_textures[0]->copyTo(gbuffers_fbo.color_textures[0]);
-	decals_fbo.color_textures[1]->copyTo(gbuffers_fbo.color_textures[1]);
-	decals_fbo.color_textures[2]->copyTo(gbuffers_fbo.color_textures[2]);
-	//--------------------
 
-	//compute SSAO
-	if (!ao_buffer)
-	{
-		ao_buffer = new Texture(Application::instance->window_width * 0.5, Application::instance->window_height * 0.5, GL_LUMINANCE, GL_UNSIGNED_BYTE);
-		blur_ao_buffer = new Texture(Application::instance->window_width * 0.5, Application::instance->window_height * 0.5, GL_LUMINANCE, GL_UNSIGNED_BYTE);
-	}
-	ssao.apply(gbuffers_fbo.depth_texture, gbuffers_fbo.color_textures[1], camera, ao_buffer);
+	gbuffers_fbo.unbind();
+}
 
-	//apply illumination	
-	glClearColor(scene->background_color.x, scene->background_color.y, scene->background_color.z, 1.0);
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+void Renderer::renderIrradianceCoeffs(Camera* camera)
+{
+	int w = Application::instance->window_width;
+	int h = Application::instance->window_height;
+	Shader* irr_shader = Shader::Get("irradiance");
+	irr_shader->enable();
+	irr_shader->setUniform("u_iRes", Vector2(1.0 / (float)w, 1.0 / (float)h));
+	irr->uploadToShader(irr_shader);
+	Matrix44 inv_vp = camera->viewprojection_matrix;
+	inv_vp.inverse();
+	irr_shader->setUniform("u_inverse_viewprojection", inv_vp);
+	irr_shader->setUniform("u_color_texture", gbuffers_fbo.color_textures[0], 0);
+	irr_shader->setUniform("u_normal_texture", gbuffers_fbo.color_textures[1], 1);
+	irr_shader->setUniform("u_depth_texture", gbuffers_fbo.depth_texture, 2);
+	irr_shader->setUniform("u_probes_texture", probes_texture, 3);
+	glDisable(GL_DEPTH_TEST);
 	glDisable(GL_BLEND);
+	Mesh* quad = Mesh::getQuad();
+	quad->render(GL_TRIANGLES);
+	irr_shader->disable();
+}
+
+void Renderer::renderIllumination(GTR::Scene* scene, std::vector< renderCall >& data, Camera* camera, FBO* output)
+{
+	//the froxels use their own targets, computed before binding the output
+	bool froxels = use_froxel_volumetrics && volumetric_fog.compute(scene, camera);
+
+	output->bind();
+	//copy the gbuffers depth buffer to the binded depth buffer in the FBO
+	gbuffers_fbo.depth_texture->copyTo(NULL);
+	glClearColor(scene->background_color.x, scene->background_color.y, scene->background_color.z, 1.0);
+	glClear(GL_COLOR_BUFFER_BIT);
 	glDisable(GL_DEPTH_TEST);
-	
-	if (show_gbuffers)
-	{
-		renderGBuffers(camera);
-	}
-	else if (show_ao && ao_buffer) {
-		ao_buffer->toViewport();
-	}
-	else if (show_irradiance_coeffs && probes_texture != NULL) {
-	//	probes_texture->toViewport();
-		int w = Application::instance->window_width;
-		int h = Application::instance->window_height;
-		Shader* irr_shader = Shader::Get("irradiance");
-		irr_shader->enable();
-		irr_shader->setUniform("u_iRes", Vector2(1.0 / (float)w, 1.0 / (float)h));
-		irr->uploadToShader(irr_shader);
-		Matrix44 inv_vp = camera->viewprojection_matrix;
-		inv_vp.inverse();
-		irr_shader->setUniform("u_inverse_viewprojection", inv_vp);
-		irr_shader->setUniform("u_color_texture", gbuffers_fbo.color_textures[0], 0);
-		irr_shader->setUniform("u_normal_texture", gbuffers_fbo.color_textures[1], 1);
-		irr_shader->setUniform("u_depth_texture", gbuffers_fbo.depth_texture, 2);
-		irr_shader->setUniform("u_probes_texture", probes_texture, 3);
-		glDisable(GL_DEPTH_TEST);
-		glDisable(GL_BLEND);
-		Mesh* quad = Mesh::getQuad();
-		quad->render(GL_TRIANGLES);
-		irr_shader->disable();
-	}
-	else {
-		illumination_fbo.bind();
-		//copy the gbuffers depth buffer to the binded depth buffer in the FBO
-		gbuffers_fbo.depth_texture->copyTo(NULL);
-		glClearColor(scene->background_color.x, scene->background_color.y, scene->background_color.z, 1.0);
-		glClear(GL_COLOR_BUFFER_BIT);
-		glDisable(GL_DEPTH_TEST);
-		renderReconstructedScene(scene, camera);
-		glEnable(GL_DEPTH_TEST);
-		
-		if (irr && apply_irradiance && show_probes)
-			irr->render(NULL, camera);
+	renderReconstructedScene(scene, camera);
+	glEnable(GL_DEPTH_TEST);
 
-		if (use_reflection && show_reflection_probes)
-			reflection_entity->render(camera);
-		
-		if(!use_dithering)
-			renderAlphaElements(data, camera);
+	if (irr && apply_irradiance && show_probes)
+		irr->render(NULL, camera);
 
-		renderVolumetricLights(scene, camera);
+	if (use_reflection && show_reflection_probes)
+		reflection_entity->render(camera);
 
-		illumination_fbo.unbind();
+	if(!use_dithering)
+		renderAlphaElements(data, camera);
 
+	if (froxels)
+		volumetric_fog.composite(gbuffers_fbo.depth_texture, camera);
+	else if (!use_froxel_volumetrics)
+		renderVolumetricLights(scene, camera);
 
-		if (!linear_correction) {
-			illumination_fbo.color_textures[0]->toViewport();
-		}
-		else {
-			//Gamma correction
-			if (gamma_fbo.fbo_id == 0) {
-				gamma_fbo.create(Application::instance->window_width, Application::instance->window_height,
-					1, 			//one textures
-					GL_RGB, 	//three channels
-					GL_FLOAT,
-					true);	    //depth texture
-			}
+	output->unbind();
+}
 
-			gamma_fbo.bind();
-			glClearColor(scene->background_color.x, scene->background_color.y, scene->background_color.z, 1.0);
-			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-			Mesh* quad = Mesh::getQuad();
-			Shader* shader;
-			if(use_tone_mapper)
-				shader = Shader::Get("tone_mapper");
-			else
-				shader = Shader::Get("gamma");
+void Renderer::applyToneMapper(Texture* input, FBO* output)
+{
+	//Gamma correction
+	output->bind();
+	Mesh* quad = Mesh::getQuad();
+	Shader* shader;
+	if(use_tone_mapper)
+		shader = Shader::Get("tone_mapper");
+	else
+		shader = Shader::Get("gamma");
 
-			shader->enable();
-			int w = Application::instance->window_width;
-			int h = Application::instance->window_height;
-			shader->setTexture("u_texture", illumination_fbo.color_textures[0], 0);
-			shader->setUniform("u_iRes", Vector2(1.0 / (float)w, 1.0 / (float)h));
-			tone_mapper.uploadToShader(shader);
-			quad->render(GL_TRIANGLES);
-			glDisable(GL_BLEND);
-			shader->disable();
-			gamma_fbo.unbind();
-
-			if (apply_post_fx) {
-				renderPostFX(camera, gamma_fbo.color_textures[0]);
-			}
-			else {
-				gamma_fbo.color_textures[0]->toViewport();
-			}
-		}
+	shader->enable();
+	int w = output->color_textures[0]->width;
+	int h = output->color_textures[0]->height;
+	shader->setTexture("u_texture", input, 0);
+	shader->setUniform("u_iRes", Vector2(1.0 / (float)w, 1.0 / (float)h));
+	tone_mapper.uploadToShader(shader);
+	glDisable(GL_BLEND);
+	glDisable(GL_DEPTH_TEST);
+	quad->render(GL_TRIANGLES);
+	shader->disable();
+	output->unbind();
+}
 
-		if (render_deferred_mode == DEFERRED_SHADOWMAP && show_depth_camera)
-		{
-			Shader* shader = Shader::Get("depth");
-			if (light_camera < lights.size())
-				lights[light_camera]->renderShadowFBO(shader);
-		}
-	}
+void Renderer::applyTemporalUpsample(Texture* input, const Matrix44& jittered_vp, Vector2 jitter_uv, FBO* output)
+{
+	Matrix44 inv_vp = jittered_vp;
+	inv_vp.inverse();
+	Texture* history = taa_history[(taa_index + 1) % 2].color_textures[0];
+	int w = output->color_textures[0]->width;
+	int h = output->color_textures[0]->height;
+
+	output->bind();
+	Shader* shader = Shader::Get("taa_upsample");
+	shader->enable();
+	shader->setUniform("u_texture", input, 0);
+	shader->setUniform("u_history_texture", history, 1);
+	shader->setUniform("u_depth_texture", gbuffers_fbo.depth_texture, 2);
+	shader->setUniform("u_inverse_viewprojection", inv_vp);
+	shader->setUniform("u_prev_viewprojection", vp_previous);
+	shader->setUniform("u_iRes", Vector2(1.0 / (float)w, 1.0 / (float)h));
+	shader->setUniform("u_jitter", jitter_uv);
+	//without history the current frame is used as it is
+	shader->setUniform("u_history_weight", taa_history_valid ? 0.9f : 0.0f);
+	glDisable(GL_BLEND);
+	glDisable(GL_DEPTH_TEST);
+	Mesh::getQuad()->render(GL_TRIANGLES);
+	shader->disable();
+	output->unbind();
 }
 
 //show each one of the 4 textures stored at gbuffers_fbo
@@ -443,8 +759,8 @@ void Renderer::renderGBuffers(Camera* camera)
 
 void Renderer::uploadDefferedUniforms(Shader* shader, GTR::Scene* scene, Camera* camera)
 {
-	int w = Application::instance->window_width;
-	int h = Application::instance->window_height;
+	int w = render_width;
+	int h = render_height;
 
 	Matrix44 inv_viewproj = camera->viewprojection_matrix;
 	inv_viewproj.inverse();
@@ -482,7 +798,7 @@ void Renderer::uploadDefferedUniforms(Shader* shader, GTR::Scene* scene, Camera*
 	shader->setUniform("u_render_shadows", shadows);
 
 	bool has_ao = false;
-	if (ao_buffer)
+	if (use_ssao && ao_buffer)
 	{
 		has_ao = true;
 		shader->setTexture("u_ssao_texture", ao_buffer, 4);
@@ -499,14 +815,27 @@ void Renderer::renderReconstructedScene(GTR::Scene* scene, Camera* camera)
 		shadows = true;
 	}
 
+	bool apply_irradiance_probes = irr && apply_irradiance && probes_texture != NULL && use_irradiance;
+
+	//flags shared by both passes
+	unsigned int flags = 0;
+	if (linear_correction)
+		flags |= DEFERRED_LINEAR_CORRECTION;
+	if (use_ssao && ao_buffer)
+		flags |= DEFERRED_SSAO;
+	if (shadows)
+		flags |= DEFERRED_SHADOWS;
+
 	/**Render directional light using a quad**/
 	Mesh* quad = Mesh::getQuad();
 	Shader* shader = Shader::Get("deferred");
+	if (use_permutations)
+		shader = shader->getPermutation(flags | DEFERRED_EMISSIVE | (apply_irradiance_probes ? DEFERRED_IRRADIANCE : 0), deferred_flag_names, NUM_PERMUTATION_FLAGS);
 	shader->enable();
 	uploadDefferedUniforms(shader, scene, camera);
 	shader->setUniform("u_is_emissor", true);
 
-	if (irr && apply_irradiance && probes_texture != NULL && use_irradiance)
+	if (apply_irradiance_probes)
 	{
 		shader->setUniform("u_apply_irradiance", true);
 		shader->setTexture("u_probes_texture", probes_texture, 7);
@@ -517,13 +846,13 @@ void Renderer::renderReconstructedScene(GTR::Scene* scene, Camera* camera)
 	}
 
 	//Multipass
-	for (int i = 0; i < lights.size(); i++)
+	scene->components.cullLights(camera, visible_lights);
+	for (int i = 0; i < visible_lights.size(); i++)
 	{
-		LightEntity* light = lights[i];
-		//check if light is inside the camera frustum
-		int inside = (int)camera->testSphereInFrustum(light->model.getTranslation(), light->max_distance);
-		if (inside == 0 || light->light_type != DIRECTIONAL)
+		int index = visible_lights[i];
+		if (scene->components.light_types[index] != DIRECTIONAL)
 			continue;
+		LightEntity* light = scene->components.light_entities[index];
 
 		float prev_intensity = light->intensity;
 		if (linear_correction) {
@@ -543,6 +872,8 @@ void Renderer::renderReconstructedScene(GTR::Scene* scene, Camera* camera)
 	/**Render point and spot lights using spheres**/
 	Mesh* sphere = Mesh::Get("data/meshes/sphere.obj", true);
 	shader = Shader::Get("deferred_ws");
+	if (use_permutations)
+		shader = shader->getPermutation(flags, deferred_flag_names, NUM_PERMUTATION_FLAGS);
 	shader->enable();
 	uploadDefferedUniforms(shader, scene, camera);
 	
@@ -562,13 +893,12 @@ void Renderer::renderReconstructedScene(GTR::Scene* scene, Camera* camera)
 	shader->setUniform("u_apply_irradiance", false);
 
 	//Multipass
-	for (int i = 0; i < lights.size(); i++)
+	for (int i = 0; i < visible_lights.size(); i++)
 	{
-		LightEntity* light = lights[i];
-		//check if light is inside the camera frustum
-		int inside = (int)camera->testSphereInFrustum(light->model.getTranslation(), light->max_distance);
-		if (inside == 0 || light->light_type == DIRECTIONAL)
+		int index = visible_lights[i];
+		if (scene->components.light_types[index] == DIRECTIONAL)
 			continue;
+		LightEntity* light = scene->components.light_entities[index];
 
 		float prev_intensity = light->intensity;
 		if (linear_correction) {
@@ -600,8 +930,8 @@ void Renderer::renderVolumetricLights(GTR::Scene* scene, Camera* camera) {
 	//	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 	glBlendFunc(GL_SRC_ALPHA, GL_ONE);
 	glDisable(GL_DEPTH_TEST);
-	int w = illumination_fbo.width;
-	int h = illumination_fbo.height;
+	int w = render_width;
+	int h = render_height;
 	Matrix44 inv_vp = camera->viewprojection_matrix;
 	inv_vp.inverse();
 
@@ -614,15 +944,13 @@ void Renderer::renderVolumetricLights(GTR::Scene* scene, Camera* camera) {
 	shader->setUniform("u_camera_position", camera->eye);
 	shader->setTexture("u_depth_texture", gbuffers_fbo.depth_texture, 9);
 	shader->setUniform("u_iRes", Vector2(1.0 / (float)w, 1.0 / (float)h));
-	for (int i = 0; i < lights.size(); i++)
+	scene->components.cullLights(camera, visible_lights, SceneComponents::LIGHT_VOLUMETRIC);
+	for (int i = 0; i < visible_lights.size(); i++)
 	{
-		LightEntity* light = lights[i];
-		if (!light->is_volumetric)
-			continue;
-		//check if light is inside the camera frustum
-		int inside = (int)camera->testSphereInFrustum(light->model.getTranslation(), light->max_distance);
-		if (inside == 0 || light->light_type != DIRECTIONAL)
+		int index = visible_lights[i];
+		if (scene->components.light_types[index] != DIRECTIONAL)
 			continue;
+		LightEntity* light = scene->components.light_entities[index];
 
 		float prev_intensity = light->intensity;
 		if (linear_correction) {
@@ -650,16 +978,12 @@ void Renderer::renderVolumetricLights(GTR::Scene* scene, Camera* camera) {
 	shader->setUniform("u_iRes", Vector2(1.0 / (float)w, 1.0 / (float)h));
 
 	//Multipass
-	for (int i = 0; i < lights.size(); i++)
+	for (int i = 0; i < visible_lights.size(); i++)
 	{
-		LightEntity* light = lights[i];
-		if (!light->is_volumetric)
-			continue;
-
-		//check if light is inside the camera frustum
-		int inside = (int)camera->testSphereInFrustum(light->model.getTranslation(), light->max_distance);
-		if (inside == 0 || light->light_type == DIRECTIONAL)
+		int index = visible_lights[i];
+		if (scene->components.light_types[index] == DIRECTIONAL)
 			continue;
+		LightEntity* light = scene->components.light_entities[index];
 
 		float prev_intensity = light->intensity;
 		if (linear_correction) {
@@ -683,48 +1007,130 @@ void Renderer::renderVolumetricLights(GTR::Scene* scene, Camera* camera) {
 	glDisable(GL_BLEND);
 }
 
-//renders a mesh given its transform and material
-void Renderer::renderMeshWithMaterial(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera, Shader* sh, ePipelineMode pipeline, eRenderMode mode, sReflectionProbe* _nearest_reflection_probe)
+static void collectMaterials(GTR::Node* node, std::vector<GTR::Material*>& materials)
 {
-	//in case there is nothing to do
-	if (!mesh || !mesh->getNumVertices() || !material )
+	if (node->material && std::find(materials.begin(), materials.end(), node->material) == materials.end())
+		materials.push_back(node->material);
+	for (int i = 0; i < node->children.size(); ++i)
+		collectMaterials(node->children[i], materials);
+}
+
+void Renderer::buildTexturePools(GTR::Scene* scene)
+{
+	std::vector<GTR::Material*> materials;
+	for (int i = 0; i < scene->entities.size(); ++i)
+	{
+		BaseEntity* ent = scene->entities[i];
+		if (ent->entity_type != PREFAB)
+			continue;
+		PrefabEntity* pent = (GTR::PrefabEntity*)ent;
+		if (pent->prefab)
+			collectMaterials(&pent->prefab->root, materials);
+	}
+
+	Material::BuildTexturePools(materials);
+	texture_pools_built = true;
+}
+
+//same as renderMeshWithMaterial for the gbuffers, but the shader is already enabled and the material is in the pools
+void Renderer::renderMeshPooled(const Matrix44 model, Mesh* mesh, GTR::Material* material, Shader* shader, sReflectionProbe* _nearest_reflection_probe)
+{
+	if (!mesh || !mesh->getNumVertices())
 		return;
-    assert(glGetError() == GL_NO_ERROR);
 
-	//define locals to simplify coding
-	GTR::Scene* scene = GTR::Scene::instance;
-	
-	//select the blending
 	if (material->alpha_mode == GTR::eAlphaMode::BLEND)
 	{
+		if (!use_dithering)
+			return;
 		glEnable(GL_BLEND);
 		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 	}
 	else
 		glDisable(GL_BLEND);
 
-	//select if render both sides of the triangles
-	if(material->two_sided)
+	if (material->two_sided)
 		glDisable(GL_CULL_FACE);
 	else
 		glEnable(GL_CULL_FACE);
-    assert(glGetError() == GL_NO_ERROR);
 
-	ePipelineMode _pipeline_mode = (pipeline == NO_PIPELINE) ? pipeline_mode : pipeline;
-	eRenderMode rending_mode = (mode == SHOW_NONE) ? render_mode : mode;
+	shader->setUniform("u_apply_dithering", material->alpha_mode == GTR::eAlphaMode::BLEND);
+	shader->setUniform("u_model", model);
+	material->uploadPooledToShader(shader);
 
-	//choose a shader
-	Shader* shader;
-	if (sh == NULL)
-		shader = getShader(_pipeline_mode, rending_mode);
-	else
-		shader = sh;
+	if (_nearest_reflection_probe != NULL && _nearest_reflection_probe->cubemap != NULL && use_reflection) {
+		shader->setUniform("u_last_pass", true);
+		shader->setTexture("u_reflection_texture", _nearest_reflection_probe->cubemap, 7);
+	}
+	else {
+		shader->setUniform("u_last_pass", false);
+	}
+	mesh->render(GL_TRIANGLES);
+
+	if (isRenderingBoundingBox) {
+		mesh->renderBounding(model, true);
+		shader->enable();
+	}
+}
+
+//renders a mesh given its transform and material
+void Renderer::renderMeshWithMaterial(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera, Shader* sh, ePipelineMode pipeline, eRenderMode mode, sReflectionProbe* _nearest_reflection_probe)
+{
+	//in case there is nothing to do
+	if (!mesh || !mesh->getNumVertices() || !material )
+		return;
+    assert(glGetError() == GL_NO_ERROR);
+
+	//define locals to simplify coding
+	GTR::Scene* scene = GTR::Scene::instance;
+	
+	//select the blending
+	if (material->alpha_mode == GTR::eAlphaMode::BLEND)
+	{
+		glEnable(GL_BLEND);
+		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	}
+	else
+		glDisable(GL_BLEND);
+
+	//select if render both sides of the triangles
+	if(material->two_sided)
+		glDisable(GL_CULL_FACE);
+	else
+		glEnable(GL_CULL_FACE);
+    assert(glGetError() == GL_NO_ERROR);
+
+	ePipelineMode _pipeline_mode = (pipeline == NO_PIPELINE) ? pipeline_mode : pipeline;
+	eRenderMode rending_mode = (mode == SHOW_NONE) ? render_mode : mode;
+
+	//choose a shader
+	Shader* shader;
+	if (sh == NULL)
+		shader = getShader(_pipeline_mode, rending_mode);
+	else
+		shader = sh;
 
     assert(glGetError() == GL_NO_ERROR);
 
 	//no shader? then nothing to render
 	if (!shader)
 		return;
+
+	//use the gbuffers shader specialized for this material
+	if (_pipeline_mode == DEFERRED && use_permutations && sh == NULL)
+	{
+		unsigned int flags = 0;
+		if (material->normal_texture.texture)
+			flags |= GBUFFERS_NORMAL;
+		if (material->metallic_roughness_texture.texture)
+			flags |= GBUFFERS_METALLIC_ROUGHNESS;
+		if (material->emissive_texture.texture)
+			flags |= GBUFFERS_EMISSIVE;
+		if (_nearest_reflection_probe != NULL && _nearest_reflection_probe->cubemap != NULL && use_reflection)
+			flags |= GBUFFERS_REFLECTION;
+		if (material->alpha_mode == GTR::eAlphaMode::BLEND)
+			flags |= GBUFFERS_DITHERING;
+		shader = shader->getPermutation(flags, gbuffers_flag_names, NUM_PERMUTATION_FLAGS);
+	}
 	shader->enable();
 
 	if (_pipeline_mode == DEFERRED)
@@ -962,17 +1368,12 @@ void GTR::Renderer::changeQualityFBO()
 //create the shadowmap of each light in the scene
 void GTR::Renderer::createShadowMaps(Scene* scene, Camera* camera)
 {
-	for (int i = 0; i < lights.size(); i++)
+	//the shadow casters inside the camera frustum (copied, the light passes reuse visible_lights)
+	std::vector<int> casters;
+	scene->components.cullLights(camera, casters, SceneComponents::LIGHT_CAST_SHADOW);
+	for (int i = 0; i < casters.size(); i++)
 	{
-		if (!lights[i]->cast_shadow)
-			continue;
-		
-		LightEntity* light = lights[i];
-
-		//check if light is inside the camera frustum
-		int inside = (int)camera->testSphereInFrustum(light->model.getTranslation(), light->max_distance);
-		if (inside == 0)
-			continue;
+		LightEntity* light = scene->components.light_entities[casters[i]];
 
 		rendering_shadowmap = true;
 		light->shadow_fbo->bind();
@@ -983,6 +1384,8 @@ void GTR::Renderer::createShadowMaps(Scene* scene, Camera* camera)
 		light->updateCamera();
 		
 		renderScene(scene, light->camera);
+		renderSkinnedEntities(light->camera, true);
+		renderCrowds(scene, light->camera, true);
 
 		//disable it to render back to the screen
 		light->shadow_fbo->unbind();
@@ -1085,6 +1488,9 @@ void Renderer::renderInMenu()
 				ImGui::Text(lights[light_camera]->name.c_str());
 		}
 		ImGui::Checkbox("Use dithering", &use_dithering);
+		ImGui::Checkbox("Use shader permutations", &use_permutations);
+		if (ImGui::Checkbox("Use texture pools", &use_texture_pools) && use_texture_pools)
+			texture_pools_built = false;	//build them again in case the scene changed
 		ImGui::Checkbox("Linear Correction", &linear_correction);
 		if (linear_correction)
 		{
@@ -1094,20 +1500,71 @@ void Renderer::renderInMenu()
 			{
 				ImGui::SliderFloat("TM Scale", &tone_mapper.scale, 0.1, 5);
 				ImGui::SliderFloat("TM White", &tone_mapper.white_lum, 0.1, 5);
-				ImGui::SliderFloat("TM Average luminance", &tone_mapper.average_lum, 0.1, 5);
+				ImGui::Checkbox("Auto exposure", &auto_exposure.enabled);
+				if (auto_exposure.enabled) {
+					ImGui::SliderFloat("Adaptation speed", &auto_exposure.speed, 0.1, 10);
+					ImGui::SliderFloat("Min luminance", &auto_exposure.min_lum, 0.01, 1);
+					ImGui::SliderFloat("Max luminance", &auto_exposure.max_lum, 1, 20);
+					ImGui::Text("Average luminance: %.3f (target %.3f)", auto_exposure.average_lum, auto_exposure.target_lum);
+				}
+				else
+					ImGui::SliderFloat("TM Average luminance", &tone_mapper.average_lum, 0.1, 5);
 			}
 		}
 	}
 	if (pipeline_mode == DEFERRED)
 	{
+		ImGui::Checkbox("Dynamic resolution", &use_dynamic_resolution);
+		if (use_dynamic_resolution) {
+			ImGui::SliderFloat("Target GPU ms", &target_gpu_ms, 4, 50);
+			ImGui::SliderFloat("Min resolution scale", &min_resolution_scale, 0.25, 1);
+			ImGui::Text("GPU: %.2f ms  Scale: %.2f (%d x %d)", gpu_ms, resolution_scale, render_width, render_height);
+		}
+		ImGui::Checkbox("Use SSAO", &use_ssao);
 		ImGui::Checkbox("Show AO", &show_ao);
+		if (use_ssao || show_ao) {
+			ImGui::SliderInt("AO Samples", &ssao.samples, 4, 32);
+			ImGui::SliderFloat("AO Radius", &ssao.radius, 1, 50);
+			ImGui::Checkbox("AO Temporal accumulation", &ssao.use_temporal);
+		}
+		ImGui::Checkbox("Froxel volumetrics", &use_froxel_volumetrics);
+		if (use_froxel_volumetrics) {
+			ImGui::SliderFloat("Fog density", &volumetric_fog.density, 0.0001, 0.01, "%.4f");
+			ImGui::SliderFloat("Fog distance", &volumetric_fog.max_distance, 100, 5000);
+			ImGui::Checkbox("Fog temporal accumulation", &volumetric_fog.use_temporal);
+		}
 		ImGui::Checkbox("Show GBuffers", &show_gbuffers);
 		if(show_gbuffers)
 			ImGui::Checkbox("Show Alpha GBuffers", &show_gbuffers_alpha);
 		ImGui::Checkbox("Apply Post Processing Effect", &apply_post_fx);
 		if (apply_post_fx) {
+			static const char* postfx_names[] = { "MOTION-BLUR", "PIXELATED", "BLUR", "DEPTH-OF-FIELD", "GRAIN", "CHROMATIC", "BLOOM", "LENS-DISTORTION", "LUT", "FXAA", "SHARPEN" };
+
+			//the stack, applied from top to bottom
+			for (int i = 0; i < post_fx_stack.size(); ++i)
+			{
+				ImGui::PushID(i);
+				ImGui::Text("%d. %s", i + 1, postfx_names[post_fx_stack[i]]);
+				ImGui::SameLine();
+				if (ImGui::SmallButton("Up") && i > 0)
+					std::swap(post_fx_stack[i], post_fx_stack[i - 1]);
+				ImGui::SameLine();
+				bool remove = ImGui::SmallButton("Remove");
+				ImGui::PopID();
+				if (remove)
+				{
+					post_fx_stack.erase(post_fx_stack.begin() + i);
+					break;
+				}
+			}
 			ImGui::Combo("PostFX", (int*)&post_fx, "MOTION-BLUR\0PIXELATED\0BLUR\0DEPTH-OF-FIELD\0GRAIN\0CHROMATIC\0BLOOM\0LENS-DISTORTION\0LUT\0FXAA\0SHARPEN", 4);
-			if (post_fx == FX_PIXELATED) {
+			ImGui::SameLine();
+			if (ImGui::Button("Add"))
+				post_fx_stack.push_back(post_fx);
+
+			//settings of the effects in the stack
+			#define IN_STACK(fx) (std::find(post_fx_stack.begin(), post_fx_stack.end(), fx) != post_fx_stack.end())
+			if (IN_STACK(FX_PIXELATED)) {
 				bool changed_pixel = false;
 				changed_pixel |= ImGui::SliderInt("Pixel size", &pixel_size, 0, 21);
 				if (changed_pixel) {
@@ -1117,26 +1574,27 @@ void Renderer::renderInMenu()
 					}
 				}
 			}
-			else if(post_fx == FX_BLUR || post_fx == FX_DEPTH_OF_FIELD) {
+			if (IN_STACK(FX_BLUR) || IN_STACK(FX_DEPTH_OF_FIELD)) {
 				ImGui::SliderInt("Blur size", &blur_size, 0, 30);
 			}
-			else if (post_fx == FX_GRAIN ) {
+			if (IN_STACK(FX_GRAIN)) {
 				ImGui::SliderFloat("Strength", &grain_strength, 0, 100);
 			}
-			else if (post_fx == FX_LENS_DISTORTION || post_fx == FX_CHROMATIC) {
+			if (IN_STACK(FX_LENS_DISTORTION) || IN_STACK(FX_CHROMATIC)) {
 				ImGui::SliderFloat("Distortion", &lens_distortion, -1, 1);
 			}
-			else if (post_fx == FX_LUT) {
+			if (IN_STACK(FX_LUT)) {
 				ImGui::SliderFloat("Amount", &lut_amount, 0, 1);
 			}
-			else if (post_fx == FX_BLOOM) {
+			if (IN_STACK(FX_BLOOM)) {
 				ImGui::SliderFloat("Threshold", &bloom_threshold, 0, 3);
 				ImGui::SliderFloat("Soft Threshold", &bloom_soft_threshold, 0, 1);
 				ImGui::SliderFloat("Intensity", &bloom_intensity, 0, 10);
 			}
-			else if (post_fx == FX_SHARPEN) {
+			if (IN_STACK(FX_SHARPEN)) {
 				ImGui::SliderFloat("Contrast", &sharpen_contrast, 0, 1);
 			}
+			#undef IN_STACK
 		}
 	}
 
@@ -1191,84 +1649,58 @@ void Renderer::renderInMenu()
 #endif
 }
 
-Texture* GTR::CubemapFromHDRE(const char* filename)
+//not cached with HDRE::Get: once the cubemap is uploaded it is deleted, which frees the half copy and unmaps the file
+static HDRE* loadHDRE(const char* filename)
+{
+	HDRE* hdre = new HDRE();
+	if (hdre->load(filename))
+		return hdre;
+	delete hdre;
+	return NULL;
+}
+
+Texture* GTR::CubemapFromHDRE(const char* filename, bool use_half)
 {
-	HDRE* hdre = HDRE::Get(filename);
+	HDRE* hdre = NULL;
+
+	//the cooked version already stores half floats, no conversion needed
+	std::string cooked_filename = std::string(filename) + ".half";
+	if (use_half)
+		hdre = loadHDRE(cooked_filename.c_str());
+
 	if (!hdre)
-		return NULL;
+	{
+		hdre = loadHDRE(filename);
+		if (!hdre)
+			return NULL;
+
+		//half floats halve the upload and the VRAM used
+		if (use_half && hdre->convertToHalf() && HDRE::save_cooked)
+			hdre->saveHalf(cooked_filename.c_str());
+	}
 
 	Texture* texture = new Texture();
 	
-	if (hdre->getFacesf(0))
+	if (hdre->getFaceh(0, 0))
 	{
-		texture->createCubemap(hdre->width, hdre->height, (Uint8**)hdre->getFacesf(0),
-			hdre->header.numChannels == 3 ? GL_RGB : GL_RGBA, GL_FLOAT);
+		texture->createCubemap(hdre->width, hdre->height, (Uint8**)hdre->getFacesh(0),
+			hdre->header.numChannels == 3 ? GL_RGB : GL_RGBA, GL_HALF_FLOAT);
 		for (int i = 1; i < hdre->levels; ++i)
 			texture->uploadCubemap(texture->format, texture->type, false,
-				(Uint8**)hdre->getFacesf(i), GL_RGBA32F, i);
+				(Uint8**)hdre->getFacesh(i), GL_RGBA16F, i);
 	}
 	else
-		if (hdre->getFacesh(0))
+		if (hdre->getFacef(0, 0))
 		{
-			texture->createCubemap(hdre->width, hdre->height, (Uint8**)hdre->getFacesh(0),
-				hdre->header.numChannels == 3 ? GL_RGB : GL_RGBA, GL_HALF_FLOAT);
+			texture->createCubemap(hdre->width, hdre->height, (Uint8**)hdre->getFacesf(0),
+				hdre->header.numChannels == 3 ? GL_RGB : GL_RGBA, GL_FLOAT);
 			for (int i = 1; i < hdre->levels; ++i)
 				texture->uploadCubemap(texture->format, texture->type, false,
-					(Uint8**)hdre->getFacesh(i), GL_RGBA16F, i);
+					(Uint8**)hdre->getFacesf(i), GL_RGBA32F, i);
 		}
-	return texture;
-}
 
-void GTR::Renderer::resizeFBOs()
-{
-	if (gbuffers_fbo.fbo_id != 0)
-	{
-		gbuffers_fbo.freeTextures();
-		gbuffers_fbo.create(Application::instance->window_width,
-			Application::instance->window_height,
-			3,	//num textures
-			GL_RGBA,
-			GL_FLOAT);	//precision
-	}
-
-	if (illumination_fbo.fbo_id != 0)
-	{
-		illumination_fbo.freeTextures();
-		illumination_fbo.create(Application::instance->window_width, 
-			Application::instance->window_height,
-			1, 			//one textures
-			GL_RGB, 		//three channels
-			GL_FLOAT, //1 byte
-			true);	//depth texture
-	}
-
-	if (ao_buffer)
-	{
-		ao_buffer->clear();
-		ao_buffer->create(Application::instance->window_width, Application::instance->window_height, GL_LUMINANCE, GL_UNSIGNED_BYTE);
-	}
-
-	if (gamma_fbo.fbo_id != 0) {
-		gamma_fbo.create(Application::instance->window_width, Application::instance->window_height,
-			1, 			//one texture
-			GL_RGB, 		//three channels
-			GL_FLOAT, //1 byte
-			true);	//depth texture
-	}
-
-	if (blur_fbo.fbo_id != 0) {
-		blur_fbo.create(Application::instance->window_width, Application::instance->window_height, 1, GL_RGBA, GL_FLOAT, false);
-	}
-
-	if (decals_fbo.fbo_id != 0)
-	{
-		decals_fbo.freeTextures();
-		decals_fbo.create(Application::instance->window_width,
-			Application::instance->window_height,
-			3,	//num textures
-			GL_RGBA,
-			GL_FLOAT);	//precision
-	}
+	delete hdre;
+	return texture;
 }
 
 void GTR::Renderer::renderSkybox(Texture* skybox, Camera* camera)
@@ -1296,9 +1728,9 @@ void GTR::Renderer::renderSkybox(Texture* skybox, Camera* camera)
 	glEnable(GL_DEPTH_TEST);
 }
 
-void GTR::Renderer::extractProbe(GTR::Scene* scene, sProbe& p)
+//renders the six views of the probe, the coefficients are computed from them in a job
+void GTR::Renderer::extractProbe(GTR::Scene* scene, sProbe& p, FloatImage* images)
 {
-	FloatImage images[6]; //here we will store the six views
 	Camera cam;
 
 	//set the fov to 90 and the aspect to 1
@@ -1328,9 +1760,19 @@ void GTR::Renderer::extractProbe(GTR::Scene* scene, sProbe& p)
 		//read the pixels back and store in a FloatImage
 		images[i].fromTexture(irr_fbo->color_textures[0]);
 	}
+}
+
+//the views of a probe waiting for its coefficients
+struct sProbeCapture {
+	FloatImage images[6];
+	sProbe* probe;
+	JobCounter counter;
+};
 
-	//compute the coefficients given the six images
-	p.sh = computeSH(images, false);
+static void computeProbeSH(void* data, int start, int end)
+{
+	sProbeCapture* capture = (sProbeCapture*)data;
+	capture->probe->sh = computeSH(capture->images, false);
 }
 
 void GTR::Renderer::updateIrradianceCache(GTR::Scene* scene)
@@ -1343,6 +1785,9 @@ void GTR::Renderer::updateIrradianceCache(GTR::Scene* scene)
 
 	std::cout << "Updating irradiance . . .";
 
+	//the GPU renders a probe while the jobs compute the coefficients of the previous ones
+	const int num_captures = 4;
+	sProbeCapture* captures = new sProbeCapture[num_captures];
 	int num_probes = irr->probes.size();
 	float probes_done = 0;
 	for (int i = 0; i < num_probes; i++)
@@ -1350,8 +1795,17 @@ void GTR::Renderer::updateIrradianceCache(GTR::Scene* scene)
 		probes_done = (float) ((i + 1) / (float)num_probes) * 100.0;
 		probes_done = floor(probes_done);
 		std::cout << "\r" << "Updating irradiance . . . " << probes_done  << "%";
-		extractProbe(scene, irr->probes[i]);
+
+		//its images can still be in use by the job of an older probe
+		sProbeCapture& capture = captures[i % num_captures];
+		JobSystem::wait(&capture.counter);
+		capture.probe = &irr->probes[i];
+		extractProbe(scene, *capture.probe, capture.images);
+		JobSystem::run(computeProbeSH, &capture, 0, 0, &capture.counter);
 	}
+	for (int i = 0; i < num_captures; i++)
+		JobSystem::wait(&captures[i].counter);
+	delete[] captures;
 
 	std::cout << " Finished!" << std::endl;
 
@@ -1439,13 +1893,299 @@ void GTR::Renderer::updateReflectionProbes(GTR::Scene* scene)
 	std::cout << " Finished!" << std::endl;
 }
 
+//called with the gbuffers_fbo bound
+struct compareSkinnedBatch {
+	bool operator ()(SkinnedEntity* a, SkinnedEntity* b) const {
+		if (a->mesh != b->mesh)
+			return a->mesh < b->mesh;
+		return a->material < b->material;
+	}
+};
+
+//per instance data of the skinned draws
+struct sSkinnedInstance {
+	Matrix44 model;
+	float palette_offset;	//first bone in the palette texture
+	float padding[3];
+};
+
+void GTR::Renderer::updateSkinnedEntities(GTR::Scene* scene)
+{
+	//the chunks of the clips that are not being played anymore are freed
+	Animation::ReleaseUnusedChunks();
+
+	skinned_entities.clear();
+	SceneComponents& components = scene->components;
+	for (int i = 0; i < components.size(); i++)
+	{
+		if (!components.visible[i] || components.types[i] != eEntityType::SKINNED)
+			continue;
+		SkinnedEntity* skinned = (SkinnedEntity*)components.entities[i];
+		if (!skinned->mesh || !skinned->animation || !skinned->material || skinned->mesh->bones_info.empty())
+			continue;
+		if (skinned->animation_instance == -1)
+			skinned->animation_instance = animation_system.addInstance(skinned->mesh, skinned->animation);
+		skinned_entities.push_back(skinned);
+	}
+	if (skinned_entities.empty())
+		return;
+
+	//the ones that can be drawn together are consecutive
+	std::sort(skinned_entities.begin(), skinned_entities.end(), compareSkinnedBatch());
+
+	animation_system.update(Application::instance->elapsed_time);
+
+	//all the palettes one after another, 256 bones per row
+	const int bones_per_row = 256;
+	int num_bones = animation_system.palettes.size();
+	int rows = (num_bones + bones_per_row - 1) / bones_per_row;
+	if (!palette_texture || palette_texture->height < rows)
+	{
+		if (palette_texture)
+			delete palette_texture;
+		palette_texture = new Texture(bones_per_row * 4, rows, GL_RGBA, GL_FLOAT, false, NULL, GL_RGBA32F);
+	}
+
+	Matrix44* palettes = &animation_system.palettes[0];
+	int full_rows = num_bones / bones_per_row;
+	int last_row = num_bones % bones_per_row;
+	glBindTexture(GL_TEXTURE_2D, palette_texture->texture_id);
+	if (full_rows)
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, bones_per_row * 4, full_rows, GL_RGBA, GL_FLOAT, palettes);
+	if (last_row)
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, full_rows, last_row * 4, 1, GL_RGBA, GL_FLOAT, palettes + full_rows * bones_per_row);
+	glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+void GTR::Renderer::renderSkinnedEntities(Camera* camera, bool shadowmap)
+{
+	if (skinned_entities.empty())
+		return;
+
+	Shader* shader = Shader::Get(shadowmap ? "skinned_depth" : "gbuffers_skinned");
+	if (!shader)
+		return;
+
+	shader->enable();
+	shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
+	shader->setUniform("u_camera_position", camera->eye);
+	shader->setTexture("u_palette_texture", palette_texture, 8);
+	if (!shadowmap)
+	{
+		shader->setUniform("u_apply_dithering", false);
+		shader->setUniform("u_last_pass", false);
+	}
+
+	if (!skinned_instances_vbo)
+		glGenBuffers(1, &skinned_instances_vbo);
+	int model_location = shader->getAttribLocation("a_model");
+	int offset_location = shader->getAttribLocation("a_palette_offset");
+
+	//enough for the largest batch, the frame memory is discarded at the end of the frame
+	sSkinnedInstance* instances = JobSystem::frameAlloc<sSkinnedInstance>(skinned_entities.size());
+	int start = 0;
+	while (start < skinned_entities.size())
+	{
+		SkinnedEntity* first = skinned_entities[start];
+		Mesh* mesh = first->mesh;
+
+		//the visible instances of this batch, the bounds are enlarged because the animation can move the vertices outside the bind pose
+		int num_instances = 0;
+		int end = start;
+		for (; end < skinned_entities.size(); end++)
+		{
+			SkinnedEntity* skinned = skinned_entities[end];
+			if (skinned->mesh != mesh || skinned->material != first->material)
+				break;
+			BoundingBox world_bounding = transformBoundingBox(skinned->model, mesh->box);
+			if (camera->testSphereInFrustum(world_bounding.center, world_bounding.halfsize.length() * 1.5) == 0)
+				continue;
+			sSkinnedInstance& instance = instances[num_instances++];
+			instance.model = skinned->model;
+			instance.palette_offset = animation_system.palette_offsets[skinned->animation_instance];
+		}
+		start = end;
+		if (!num_instances)
+			continue;
+
+		Material* material = first->material;
+		if (shadowmap && material->alpha_mode == GTR::eAlphaMode::BLEND)
+			continue;
+		if (!shadowmap)
+			material->uploadToShader(shader, linear_correction, tone_mapper.gamma);
+		if (material->two_sided)
+			glDisable(GL_CULL_FACE);
+		else
+			glEnable(GL_CULL_FACE);
+
+		glBindBuffer(GL_ARRAY_BUFFER, skinned_instances_vbo);
+		glBufferData(GL_ARRAY_BUFFER, num_instances * sizeof(sSkinnedInstance), instances, GL_STREAM_DRAW);
+		//mat4 count as 4 different attributes of vec4
+		for (int k = 0; model_location != -1 && k < 4; ++k)
+		{
+			glEnableVertexAttribArray(model_location + k);
+			glVertexAttribPointer(model_location + k, 4, GL_FLOAT, false, sizeof(sSkinnedInstance), (void*)(sizeof(float) * 4 * k));
+			glVertexAttribDivisor(model_location + k, 1);
+		}
+		if (offset_location != -1)
+		{
+			glEnableVertexAttribArray(offset_location);
+			glVertexAttribPointer(offset_location, 1, GL_FLOAT, false, sizeof(sSkinnedInstance), (void*)sizeof(Matrix44));
+			glVertexAttribDivisor(offset_location, 1);
+		}
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+		mesh->render(GL_TRIANGLES, -1, num_instances);
+
+		for (int k = 0; model_location != -1 && k < 4; ++k)
+		{
+			glDisableVertexAttribArray(model_location + k);
+			glVertexAttribDivisor(model_location + k, 0);
+		}
+		if (offset_location != -1)
+		{
+			glDisableVertexAttribArray(offset_location);
+			glVertexAttribDivisor(offset_location, 0);
+		}
+	}
+
+	glDisable(GL_CULL_FACE);
+	shader->disable();
+}
+
+//per instance data of the crowds
+struct sCrowdInstance {
+	Matrix44 model;
+	float time_offset;
+	float padding[3];
+};
+
+void GTR::Renderer::renderCrowds(GTR::Scene* scene, Camera* camera, bool shadowmap)
+{
+	Shader* shader = NULL;
+	SceneComponents& components = scene->components;
+	for (int i = 0; i < components.size(); i++)
+	{
+		if (!components.visible[i] || components.types[i] != eEntityType::CROWD)
+			continue;
+		CrowdEntity* crowd = (CrowdEntity*)components.entities[i];
+		VertexAnimation* vat = crowd->vertex_animation;
+		if (!vat || crowd->instance_models.empty())
+			continue;
+		if (shadowmap && crowd->material->alpha_mode == GTR::eAlphaMode::BLEND)
+			continue;
+
+		//culled as a whole, the instances never change so they are uploaded once
+		BoundingBox world_bounding = transformBoundingBox(crowd->model, crowd->bounding);
+		if (camera->testSphereInFrustum(world_bounding.center, world_bounding.halfsize.length()) == 0)
+			continue;
+
+		if (!crowd->instances_vbo)
+		{
+			std::vector<sCrowdInstance> instances(crowd->instance_models.size());
+			for (int j = 0; j < instances.size(); ++j)
+			{
+				instances[j].model = crowd->instance_models[j];
+				instances[j].time_offset = crowd->time_offsets[j];
+			}
+			glGenBuffers(1, &crowd->instances_vbo);
+			glBindBuffer(GL_ARRAY_BUFFER, crowd->instances_vbo);
+			glBufferData(GL_ARRAY_BUFFER, instances.size() * sizeof(sCrowdInstance), &instances[0], GL_STATIC_DRAW);
+			glBindBuffer(GL_ARRAY_BUFFER, 0);
+		}
+
+		if (!shader)
+		{
+			shader = Shader::Get(shadowmap ? "crowd_depth" : "gbuffers_crowd");
+			if (!shader)
+				return;
+			shader->enable();
+			shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
+			shader->setUniform("u_camera_position", camera->eye);
+			shader->setUniform("u_time", Application::instance->time);
+			if (!shadowmap)
+			{
+				shader->setUniform("u_apply_dithering", false);
+				shader->setUniform("u_last_pass", false);
+			}
+		}
+
+		shader->setUniform("u_model", crowd->model);
+		shader->setTexture("u_vat_positions", vat->positions_texture, 8);
+		shader->setTexture("u_vat_normals", vat->normals_texture, 10);
+		shader->setUniform("u_vat_min", vat->min);
+		shader->setUniform("u_vat_size", vat->max - vat->min);
+		shader->setUniform("u_vat_width", vat->width);
+		shader->setUniform("u_vat_rows_per_frame", vat->rows_per_frame);
+		shader->setUniform("u_vat_num_frames", vat->num_frames);
+		shader->setUniform("u_vat_fps", vat->fps);
+		if (!shadowmap)
+			crowd->material->uploadToShader(shader, linear_correction, tone_mapper.gamma);
+		if (crowd->material->two_sided)
+			glDisable(GL_CULL_FACE);
+		else
+			glEnable(GL_CULL_FACE);
+
+		int model_location = shader->getAttribLocation("a_model");
+		int offset_location = shader->getAttribLocation("a_time_offset");
+		glBindBuffer(GL_ARRAY_BUFFER, crowd->instances_vbo);
+		for (int k = 0; model_location != -1 && k < 4; ++k)
+		{
+			glEnableVertexAttribArray(model_location + k);
+			glVertexAttribPointer(model_location + k, 4, GL_FLOAT, false, sizeof(sCrowdInstance), (void*)(sizeof(float) * 4 * k));
+			glVertexAttribDivisor(model_location + k, 1);
+		}
+		if (offset_location != -1)
+		{
+			glEnableVertexAttribArray(offset_location);
+			glVertexAttribPointer(offset_location, 1, GL_FLOAT, false, sizeof(sCrowdInstance), (void*)sizeof(Matrix44));
+			glVertexAttribDivisor(offset_location, 1);
+		}
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+		crowd->mesh->render(GL_TRIANGLES, -1, crowd->instance_models.size());
+
+		for (int k = 0; model_location != -1 && k < 4; ++k)
+		{
+			glDisableVertexAttribArray(model_location + k);
+			glVertexAttribDivisor(model_location + k, 0);
+		}
+		if (offset_location != -1)
+		{
+			glDisableVertexAttribArray(offset_location);
+			glVertexAttribDivisor(offset_location, 0);
+		}
+	}
+
+	if (!shader)
+		return;
+	glDisable(GL_CULL_FACE);
+	shader->disable();
+}
+
 void GTR::Renderer::renderDecals(GTR::Scene* scene, Camera* camera) {
 
+	//only the decals inside the frustum
+	std::vector<DecalEntity*> decals;
+	SceneComponents& components = scene->components;
+	for (int i = 0; i < components.size(); i++)
+	{
+		if (components.types[i] != eEntityType::DECAL)
+			continue;
+		//sphere around the box (from -1 to 1 in every axis)
+		Matrix44& m = components.models[i];
+		Vector3 x = m.rightVector(), y = m.topVector(), z = m.frontVector();
+		float radius = sqrt(x.dot(x) + y.dot(y) + z.dot(z));
+		if (camera->testSphereInFrustum(m.getTranslation(), radius) == 0)
+			continue;
+		decals.push_back((DecalEntity*)components.entities[i]);
+	}
+	if (decals.empty())
+		return;
+
 	Shader* shader = Shader::Get("decals");
 	shader->enable();
-	shader->setTexture("u_color_texture", gbuffers_fbo.color_textures[0], 0);
-	shader->setTexture("u_normal_texture", gbuffers_fbo.color_textures[1], 1);
-	shader->setTexture("u_extra_texture", gbuffers_fbo.color_textures[2], 2);
+	//the depth is attached but not written (no depth test nor mask), so it can be read
 	shader->setTexture("u_depth_texture", gbuffers_fbo.depth_texture, 3);
 	shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
 	Matrix44 inv_viewproj = camera->viewprojection_matrix;
@@ -1460,37 +2200,100 @@ void GTR::Renderer::renderDecals(GTR::Scene* scene, Camera* camera) {
 		box->createCube();
 	}
 	glDisable(GL_DEPTH_TEST);
-	glDisable(GL_BLEND);
+	glDepthMask(false);
+	//only the albedo is changed, blended with the alpha of the decal
+	glColorMaski(0, true, true, true, false);
+	glColorMaski(1, false, false, false, false);
+	glColorMaski(2, false, false, false, false);
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	//render only the backfacing triangles of the box, so every pixel once even from inside
+	glEnable(GL_CULL_FACE);
+	glFrontFace(GL_CW);
 
-	for (int i = 0; i < scene->entities.size(); i++)
+	for (int i = 0; i < decals.size(); i++)
 	{
-		BaseEntity* ent = scene->entities[i];
-		if (ent->entity_type != eEntityType::DECAL)
-			continue;
-
-		DecalEntity* decal = (DecalEntity*)ent;
-		shader->setUniform("u_model", ent->model);
-		Matrix44 inv = ent->model;
+		DecalEntity* decal = decals[i];
+		shader->setUniform("u_model", decal->model);
+		Matrix44 inv = decal->model;
 		inv.inverse();
 		shader->setUniform("u_iModel", inv);
 		shader->setTexture("u_decal_texture", decal->albedo, 4);
 
 		box->render(GL_TRIANGLES);
 	}
+
+	//restore it
+	glFrontFace(GL_CCW);
+	glDisable(GL_BLEND);
+	glColorMask(true, true, true, true);
+	glDepthMask(true);
+	shader->disable();
+}
+
+//per pixel effects that can be combined in a single pass of postfx_fused
+static bool isFusablePostFX(ePostFX fx)
+{
+	return fx == FX_GRAIN || fx == FX_CHROMATIC || fx == FX_LENS_DISTORTION || fx == FX_LUT || fx == FX_SHARPEN;
 }
 
 void GTR::Renderer::renderPostFX(Camera* camera, Texture* texture)
+{
+	int w = Application::instance->window_width;
+	int h = Application::instance->window_height;
+
+	//split the stack in passes, consecutive fusable effects go in the same pass (each one only once)
+	std::vector< std::vector<ePostFX> > passes;
+	for (int i = 0; i < post_fx_stack.size(); ++i)
+	{
+		ePostFX fx = post_fx_stack[i];
+		bool fuse = isFusablePostFX(fx) && passes.size() && isFusablePostFX(passes.back()[0]) &&
+			std::find(passes.back().begin(), passes.back().end(), fx) == passes.back().end();
+		if (fuse)
+			passes.back().push_back(fx);
+		else
+			passes.push_back(std::vector<ePostFX>(1, fx));
+	}
+
+	if (passes.empty())
+	{
+		texture->toViewport();
+		return;
+	}
+
+	//every pass reads the output of the previous one, the last one goes to the screen
+	Texture* input = texture;
+	FBO* input_fbo = NULL;
+	for (int i = 0; i < passes.size(); ++i)
+	{
+		FBO* output = NULL;
+		if (i < passes.size() - 1)
+			output = rt_pool.acquire(w, h);
+
+		if (isFusablePostFX(passes[i][0]))
+			applyFusedPostFX(passes[i], input, output);
+		else
+			applyPostFX(passes[i][0], input, camera, output);
+
+		if (input_fbo)
+			rt_pool.release(input_fbo);
+		input_fbo = output;
+		if (output)
+			input = output->color_textures[0];
+	}
+}
+
+void GTR::Renderer::applyPostFX(ePostFX fx, Texture* input, Camera* camera, FBO* output)
 {
 	Shader* shader = NULL;
 	int w = Application::instance->window_width;
 	int h = Application::instance->window_height;
 	Matrix44 inv_vp = camera->viewprojection_matrix;
 	inv_vp.inverse();
-	float t = (float)Application::instance->time;
-	float x_rnd = rand();
-	float y_rnd = rand();
+	FBO* temp_fbo = NULL;
+	int num_levels = 0;
 
-	switch (post_fx) {
+	switch (fx) {
 		case FX_MOTION_BLUR:
 			if (gbuffers_fbo.depth_texture) {
 				shader = Shader::Get("motion_blur");
@@ -1508,94 +2311,342 @@ void GTR::Renderer::renderPostFX(Camera* camera, Texture* texture)
 			shader->setUniform("u_iRes", Vector2(1.0 / (float)w, 1.0 / (float)h));
 			break;
 		case FX_BLUR:
-			shader = Shader::Get("blur");
-			shader->enable();
-			shader->setUniform("u_blur_size", blur_size);
-			shader->setUniform("u_iRes", Vector2(1.0 / (float)w, 1.0 / (float)h));
-			break;
+			blurTexture(input, output, blur_size);
+			return;
 		case FX_DEPTH_OF_FIELD:
-			if (blur_fbo.fbo_id == 0) {
-				blur_fbo.create(w, h, 1, GL_RGBA, GL_FLOAT, false);
-			}
-			//blur step
-			shader = Shader::Get("blur");
-			shader->enable();
-			shader->setUniform("u_blur_size", blur_size);
-			shader->setUniform("u_iRes", Vector2(1.0 / (float)w, 1.0 / (float)h));
-			blur_fbo.bind();
-			glClearColor(0,0,0, 1.0);
-			glClear(GL_COLOR_BUFFER_BIT);
-			glDisable(GL_BLEND);
-			glDisable(GL_DEPTH_TEST);
-			texture->toViewport(shader);
-			blur_fbo.unbind();
-			shader->disable();
+			//blur step, at half resolution
+			temp_fbo = rt_pool.acquire(w / 2, h / 2);
+			blurTexture(input, temp_fbo, blur_size);
 			//once have it the blurried texture, apply the depth of field postfx
 			shader = Shader::Get("dof");
 			shader->enable();
 			shader->setUniform("u_blur_size", blur_size);
 			shader->setUniform("u_iRes", Vector2(1.0 / (float)w, 1.0 / (float)h));
-			shader->setTexture("u_blur_texture", blur_fbo.color_textures[0], 3);
+			shader->setTexture("u_blur_texture", temp_fbo->color_textures[0], 3);
 			shader->setTexture("u_depth_texture", gbuffers_fbo.depth_texture, 4);
 			shader->setUniform("u_inverse_viewprojection", inv_vp);
 			shader->setUniform("u_camera_nearfar", Vector2(camera->near_plane, camera->far_plane));
 			shader->setUniform("u_camera_position", camera->eye);
 			break;
-		case FX_GRAIN:
-			shader = Shader::Get("grain");
-			shader->enable();
-			shader->setUniform("u_iRes", Vector2(1.0 / (float)w, 1.0 / (float)h));
-			shader->setUniform("u_strength", grain_strength);
-			shader->setUniform("u_time", t);
-			break;
-		case FX_CHROMATIC:
-			shader = Shader::Get("chromatic");
-			shader->enable();
-			shader->setUniform("u_iRes", Vector2(1.0 / (float)w, 1.0 / (float)h));
-			shader->setUniform("u_lens_distortion", lens_distortion);
-			break;
 		case FX_BLOOM:
+			temp_fbo = computeBloomChain(input, num_levels);
 			shader = Shader::Get("bloom");
 			shader->enable();
+			shader->setTexture("u_bloom_texture", temp_fbo->color_textures[0], 3);
+			shader->setUniform("u_bloom_levels", (float)num_levels);
 			shader->setUniform("u_iRes", Vector2(1.0 / (float)w, 1.0 / (float)h));
 			shader->setUniform("u_threshold", bloom_threshold);
 			shader->setUniform("u_soft_threshold", bloom_soft_threshold);
 			shader->setUniform("u_intensity", bloom_intensity);
 			break;
-		case FX_LENS_DISTORTION:
-			shader = Shader::Get("lens");
-			shader->enable();
-			shader->setUniform("u_iRes", Vector2(1.0 / (float)w, 1.0 / (float)h));
-			shader->setUniform("u_lens_distortion", lens_distortion);
-			break;
-		case FX_LUT:
-			if (lut_texture == NULL) {
-				lut_texture = new Texture();
-				lut_texture->create(512, 512, GL_RGB, GL_UNSIGNED_INT, false);
-				lut_texture->load("data/textures/lut.png", false);
-			}
-			shader = Shader::Get("lut");
-			shader->enable();
-			shader->setUniform("u_iRes", Vector2(1.0 / (float)w, 1.0 / (float)h));
-			shader->setTexture("u_lut_texture", lut_texture, 3);
-			shader->setUniform("u_amount", lut_amount);
-			break;
 		case FX_FXAA:
 			shader = Shader::Get("fxaa");
 			shader->enable();
 			shader->setUniform("u_iRes", Vector2(1.0 / (float)w, 1.0 / (float)h));
 			break;
-		case FX_SHARPEN:
-			shader = Shader::Get("sharpen");
-			shader->enable();
-			shader->setUniform("u_iRes", Vector2(1.0 / (float)w, 1.0 / (float)h));
-			shader->setUniform("u_amount_contrast", sharpen_contrast);
-			break;
 		default:
 			break;
 	}
 
-	texture->toViewport(shader);
+	if (output)
+		output->bind();
+	input->toViewport(shader);
+	if (output)
+		output->unbind();
+
+	if (temp_fbo)
+		rt_pool.release(temp_fbo);
+}
+
+void GTR::Renderer::blurTexture(Texture* input, FBO* output, float radius)
+{
+	int w = output ? output->color_textures[0]->width : Application::instance->window_width;
+	int h = output ? output->color_textures[0]->height : Application::instance->window_height;
+
+	glDisable(GL_BLEND);
+	glDisable(GL_DEPTH_TEST);
+
+	//horizontal pass, it can also reduce the resolution
+	FBO* temp = rt_pool.acquire(w, h);
+	Shader* shader = Shader::Get("blur");
+	shader->enable();
+	shader->setUniform("u_direction", Vector2(1, 0));
+	shader->setUniform("u_blur_size", radius);
+	temp->bind();
+	input->toViewport(shader);
+	temp->unbind();
+
+	//vertical pass, the radius is in pixels of the temporal target
+	shader->enable();
+	shader->setUniform("u_direction", Vector2(0, 1));
+	shader->setUniform("u_blur_size", radius * w / (float)input->width);
+	if (output)
+		output->bind();
+	temp->color_textures[0]->toViewport(shader);
+	if (output)
+		output->unbind();
+
+	rt_pool.release(temp);
+}
+
+FBO* GTR::Renderer::computeBloomChain(Texture* input, int& num_levels)
+{
+	const int max_levels = 6;
+	FBO* levels[max_levels];
+	int w = Application::instance->window_width / 2;
+	int h = Application::instance->window_height / 2;
+
+	glDisable(GL_BLEND);
+	glDisable(GL_DEPTH_TEST);
+
+	//bright parts at half resolution
+	//the levels are added, they need more than the 0..1 range
+	levels[0] = rt_pool.acquire(w, h, GL_RGB, GL_HALF_FLOAT);
+	Shader* shader = Shader::Get("bloom_prefilter");
+	shader->enable();
+	shader->setUniform("u_threshold", bloom_threshold);
+	shader->setUniform("u_soft_threshold", bloom_soft_threshold);
+	levels[0]->bind();
+	input->toViewport(shader);
+	levels[0]->unbind();
+
+	//down the chain until it is too small
+	num_levels = 1;
+	shader = Shader::Get("bloom_down");
+	while (num_levels < max_levels && w / 2 >= 8 && h / 2 >= 8)
+	{
+		w /= 2;
+		h /= 2;
+		levels[num_levels] = rt_pool.acquire(w, h, GL_RGB, GL_HALF_FLOAT);
+		levels[num_levels]->bind();
+		levels[num_levels - 1]->color_textures[0]->toViewport(shader);
+		levels[num_levels]->unbind();
+		num_levels++;
+	}
+
+	//and up again, every level is added to the bigger one
+	shader = Shader::Get("bloom_up");
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_ONE, GL_ONE);
+	for (int i = num_levels - 1; i > 0; --i)
+	{
+		levels[i - 1]->bind();
+		levels[i]->color_textures[0]->toViewport(shader);
+		levels[i - 1]->unbind();
+		rt_pool.release(levels[i]);
+	}
+	glDisable(GL_BLEND);
+
+	return levels[0];
+}
+
+void GTR::Renderer::applyFusedPostFX(std::vector< ePostFX >& effects, Texture* input, FBO* output)
+{
+	//macro names of the fusable effects, FX_PREV_<NAME> tells each one which effect goes before
+	static const char* names[NUM_POSTFX] = { NULL, NULL, NULL, NULL, "GRAIN", "CHROMATIC", NULL, "LENS", "LUT", NULL, "SHARPEN" };
+	static const char* functions[NUM_POSTFX] = { NULL, NULL, NULL, NULL, "fx_grain", "fx_chromatic", NULL, "fx_lens", "fx_lut", NULL, "fx_sharpen" };
+
+	//the key has 4 bits per effect in order
+	unsigned int key = 0;
+	std::string macros;
+	const char* prev = "fx_source";
+	for (int i = 0; i < effects.size(); ++i)
+	{
+		ePostFX fx = effects[i];
+		key |= (fx + 1) << (i * 4);
+		macros += std::string("#define FX_PREV_") + names[fx] + " " + prev + "\n";
+		prev = functions[fx];
+	}
+	macros += std::string("#define FX_LAST ") + prev + "\n";
+
+	Shader* shader = Shader::Get("postfx_fused");
+	if (!shader)
+		return;
+	shader = shader->getPermutation(key, macros);
+
+	int w = Application::instance->window_width;
+	int h = Application::instance->window_height;
+	shader->enable();
+	shader->setUniform("u_iRes", Vector2(1.0 / (float)w, 1.0 / (float)h));
+	shader->setUniform("u_time", (float)Application::instance->time);
+	shader->setUniform("u_strength", grain_strength);
+	shader->setUniform("u_lens_distortion", lens_distortion);
+	shader->setUniform("u_amount_contrast", sharpen_contrast);
+	if (std::find(effects.begin(), effects.end(), FX_LUT) != effects.end())
+	{
+		if (lut_texture == NULL) {
+			lut_texture = new Texture();
+			lut_texture->create(512, 512, GL_RGB, GL_UNSIGNED_INT, false);
+			lut_texture->load("data/textures/lut.png", false);
+		}
+		shader->setTexture("u_lut_texture", lut_texture, 3);
+		shader->setUniform("u_amount", lut_amount);
+	}
+
+	if (output)
+		output->bind();
+	input->toViewport(shader);
+	if (output)
+		output->unbind();
+}
+
+FBO* GTR::RenderTargetPool::acquire(int width, int height, int format, int type)
+{
+	for (int i = 0; i < targets.size(); ++i)
+	{
+		sTarget& target = targets[i];
+		Texture* texture = target.fbo->color_textures[0];
+		if (target.in_use || texture->width != width || texture->height != height || texture->format != format || texture->type != type)
+			continue;
+		target.in_use = true;
+		target.last_frame = frame;
+		return target.fbo;
+	}
+
+	sTarget target;
+	target.fbo = new FBO();
+	target.fbo->create(width, height, 1, format, type, false);
+	//FBO textures are nearest by default, the blur and bloom passes rely on bilinear fetches
+	setBilinearFilter(target.fbo->color_textures[0]);
+	target.in_use = true;
+	target.last_frame = frame;
+	targets.push_back(target);
+	return target.fbo;
+}
+
+void GTR::RenderTargetPool::release(FBO* fbo)
+{
+	for (int i = 0; i < targets.size(); ++i)
+		if (targets[i].fbo == fbo)
+		{
+			targets[i].in_use = false;
+			return;
+		}
+	assert(0 && "FBO not from the pool");
+}
+
+GTR::RenderGraph::RenderGraph(RenderTargetPool* pool)
+{
+	this->pool = pool;
+	clear();
+}
+
+void GTR::RenderGraph::clear()
+{
+	resources.clear();
+	passes.clear();
+	importTarget("screen", NULL);
+}
+
+int GTR::RenderGraph::createTarget(const char* name, float scale, int format, int type)
+{
+	sResource resource;
+	resource.name = name;
+	resource.scale = scale;
+	resource.format = format;
+	resource.type = type;
+	resource.fbo = NULL;
+	resource.imported = false;
+	resource.first_pass = resource.last_pass = -1;
+	resources.push_back(resource);
+	return resources.size() - 1;
+}
+
+int GTR::RenderGraph::importTarget(const char* name, FBO* fbo)
+{
+	int index = createTarget(name, 1.0, 0, 0);
+	resources[index].fbo = fbo;
+	resources[index].imported = true;
+	return index;
+}
+
+int GTR::RenderGraph::addPass(int id)
+{
+	sPass pass;
+	pass.id = id;
+	pass.alive = false;
+	passes.push_back(pass);
+	return passes.size() - 1;
+}
+
+void GTR::RenderGraph::compile()
+{
+	//from the last pass to the first one, a pass is needed if it writes the screen or something read by a needed pass
+	std::vector<bool> needed(resources.size(), false);
+	needed[SCREEN] = true;
+	for (int i = passes.size() - 1; i >= 0; --i)
+	{
+		sPass& pass = passes[i];
+		pass.alive = false;
+		for (int j = 0; j < pass.writes.size(); ++j)
+			if (needed[pass.writes[j]])
+				pass.alive = true;
+		if (!pass.alive)
+			continue;
+		for (int j = 0; j < pass.reads.size(); ++j)
+			needed[pass.reads[j]] = true;
+	}
+
+	//lifetimes, from the first to the last alive pass that uses it
+	for (int i = 0; i < passes.size(); ++i)
+	{
+		sPass& pass = passes[i];
+		if (!pass.alive)
+			continue;
+		for (int j = 0; j < pass.reads.size() + pass.writes.size(); ++j)
+		{
+			int index = j < pass.reads.size() ? pass.reads[j] : pass.writes[j - pass.reads.size()];
+			sResource& resource = resources[index];
+			if (resource.first_pass == -1)
+				resource.first_pass = i;
+			resource.last_pass = i;
+		}
+	}
+}
+
+bool GTR::RenderGraph::beginPass(int pass)
+{
+	if (!passes[pass].alive)
+		return false;
+
+	for (int i = 0; i < resources.size(); ++i)
+	{
+		sResource& resource = resources[i];
+		if (resource.imported || resource.first_pass != pass)
+			continue;
+		int w = Application::instance->window_width * resource.scale;
+		int h = Application::instance->window_height * resource.scale;
+		resource.fbo = pool->acquire(w, h, resource.format, resource.type);
+	}
+	return true;
+}
+
+void GTR::RenderGraph::endPass(int pass)
+{
+	//the targets not used anymore can be taken by the next passes
+	for (int i = 0; i < resources.size(); ++i)
+	{
+		sResource& resource = resources[i];
+		if (resource.imported || resource.last_pass != pass)
+			continue;
+		pool->release(resource.fbo);
+		resource.fbo = NULL;
+	}
+}
+
+void GTR::RenderTargetPool::endFrame()
+{
+	frame++;
+
+	//after a resize or disabling an effect their targets are not needed anymore
+	for (int i = targets.size() - 1; i >= 0; --i)
+	{
+		sTarget& target = targets[i];
+		if (target.in_use || frame - target.last_frame < 60)
+			continue;
+		delete target.fbo;
+		targets.erase(targets.begin() + i);
+	}
 }
 
 void GTR::Renderer::readIrradiance(GTR::Scene* scene)
@@ -1605,73 +2656,290 @@ void GTR::Renderer::readIrradiance(GTR::Scene* scene)
 	storeIrradianceToTexture();
 }
 
-std::vector<Vector3> generateSpherePoints(int num, float radius, bool hemi)
+GTR::VolumetricFog::VolumetricFog()
+{
+	grid_width = 160;
+	grid_height = 90;
+	grid_slices = 64;
+	density = 0.001;
+	max_distance = 1000;
+	use_temporal = true;
+	history_index = 0;
+	history_valid = false;
+	frame = 0;
+}
+
+void GTR::VolumetricFog::uploadGrid(Shader* shader, Camera* camera)
+{
+	shader->setUniform("u_froxel_dims", Vector3(grid_width, grid_height, grid_slices));
+	shader->setUniform("u_froxel_near", camera->near_plane);
+	float far_plane = camera->far_plane < max_distance ? camera->far_plane : max_distance;
+	shader->setUniform("u_froxel_far", far_plane);
+}
+
+bool GTR::VolumetricFog::compute(GTR::Scene* scene, Camera* camera)
 {
-	std::vector<Vector3> points;
-	points.resize(num);
-	for (int i = 0; i < num; i += 3)
+	const int tiles = 8;	//FROXEL_TILES in the atlas
+	assert(grid_slices <= tiles * tiles);
+	if (scatter_fbo.fbo_id == 0 || scatter_fbo.width != grid_width * tiles || scatter_fbo.height != grid_height * tiles)
 	{
-		Vector3& p = points[i];
-		float u = random();
-		float v = random();
-		float theta = u * 2.0 * PI;
-		float phi = acos(2.0 * v - 1.0);
-		float r = cbrt(random() * 0.9 + 0.1) * radius;
-		float sinTheta = sin(theta);
-		float cosTheta = cos(theta);
-		float sinPhi = sin(phi);
-		float cosPhi = cos(phi);
-		p.x = r * sinPhi * cosTheta;
-		p.y = r * sinPhi * sinTheta;
-		p.z = r * cosPhi;
-		if (hemi && p.z < 0)
-			p.z *= -1.0;
+		FBO* fbos[4] = { &scatter_fbo, &history_fbo[0], &history_fbo[1], &integrated_fbo };
+		for (int i = 0; i < 4; ++i)
+		{
+			fbos[i]->create(grid_width * tiles, grid_height * tiles, 1, GL_RGBA, GL_FLOAT, false);
+			setBilinearFilter(fbos[i]->color_textures[0]);
+		}
+		history_valid = false;
 	}
-	return points;
+
+	Matrix44 inv_vp = camera->viewprojection_matrix;
+	inv_vp.inverse();
+	Mesh* quad = Mesh::getQuad();
+	glDisable(GL_DEPTH_TEST);
+
+	//in-scattering of every light added in the froxels, the extinction of the media is the clear alpha
+	scatter_fbo.bind();
+	glClearColor(0.0, 0.0, 0.0, density);
+	glClear(GL_COLOR_BUFFER_BIT);
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_ONE, GL_ONE);
+	Shader* shader = Shader::Get("froxel_inject");
+	shader->enable();
+	uploadGrid(shader, camera);
+	shader->setUniform("u_inverse_viewprojection", inv_vp);
+	shader->setUniform("u_camera_position", camera->eye);
+	shader->setUniform("u_density", density);
+	//a different depth inside the froxel every frame, the history accumulates them
+	shader->setUniform("u_jitter", use_temporal ? halton(frame % 16 + 1, 2) : 0.5f);
+	scene->components.cullLights(camera, visible_lights, SceneComponents::LIGHT_VOLUMETRIC);
+	int num_lights = visible_lights.size();
+	for (int i = 0; i < num_lights; i++)
+	{
+		LightEntity* light = scene->components.light_entities[visible_lights[i]];
+		light->uploadToShader(shader, true);
+		quad->render(GL_TRIANGLES);
+	}
+	shader->disable();
+	glDisable(GL_BLEND);
+	scatter_fbo.unbind();
+
+	if (num_lights == 0)
+	{
+		history_valid = false;
+		return false;
+	}
+
+	//reprojection of the previous froxels
+	FBO& history = history_fbo[history_index];
+	FBO& prev_history = history_fbo[1 - history_index];
+	shader = Shader::Get("froxel_resolve");
+	shader->enable();
+	uploadGrid(shader, camera);
+	shader->setTexture("u_texture", scatter_fbo.color_textures[0], 0);
+	shader->setTexture("u_history_texture", prev_history.color_textures[0], 1);
+	shader->setUniform("u_inverse_viewprojection", inv_vp);
+	shader->setUniform("u_camera_position", camera->eye);
+	shader->setUniform("u_prev_viewprojection", prev_viewprojection);
+	shader->setUniform("u_prev_camera_position", prev_eye);
+	shader->setUniform("u_history_weight", (use_temporal && history_valid) ? 0.9f : 0.0f);
+	history.bind();
+	quad->render(GL_TRIANGLES);
+	history.unbind();
+
+	//accumulated along the view distance
+	shader = Shader::Get("froxel_integrate");
+	shader->enable();
+	uploadGrid(shader, camera);
+	shader->setTexture("u_texture", history.color_textures[0], 0);
+	integrated_fbo.bind();
+	quad->render(GL_TRIANGLES);
+	integrated_fbo.unbind();
+	shader->disable();
+
+	prev_viewprojection = camera->viewprojection_matrix;
+	prev_eye = camera->eye;
+	history_index = 1 - history_index;
+	history_valid = true;
+	frame++;
+	return true;
 }
 
-GTR::SSAOFX::SSAOFX()
+void GTR::VolumetricFog::composite(Texture* depth_buffer, Camera* camera)
 {
-	intensity = 1.0;
-	//random points
-	points = generateSpherePoints(64, 1.0, true);
+	Matrix44 inv_vp = camera->viewprojection_matrix;
+	inv_vp.inverse();
+
+	Shader* shader = Shader::Get("froxel_composite");
+	shader->enable();
+	uploadGrid(shader, camera);
+	shader->setTexture("u_froxel_texture", integrated_fbo.color_textures[0], 0);
+	shader->setTexture("u_depth_texture", depth_buffer, 1);
+	shader->setUniform("u_inverse_viewprojection", inv_vp);
+	shader->setUniform("u_camera_position", camera->eye);
+	shader->setUniform("u_iRes", Vector2(1.0 / (float)depth_buffer->width, 1.0 / (float)depth_buffer->height));
+	//scene * transmittance + scattered light
+	glDisable(GL_DEPTH_TEST);
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_ONE, GL_SRC_ALPHA);
+	Mesh::getQuad()->render(GL_TRIANGLES);
+	glDisable(GL_BLEND);
+	shader->disable();
+}
+
+GTR::AutoExposure::AutoExposure()
+{
+	enabled = false;
+	speed = 1.5;
+	min_lum = 0.05;
+	max_lum = 8.0;
+	target_lum = average_lum = 1.4;
+	pbos[0] = pbos[1] = pbos[2] = 0;
+	fences[0] = fences[1] = fences[2] = NULL;
+	pbo_index = 0;
 }
 
-void GTR::SSAOFX::apply(Texture* depth_buffer, Texture* normal_buffer, Camera* cam, Texture* output)
+void GTR::AutoExposure::update(Texture* hdr_texture, float dt)
 {
-	////bind the texture we want to change
-	//depth_buffer->bind();
+	const int size = 256;
+	const int last_level = 8;	//1x1
+
+	if (lum_fbo.fbo_id == 0)
+	{
+		lum_fbo.create(size, size, 1, GL_RGB, GL_FLOAT, false, true);	//log luminance can be negative
+		glGenBuffers(3, pbos);
+		for (int i = 0; i < 3; ++i)
+		{
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, pbos[i]);
+			glBufferData(GL_PIXEL_PACK_BUFFER, sizeof(float), NULL, GL_STREAM_READ);
+		}
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	}
+
+	//the oldest request (from some frames ago), only read if the gpu already finished it
+	if (fences[pbo_index])
+	{
+		GLenum state = glClientWaitSync(fences[pbo_index], 0, 0);
+		if (state == GL_ALREADY_SIGNALED || state == GL_CONDITION_SATISFIED)
+		{
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, pbos[pbo_index]);
+			float* log_average = (float*)glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, sizeof(float), GL_MAP_READ_BIT);
+			if (log_average)
+				target_lum = clamp((float)exp(*log_average), min_lum, max_lum);
+			glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		}
+		glDeleteSync(fences[pbo_index]);
+		fences[pbo_index] = NULL;
+	}
 
-	////disable using mipmaps
-	//glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	//log luminance of this frame, averaged by the mipmaps
+	glDisable(GL_DEPTH_TEST);
+	glDisable(GL_BLEND);
+	Shader* shader = Shader::Get("luminance");
+	shader->enable();
+	shader->setTexture("u_texture", hdr_texture, 0);
+	lum_fbo.bind();
+	Mesh::getQuad()->render(GL_TRIANGLES);
+	lum_fbo.unbind();
+	shader->disable();
 
-	////enable bilinear filtering
-	//glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	Texture* texture = lum_fbo.color_textures[0];
+	glBindTexture(GL_TEXTURE_2D, texture->texture_id);
+	glGenerateMipmap(GL_TEXTURE_2D);
+	//copied to the buffer by the gpu, this call doesnt wait
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, pbos[pbo_index]);
+	glGetTexImage(GL_TEXTURE_2D, last_level, GL_RED, GL_FLOAT, 0);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	fences[pbo_index] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	pbo_index = (pbo_index + 1) % 3;
+
+	//eyes adapt progressively, independent of the framerate
+	average_lum += (target_lum - average_lum) * (1.0 - exp(-dt * speed));
+}
+
+GTR::SSAOFX::SSAOFX()
+{
+	intensity = 1.0;
+	samples = 12;
+	radius = 10.0;
+	use_temporal = true;
+	history_index = 0;
+	history_valid = false;
+	frame = 0;
+	last_frame_number = -1;
+}
 
-	//depth_buffer->unbind();
+void GTR::SSAOFX::apply(Texture* depth_buffer, Texture* normal_buffer, Camera* cam, const Matrix44& prev_viewprojection, FBO* output, long frame_number)
+{
+	//the pass is culled while nobody reads the ao, the history of before is not reprojected
+	if (frame_number != last_frame_number + 1)
+		history_valid = false;
+	last_frame_number = frame_number;
 
-	FBO* fboS = Texture::getGlobalFBO(output);
-	fboS->bind();
+	int w = depth_buffer->width / 2;
+	int h = depth_buffer->height / 2;
 
+	//the history is lost when the size changes
+	if (half_fbo.fbo_id == 0 || half_fbo.width != w || half_fbo.height != h)
+	{
+		//they store the depth, it needs the full precision
+		half_fbo.create(w, h, 1, GL_RGBA, GL_FLOAT, false, true);
+		history_fbo[0].create(w, h, 1, GL_RGBA, GL_FLOAT, false, true);
+		history_fbo[1].create(w, h, 1, GL_RGBA, GL_FLOAT, false, true);
+		history_valid = false;
+	}
 
-	Mesh* quad = Mesh::getQuad();
+	Matrix44 inv_viewproj = cam->viewprojection_matrix;
+	inv_viewproj.inverse();
+	Matrix44 inv_prev_viewproj = prev_viewprojection;
+	inv_prev_viewproj.inverse();
 
 	glDisable(GL_DEPTH_TEST);
 	glDisable(GL_BLEND);
 
-	Shader* shader = Shader::Get("ssao");
+	//downsample depth and normals, so the samples read a smaller texture
+	Shader* shader = Shader::Get("ssao_downsample");
 	shader->enable();
-	shader->setUniform("u_viewprojection", cam->viewprojection_matrix);
 	shader->setTexture("u_normal_texture", normal_buffer, 1);
 	shader->setTexture("u_depth_texture", depth_buffer, 3);
-	shader->setUniform3Array("u_points", (float*)&points[0], points.size());
+	half_fbo.bind();
+	Mesh::getQuad()->render(GL_TRIANGLES);
+	half_fbo.unbind();
+
+	//ao + reprojection of the previous result
+	FBO& history = history_fbo[history_index];
+	FBO& prev_history = history_fbo[1 - history_index];
+	shader = Shader::Get("ssao");
+	shader->enable();
+	shader->setTexture("u_halfres_texture", half_fbo.color_textures[0], 1);
+	shader->setTexture("u_history_texture", prev_history.color_textures[0], 3);
+	shader->setUniform("u_viewprojection", cam->viewprojection_matrix);
 	//viewprojection to obtain the uv in the depthtexture of any random position of our world
-	Matrix44 inv_viewproj = cam->viewprojection_matrix;
-	inv_viewproj.inverse();
 	shader->setUniform("u_inverse_viewprojection", inv_viewproj);
-	shader->setUniform("u_iRes", Vector2(1.0 / (float)depth_buffer->width, 1.0 / (float)depth_buffer->height));
+	shader->setUniform("u_prev_viewprojection", prev_viewprojection);
+	shader->setUniform("u_inverse_prev_viewprojection", inv_prev_viewproj);
+	shader->setUniform("u_iRes", Vector2(1.0 / (float)w, 1.0 / (float)h));
+	shader->setUniform("u_samples", samples);
+	shader->setUniform("u_radius", radius);
+	shader->setUniform("u_frame", (float)(frame % 64));
+	shader->setUniform("u_history_weight", (use_temporal && history_valid) ? 0.9f : 0.0f);
+	history.bind();
+	Mesh::getQuad()->render(GL_TRIANGLES);
+	history.unbind();
+
+	//back to full resolution using the depth to not mix across edges
+	shader = Shader::Get("ssao_upsample");
+	shader->enable();
+	shader->setTexture("u_ao_texture", history.color_textures[0], 1);
+	shader->setTexture("u_depth_texture", depth_buffer, 3);
+	shader->setUniform("u_camera_nearfar", Vector2(cam->near_plane, cam->far_plane));
+	output->bind();
+	Mesh::getQuad()->render(GL_TRIANGLES);
+	output->unbind();
+	shader->disable();
 
-	quad->render(GL_TRIANGLES);
-	
-	fboS->unbind();
+	history_index = 1 - history_index;
+	history_valid = true;
+	frame++;
 }
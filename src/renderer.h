@@ -1,6 +1,7 @@
 #pragma once
 #include "prefab.h"
 #include "fbo.h"
+#include "animation.h"
 
 //forward declarations
 class Camera;
@@ -61,7 +62,104 @@ namespace GTR {
 		FX_LENS_DISTORTION,
 		FX_LUT,
 		FX_FXAA,
-		FX_SHARPEN
+		FX_SHARPEN,
+		NUM_POSTFX
+	};
+
+	//transient render targets reused between passes and frames, identified by size and format
+	class RenderTargetPool {
+	public:
+		struct sTarget {
+			FBO* fbo;
+			bool in_use;
+			long last_frame; //last frame it was used
+		};
+		std::vector<sTarget> targets;
+		long frame;
+
+		RenderTargetPool() { frame = 0; }
+		FBO* acquire(int width, int height, int format = GL_RGBA, int type = GL_UNSIGNED_BYTE); //by default for tonemapped colors
+		void release(FBO* fbo);
+		void endFrame(); //frees the ones that have not been used for a while
+	};
+
+	//declarative frame: every pass says which resources it reads and writes. compile() culls the passes
+	//whose results are not used and gives every transient target a lifetime, so it is only taken from the
+	//pool between its first and last pass (targets not alive at the same time share the same FBO).
+	//Transient targets are sized from the window when acquired, so resizing needs nothing else
+	class RenderGraph {
+	public:
+		enum { SCREEN = 0 }; //resource 0 is the screen, the passes that write it are always kept
+
+		struct sResource {
+			const char* name;
+			float scale;	//of the window size
+			int format;
+			int type;
+			FBO* fbo;	//imported ones always, transient ones only while alive
+			bool imported;
+			int first_pass;
+			int last_pass;
+		};
+
+		struct sPass {
+			int id;	//what the renderer has to execute
+			std::vector<int> reads;
+			std::vector<int> writes;
+			bool alive;
+		};
+
+		std::vector<sResource> resources;
+		std::vector<sPass> passes;
+		RenderTargetPool* pool;
+
+		RenderGraph(RenderTargetPool* pool);
+		void clear();
+		int createTarget(const char* name, float scale, int format, int type);
+		int importTarget(const char* name, FBO* fbo);
+		int addPass(int id);
+		void read(int pass, int resource) { passes[pass].reads.push_back(resource); }
+		void write(int pass, int resource) { passes[pass].writes.push_back(resource); }
+		void compile();
+
+		//around the execution of every pass, begin returns false if it was culled
+		bool beginPass(int pass);
+		void endPass(int pass);
+
+		FBO* getFBO(int resource) { return resources[resource].fbo; }
+		Texture* getTexture(int resource) { FBO* fbo = resources[resource].fbo; return fbo ? fbo->color_textures[0] : NULL; }
+	};
+
+	//passes of the deferred render graph
+	enum eDeferredPass {
+		PASS_GBUFFERS,
+		PASS_SSAO,
+		PASS_SHOW_GBUFFERS,
+		PASS_SHOW_AO,
+		PASS_SHOW_IRRADIANCE,
+		PASS_ILLUMINATION,
+		PASS_PRESENT,
+		PASS_TONEMAP,
+		PASS_UPSAMPLE,
+		PASS_POSTFX,
+		PASS_SHOW_SHADOWMAP
+	};
+
+	//flags of the shader permutations (see PERMUTATION in the atlas)
+	enum eGBuffersFlags {
+		GBUFFERS_NORMAL = 1 << 0,
+		GBUFFERS_METALLIC_ROUGHNESS = 1 << 1,
+		GBUFFERS_EMISSIVE = 1 << 2,
+		GBUFFERS_REFLECTION = 1 << 3,
+		GBUFFERS_DITHERING = 1 << 4
+	};
+
+	enum eDeferredFlags {
+		DEFERRED_LINEAR_CORRECTION = 1 << 0,
+		DEFERRED_SSAO = 1 << 1,
+		DEFERRED_IRRADIANCE = 1 << 2,
+		DEFERRED_EMISSIVE = 1 << 3,
+		DEFERRED_SHADOWS = 1 << 4
 	};
 
 	class renderCall {
@@ -127,13 +225,73 @@ namespace GTR {
 		}
 	};
 
+	//average luminance of the hdr frame for the tone mapper: log luminance reduced with the mipmaps on the gpu
+	//and read back some frames later through pixel buffers, so the cpu never waits for it
+	class AutoExposure {
+	public:
+		bool enabled;
+		float speed;	//how fast it adapts, per second
+		float min_lum;
+		float max_lum;
+		float target_lum;	//last value read from the gpu
+		float average_lum;	//adapted over time, the one used
+
+		FBO lum_fbo;	//log luminance, power of two so the last mipmap is the exact average
+		unsigned int pbos[3];
+		GLsync fences[3];
+		int pbo_index;
+
+		AutoExposure();
+		void update(Texture* hdr_texture, float dt);
+	};
+
+	//participating media in a low resolution view aligned grid (froxels), the slices stored as tiles of a 2D atlas.
+	//every volumetric light is injected once per froxel, blended with the reprojected previous frames
+	//and integrated along the view distance, so the composite is a single fetch per pixel
+	class VolumetricFog {
+	public:
+		int grid_width;
+		int grid_height;
+		int grid_slices;	//exponentially distributed from the near plane to max_distance
+		float density;
+		float max_distance;
+		bool use_temporal;
+
+		FBO scatter_fbo;	//in-scattering + extinction of this frame
+		FBO history_fbo[2];	//the same accumulated with the previous frames
+		FBO integrated_fbo;	//scattering + transmittance from the camera to each froxel
+		int history_index;
+		bool history_valid;
+		int frame;
+		Matrix44 prev_viewprojection;
+		Vector3 prev_eye;
+		std::vector< int > visible_lights;	//indices in the scene light components
+
+		VolumetricFog();
+		//returns false if there is no volumetric light to render
+		bool compute(GTR::Scene* scene, Camera* camera);
+		//over the binded target, using the depth of the scene
+		void composite(Texture* depth_buffer, Camera* camera);
+		void uploadGrid(Shader* shader, Camera* camera);
+	};
+
+	//computed at half resolution, accumulated with the previous frames and upsampled with the depth
 	class SSAOFX {
 	public:
 		float intensity;
-		std::vector<Vector3> points;
+		int samples;	//per pixel and frame, the kernel is rotated every pixel and frame
+		float radius;
+		bool use_temporal;
+
+		FBO half_fbo;	//normal + depth at half resolution
+		FBO history_fbo[2];	//ao + depth, ping-pong between frames
+		int history_index;
+		bool history_valid;
+		int frame;
+		long last_frame_number;	//of the renderer, the history is too old if it was not applied the previous frame
 
 		SSAOFX();
-		void apply(Texture* depth_buffer, Texture* normal_buffer, Camera* cam, Texture* output);
+		void apply(Texture* depth_buffer, Texture* normal_buffer, Camera* cam, const Matrix44& prev_viewprojection, FBO* output, long frame_number);
 	};
 	
 	// This class is in charge of rendering anything in our system.
@@ -146,17 +304,12 @@ namespace GTR {
 		FBO fbo;
 		FBO shadow_singlepass;
 		FBO gbuffers_fbo;
-		FBO decals_fbo;
-		FBO illumination_fbo;
-		FBO ssao_fbo;
-		FBO gamma_fbo;
 		FBO* irr_fbo;
-		FBO blur_fbo;
 		FBO reflection_fbo;
+		RenderTargetPool rt_pool;
+		RenderGraph graph;
 
-		Texture* color_buffer;
-		Texture* ao_buffer;
-		Texture* blur_ao_buffer;
+		Texture* ao_buffer;	//of this frame, NULL if the ssao was not computed
 		Texture* probes_texture;
 		Texture* noise_texture;
 		Texture* lut_texture;
@@ -166,16 +319,28 @@ namespace GTR {
 		eRenderDeferredMode render_deferred_mode;
 		ePipelineMode pipeline_mode;
 		eQuality quality;
-		ePostFX post_fx;
+		ePostFX post_fx;	//selected in the menu to be added to the stack
+		std::vector< ePostFX > post_fx_stack;	//applied in order
 		std::vector< renderCall > render_calls;
+		std::vector< std::vector< renderCall > > render_call_batches;	//built in parallel, then joined in render_calls
 		std::vector< LightEntity* > lights;
+		std::vector< int > visible_lights;	//indices in the scene light components, filled by the light passes
 		IrradianceEntity* irr;
 		ReflectionEntity* reflection_entity;
 		SSAOFX ssao;
+		AutoExposure auto_exposure;
+		VolumetricFog volumetric_fog;
+		//skinned characters: the bones of all of them in one texture, drawn instanced per mesh and material
+		AnimationSystem animation_system;
+		std::vector< SkinnedEntity* > skinned_entities;	//of this frame, sorted by mesh and material
+		Texture* palette_texture;	//4 texels (the rows of the matrix) per bone
+		unsigned int skinned_instances_vbo;
 		toneMapper tone_mapper;
 
 		//some flags
 		bool show_ao = false;
+		bool use_ssao = true;	//the ssao is only computed when used or shown
+		bool use_froxel_volumetrics = true;	//instead of raymarching every light per pixel
 		bool rendering_shadowmap = false;
 		bool show_depth_camera = false;
 		bool show_gbuffers = false;
@@ -193,6 +358,9 @@ namespace GTR {
 		bool apply_post_fx = true;
 		bool use_reflection = true;
 		bool show_reflection_probes = false;
+		bool use_permutations = true;	//specialized shaders instead of branching on uniforms
+		bool use_texture_pools = true;	//gbuffers read the materials from texture arrays + uniform buffer
+		bool texture_pools_built = false;
 		int light_camera;	//light to show on depth camera
 
 		//PostFX
@@ -206,6 +374,27 @@ namespace GTR {
 		float sharpen_contrast = 0.5;
 		float grain_strength = 20;
 
+		//dynamic resolution: the scene is rendered smaller when the gpu time goes over the target
+		//and the temporal upsample (jittered projection + reprojected history) brings it back to the window size
+		bool use_dynamic_resolution = false;
+		float resolution_scale = 1.0;
+		float min_resolution_scale = 0.5;
+		float target_gpu_ms = 16.6;
+		float gpu_ms = 0.0;	//of a previous frame, measured with a timer query
+		int render_width;	//size of the gbuffers and the lighting targets
+		int render_height;
+		//ring of timer queries, one is only begun again once its result was read so a late gpu doesnt discard them
+		enum { NUM_GPU_TIME_QUERIES = 4 };
+		unsigned int gpu_time_queries[NUM_GPU_TIME_QUERIES];
+		bool gpu_time_issued[NUM_GPU_TIME_QUERIES];
+		int gpu_time_next;	//the query of the next frame
+		bool gpu_time_measuring;	//false the frames the whole ring is waiting for the gpu
+		int frames_since_scale_change;
+		long frame_number;
+		FBO taa_history[2];
+		int taa_index;
+		bool taa_history_valid;
+
 		Matrix44 vp_previous;
 
 		float computeDistanceToCamera(Matrix44 node_model, Mesh* mesh, Vector3 cam_pos);
@@ -226,14 +415,23 @@ namespace GTR {
 		//create the render calls + sort them 
 		void createRenderCalls(GTR::Scene* scene, Camera* camera);
 	
-		//to render a whole prefab (with all its nodes)
-		void prefabToNode(const Matrix44& model, GTR::Prefab* prefab, Camera* camera, sReflectionProbe* _nearest_reflection_probe = NULL);
+		//to render a whole prefab (with all its nodes), called from the jobs so the calls go to output
+		void prefabToNode(const Matrix44& model, GTR::Prefab* prefab, Camera* camera, std::vector< renderCall >& output, sReflectionProbe* _nearest_reflection_probe = NULL);
 
-		//to render one node from the prefab and its children
-		void nodeToRenderCall(const Matrix44& model, GTR::Node* node, Camera* camera, sReflectionProbe* _nearest_reflection_probe = NULL);
+		//to render one node from the prefab and its children, model is the global one of its parent
+		void nodeToRenderCall(const Matrix44& model, GTR::Node* node, Camera* camera, std::vector< renderCall >& output, sReflectionProbe* _nearest_reflection_probe = NULL);
 
 		void renderForward(GTR::Scene* scene, std::vector< renderCall >& data, Camera* camera, ePipelineMode pipeline = NO_PIPELINE, eRenderMode mode = SHOW_NONE);
 		void renderDeferred(GTR::Scene* scene, std::vector< renderCall >& data, Camera* camera);
+		//passes of renderDeferred
+		void fillGBuffers(GTR::Scene* scene, std::vector< renderCall >& data, Camera* camera);
+		void renderIllumination(GTR::Scene* scene, std::vector< renderCall >& data, Camera* camera, FBO* output);
+		void renderIrradianceCoeffs(Camera* camera);
+		void applyToneMapper(Texture* input, FBO* output);
+		//reconstructs the window resolution from the scaled frame and the history
+		void applyTemporalUpsample(Texture* input, const Matrix44& jittered_vp, Vector2 jitter_uv, FBO* output);
+		//reads the gpu time of the previous frames and adapts resolution_scale
+		void updateResolutionScale();
 
 		//show gBuffers
 		void renderGBuffers(Camera* camera);
@@ -245,6 +443,10 @@ namespace GTR {
 		void renderReconstructedScene(GTR::Scene* scene, Camera* camera);
 		void renderVolumetricLights(GTR::Scene* scene, Camera* camera);
 
+		//texture pools for the gbuffers pass
+		void buildTexturePools(GTR::Scene* scene);
+		void renderMeshPooled(const Matrix44 model, Mesh* mesh, GTR::Material* material, Shader* shader, sReflectionProbe* _nearest_reflection_probe = NULL);
+
 		//to render one mesh given its material and transformation matrix
 		void renderMeshWithMaterial(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera, Shader* sh = NULL, ePipelineMode pipeline = NO_PIPELINE,eRenderMode mode = SHOW_NONE, sReflectionProbe* _nearest_reflection_probe = NULL);
 
@@ -263,21 +465,34 @@ namespace GTR {
 
 		void changeQualityFBO();
 
-		void resizeFBOs();
 		void renderSkybox(Texture* skybox, Camera* camera);
 
 		void updateIrradianceCache(GTR::Scene* scene);
-		void extractProbe(GTR::Scene* scene, sProbe& p);
+		void extractProbe(GTR::Scene* scene, sProbe& p, FloatImage* images);
 		void storeIrradianceToTexture();
 		void updateReflectionProbes(GTR::Scene* scene);
 
 		void renderDecals(GTR::Scene* scene, Camera* camera);
 
+		//animates the skinned entities and uploads their palettes, once per frame
+		void updateSkinnedEntities(GTR::Scene* scene);
+		//one instanced draw per mesh and material, only depth when rendering a shadowmap
+		void renderSkinnedEntities(Camera* camera, bool shadowmap);
+		//crowds play their baked vertex animation in the shader, one instanced draw per crowd
+		void renderCrowds(GTR::Scene* scene, Camera* camera, bool shadowmap);
+
+		//apply the post_fx_stack to the texture and show it on the screen
 		void renderPostFX(Camera* camera, Texture* texture);
+		void applyPostFX(ePostFX fx, Texture* input, Camera* camera, FBO* output);
+		void applyFusedPostFX(std::vector< ePostFX >& effects, Texture* input, FBO* output);
+		//separable gaussian blur, radius in pixels of the input (output NULL is the screen)
+		void blurTexture(Texture* input, FBO* output, float radius);
+		//downsample/upsample chain of the bright parts, returns the first level (from the rt_pool) and the number of levels
+		FBO* computeBloomChain(Texture* input, int& num_levels);
 
 		void readIrradiance(GTR::Scene* scene);
 	};
 
-	Texture* CubemapFromHDRE(const char* filename);
+	Texture* CubemapFromHDRE(const char* filename, bool use_half = true);
 
 };
\ No newline at end of file
@@ -2,9 +2,13 @@
 #include "utils.h"
 
 #include "prefab.h"
+#include "animation.h"
 #include "application.h"
 #include "extra/cJSON.h"
 
+#include <algorithm>
+#include <set>
+
 GTR::Scene* GTR::Scene::instance = NULL;
 
 GTR::Scene::Scene()
@@ -23,6 +27,11 @@ void GTR::Scene::clear()
 		delete ent;
 	}
 	entities.resize(0);
+	lights.clear();
+	reflect_probes.clear();
+	irr = NULL;
+	components.clear();
+	partition.clear();
 }
 
 
@@ -44,6 +53,14 @@ void GTR::Scene::addEntity(BaseEntity* entity)
 	{
 		reflect_probes.push_back( (GTR::sReflectionProbe*)entity );
 	}
+
+	entity->handle = components.add(entity);
+}
+
+void GTR::Scene::updateEntity(BaseEntity* entity)
+{
+	if (entity->handle != -1)
+		components.update(entity->handle);
 }
 
 void GTR::Scene::updatePrefabNearestReflectionProbe()
@@ -56,7 +73,10 @@ void GTR::Scene::updatePrefabNearestReflectionProbe()
 		{
 			PrefabEntity* pent = (GTR::PrefabEntity*)ent;
 			if (pent->prefab)
+			{
 				pent->updateNearestReflectionProbe();
+				updateEntity(pent);
+			}
 		}
 	}
 	std::cout << "Finished" << std::endl;
@@ -67,6 +87,13 @@ bool GTR::Scene::load(const char* filename)
 	std::string content;
 
 	this->filename = filename;
+
+	//the snapshot is used while the JSON has not changed since it was written
+	long long source_time = getFileTime(filename);
+	std::string snapshot_filename = std::string(filename) + ".sbin";
+	if (source_time && loadSnapshot(snapshot_filename.c_str(), source_time))
+		return true;
+
 	std::cout << " + Reading scene JSON: " << filename << "..." << std::endl;
 
 	if (!readFile(filename, content))
@@ -91,6 +118,11 @@ bool GTR::Scene::load(const char* filename)
 	main_camera.center = readJSONVector3(json, "camera_target", main_camera.center);
 	main_camera.fov = readJSONNumber(json, "camera_fov", main_camera.fov);
 
+	//before the entities, so the prefabs are loaded when the camera gets near
+	cJSON* partition_json = cJSON_GetObjectItemCaseSensitive(json, "partition");
+	if (partition_json)
+		partition.configure(partition_json);
+
 	//entities
 	cJSON* entities_json = cJSON_GetObjectItemCaseSensitive(json, "entities");
 	cJSON* entity_json;
@@ -143,29 +175,665 @@ bool GTR::Scene::load(const char* filename)
 		}
 
 		ent->configure(entity_json);
+		//added before reading it, so the components are copied again
+		updateEntity(ent);
 	}
 
 	//free memory
 	cJSON_Delete(json);
 
+	if (source_time)
+		writeSnapshot(snapshot_filename.c_str(), source_time);
+
+	return true;
+}
+
+struct sSceneHeader {
+	int version;
+	int header_bytes;
+	long long source_time;	//modification time of the JSON it comes from
+	int num_strings;
+	int num_entities;
+	Vector3 background_color;
+	Vector3 ambient_light;
+	Vector3 camera_eye;
+	Vector3 camera_center;
+	float camera_fov;
+	int environment;	//string id
+	int partition;	//1 if the prefabs are streamed
+	float cell_size;
+	float load_radius;
+	float prediction_time;
+	float max_load_ms;
+	double memory_budget;
+};
+
+//"SBIN", header, string offsets, strings, and for every entity: type, name, visible, model, payload size and payload
+bool GTR::Scene::writeSnapshot(const char* filename, long long source_time)
+{
+	SceneSnapshotWriter writer;
+
+	sSceneHeader header = sSceneHeader();
+	header.version = SCENE_BIN_VERSION;
+	header.header_bytes = sizeof(sSceneHeader);
+	header.source_time = source_time;
+	header.num_entities = entities.size();
+	header.background_color = background_color;
+	header.ambient_light = ambient_light;
+	header.camera_eye = main_camera.eye;
+	header.camera_center = main_camera.center;
+	header.camera_fov = main_camera.fov;
+	header.environment = writer.addString(environment_file);
+	header.partition = partition.enabled;
+	header.cell_size = partition.cell_size;
+	header.load_radius = partition.load_radius;
+	header.prediction_time = partition.prediction_time;
+	header.max_load_ms = partition.max_load_ms;
+	header.memory_budget = partition.memory_budget;
+
+	for (int i = 0; i < entities.size(); ++i)
+	{
+		BaseEntity* ent = entities[i];
+		writer.write((int)ent->entity_type);
+		writer.writeString(ent->name);
+		writer.write((uint8)ent->visible);
+		writer.write(ent->model);
+
+		//the size first, so the reader can check it read all of it
+		size_t size_pos = writer.data.size();
+		writer.write((uint32)0);
+		ent->writeSnapshot(writer);
+		uint32 payload_size = writer.data.size() - size_pos - sizeof(uint32);
+		memcpy(&writer.data[size_pos], &payload_size, sizeof(uint32));
+	}
+	header.num_strings = writer.strings.size();
+
+	FILE* f = fopen(filename, "wb");
+	if (f == NULL)
+	{
+		std::cout << "[ERROR] cannot write scene snapshot: " << filename << std::endl;
+		return false;
+	}
+
+	//watermark
+	fwrite("SBIN", sizeof(char), 4, f);
+	fwrite((void*)&header, sizeof(sSceneHeader), 1, f);
+
+	//strings, null terminated so they can be used from the mapped file
+	std::vector<uint32> offsets(1, 0);
+	for (int i = 0; i < writer.strings.size(); ++i)
+		offsets.push_back(offsets.back() + writer.strings[i].size() + 1);
+	fwrite((void*)&offsets[0], sizeof(uint32) * offsets.size(), 1, f);
+	for (int i = 0; i < writer.strings.size(); ++i)
+		fwrite(writer.strings[i].c_str(), writer.strings[i].size() + 1, 1, f);
+
+	if (writer.data.size())
+		fwrite((void*)&writer.data[0], writer.data.size(), 1, f);
+
+	fclose(f);
+	return true;
+}
+
+bool GTR::Scene::loadSnapshot(const char* filename, long long source_time)
+{
+	size_t size = 0;
+	char* data = (char*)mapFile(filename, size);
+	if (data == NULL)
+		return false;
+
+	//watermark
+	if (size < 4 + sizeof(sSceneHeader) || memcmp(data, "SBIN", 4) != 0)
+	{
+		std::cout << "[ERROR] loading scene snapshot: invalid content: " << filename << std::endl;
+		unmapFile(data, size);
+		return false;
+	}
+
+	sSceneHeader header;
+	memcpy(&header, data + 4, sizeof(sSceneHeader));
+	if (header.version != SCENE_BIN_VERSION || header.header_bytes != sizeof(sSceneHeader) || header.source_time != source_time)
+	{
+		std::cout << " + Scene snapshot is outdated: " << filename << std::endl;
+		unmapFile(data, size);
+		return false;
+	}
+
+	std::cout << " + Reading scene snapshot: " << filename << "..." << std::endl;
+	long time = getTime();
+
+	SceneSnapshotReader reader;
+	reader.pos = data + 4 + sizeof(sSceneHeader);
+	reader.end = data + size;
+
+	//a truncated or damaged file is read again from the JSON, so everything is checked before creating the entities.
+	//the string offsets go in order and every string ends in the table
+	bool valid = header.num_strings >= 0 && header.num_entities >= 0 &&
+		(size_t)header.num_strings < (size_t)(reader.end - reader.pos) / sizeof(uint32);
+	if (valid)
+	{
+		std::vector<uint32> offsets(header.num_strings + 1);
+		memcpy(&offsets[0], reader.pos, sizeof(uint32) * offsets.size());
+		reader.pos += sizeof(uint32) * offsets.size();
+		valid = offsets[0] == 0 && offsets[header.num_strings] <= (size_t)(reader.end - reader.pos);
+		for (int i = 0; i < header.num_strings && valid; ++i)
+			valid = offsets[i + 1] > offsets[i] && reader.pos[offsets[i + 1] - 1] == 0;
+		if (valid)
+		{
+			for (int i = 0; i < header.num_strings; ++i)
+				reader.strings.push_back(reader.pos + offsets[i]);
+			reader.pos += offsets[header.num_strings];
+		}
+	}
+	valid = valid && header.environment >= 0 && header.environment < header.num_strings;
+
+	//the records of the entities, without their payload
+	const char* entities_start = reader.pos;
+	for (int i = 0; i < header.num_entities && valid && !reader.failed; ++i)
+	{
+		reader.read<int>();
+		reader.readString();
+		reader.read<uint8>();
+		reader.read<Matrix44>();
+		uint32 payload_size = reader.read<uint32>();
+		if (payload_size > (size_t)(reader.end - reader.pos))
+			reader.failed = true;
+		else
+			reader.pos += payload_size;
+	}
+	if (!valid || reader.failed)
+	{
+		std::cout << "[ERROR] loading scene snapshot: truncated or damaged file: " << filename << std::endl;
+		unmapFile(data, size);
+		return false;
+	}
+	reader.pos = entities_start;
+
+	//read global properties
+	background_color = header.background_color;
+	ambient_light = header.ambient_light;
+	main_camera.eye = header.camera_eye;
+	main_camera.center = header.camera_center;
+	main_camera.fov = header.camera_fov;
+	environment_file = reader.strings[header.environment];
+	partition.enabled = header.partition != 0;
+	partition.cell_size = header.cell_size;
+	partition.load_radius = header.load_radius;
+	partition.prediction_time = header.prediction_time;
+	partition.max_load_ms = header.max_load_ms;
+	partition.memory_budget = header.memory_budget;
+
+	//entities, in the same order they were in the JSON
+	for (int i = 0; i < header.num_entities; ++i)
+	{
+		eEntityType type = (eEntityType)reader.read<int>();
+		BaseEntity* ent = createEntity(type);
+		if (!ent)
+			ent = new BaseEntity();
+
+		addEntity(ent);
+		ent->name = reader.readString();
+		ent->visible = reader.read<uint8>() != 0;
+		ent->model = reader.read<Matrix44>();
+
+		//the entity cannot read past its payload
+		uint32 payload_size = reader.read<uint32>();
+		const char* payload_end = reader.pos + payload_size;
+		const char* file_end = reader.end;
+		reader.end = payload_end;
+		ent->readSnapshot(reader);
+		if (reader.pos != payload_end)
+			reader.failed = true;
+		reader.pos = payload_end;
+		reader.end = file_end;
+		updateEntity(ent);
+
+		if (reader.failed)
+		{
+			std::cout << "[ERROR] loading scene snapshot: damaged entity " << ent->name << ": " << filename << std::endl;
+			clear();
+			unmapFile(data, size);
+			return false;
+		}
+	}
+
+	unmapFile(data, size);
+	std::cout << " + Scene snapshot: " << header.num_entities << " entities in " << (getTime() - time) << "ms" << std::endl;
 	return true;
 }
 
+int GTR::SceneSnapshotWriter::addString(const std::string& str)
+{
+	auto it = string_ids.find(str);
+	if (it != string_ids.end())
+		return it->second;
+	int id = strings.size();
+	strings.push_back(str);
+	string_ids[str] = id;
+	return id;
+}
+
+void GTR::SceneSnapshotWriter::write(const void* ptr, size_t size)
+{
+	data.insert(data.end(), (const char*)ptr, (const char*)ptr + size);
+}
+
+void GTR::SceneSnapshotReader::read(void* ptr, size_t size)
+{
+	if (failed || size > (size_t)(end - pos))
+	{
+		failed = true;
+		memset(ptr, 0, size);
+		return;
+	}
+	memcpy(ptr, pos, size);
+	pos += size;
+}
+
+const char* GTR::SceneSnapshotReader::readString()
+{
+	int id = read<int>();
+	if (id < 0 || id >= strings.size())
+	{
+		failed = true;
+		return "";
+	}
+	return strings[id];
+}
+
+GTR::EntityHandle GTR::SceneComponents::add(BaseEntity* entity)
+{
+	EntityHandle handle;
+	if (free_handles.size())
+	{
+		handle = free_handles.back();
+		free_handles.pop_back();
+	}
+	else
+	{
+		handle = handle_to_index.size();
+		handle_to_index.push_back(-1);
+	}
+
+	int index = entities.size();
+	handle_to_index[handle] = index;
+	index_to_handle.push_back(handle);
+	entities.push_back(entity);
+	types.push_back(entity->entity_type);
+	visible.push_back(entity->visible);
+	models.push_back(entity->model);
+	world_bounds.push_back(BoundingBox());
+	prefabs.push_back(NULL);
+	reflection_probes.push_back(NULL);
+	light_indices.push_back(-1);
+
+	if (entity->entity_type == LIGHT)
+	{
+		light_indices[index] = light_entities.size();
+		light_owners.push_back(index);
+		light_entities.push_back((LightEntity*)entity);
+		light_positions.push_back(Vector3());
+		light_max_distances.push_back(0);
+		light_types.push_back(0);
+		light_flags.push_back(0);
+	}
+
+	update(handle);
+	return handle;
+}
+
+void GTR::SceneComponents::update(EntityHandle handle)
+{
+	int index = handle_to_index[handle];
+	BaseEntity* entity = entities[index];
+	visible[index] = entity->visible;
+	models[index] = entity->model;
+
+	if (entity->entity_type == PREFAB)
+	{
+		PrefabEntity* pent = (PrefabEntity*)entity;
+		prefabs[index] = pent->prefab;
+		reflection_probes[index] = pent->nearest_reflection_probe;
+		if (pent->prefab)
+			world_bounds[index] = transformBoundingBox(entity->model, pent->prefab->root.getBoundingBox());
+	}
+
+	int light = light_indices[index];
+	if (light != -1)
+	{
+		LightEntity* lent = (LightEntity*)entity;
+		light_positions[light] = entity->model.getTranslation();
+		light_max_distances[light] = lent->max_distance;
+		light_types[light] = lent->light_type;
+		light_flags[light] = (lent->cast_shadow ? LIGHT_CAST_SHADOW : 0) | (lent->is_volumetric ? LIGHT_VOLUMETRIC : 0);
+	}
+}
+
+void GTR::SceneComponents::remove(EntityHandle handle)
+{
+	int index = handle_to_index[handle];
+	int last = entities.size() - 1;
+
+	//the light first, the same way
+	int light = light_indices[index];
+	if (light != -1)
+	{
+		int last_light = light_entities.size() - 1;
+		light_entities[light] = light_entities[last_light];
+		light_positions[light] = light_positions[last_light];
+		light_max_distances[light] = light_max_distances[last_light];
+		light_types[light] = light_types[last_light];
+		light_flags[light] = light_flags[last_light];
+		light_owners[light] = light_owners[last_light];
+		light_indices[light_owners[light]] = light;
+		light_entities.pop_back();
+		light_positions.pop_back();
+		light_max_distances.pop_back();
+		light_types.pop_back();
+		light_flags.pop_back();
+		light_owners.pop_back();
+		light_indices[index] = -1;	//its light is gone, also when it was the last one
+	}
+
+	entities[index] = entities[last];
+	types[index] = types[last];
+	visible[index] = visible[last];
+	models[index] = models[last];
+	world_bounds[index] = world_bounds[last];
+	prefabs[index] = prefabs[last];
+	reflection_probes[index] = reflection_probes[last];
+	light_indices[index] = light_indices[last];
+	index_to_handle[index] = index_to_handle[last];
+	handle_to_index[index_to_handle[index]] = index;
+	if (light_indices[index] != -1)
+		light_owners[light_indices[index]] = index;
+
+	entities.pop_back();
+	types.pop_back();
+	visible.pop_back();
+	models.pop_back();
+	world_bounds.pop_back();
+	prefabs.pop_back();
+	reflection_probes.pop_back();
+	light_indices.pop_back();
+	index_to_handle.pop_back();
+
+	handle_to_index[handle] = -1;
+	free_handles.push_back(handle);
+}
+
+void GTR::SceneComponents::clear()
+{
+	entities.clear();
+	types.clear();
+	visible.clear();
+	models.clear();
+	world_bounds.clear();
+	prefabs.clear();
+	reflection_probes.clear();
+	light_entities.clear();
+	light_positions.clear();
+	light_max_distances.clear();
+	light_types.clear();
+	light_flags.clear();
+	handle_to_index.clear();
+	index_to_handle.clear();
+	free_handles.clear();
+	light_indices.clear();
+	light_owners.clear();
+}
+
+void GTR::SceneComponents::cullLights(Camera* camera, std::vector<int>& output, uint8 flags) const
+{
+	output.clear();
+	for (int i = 0; i < light_positions.size(); ++i)
+	{
+		if ((light_flags[i] & flags) != flags)
+			continue;
+		if (camera->testSphereInFrustum(light_positions[i], light_max_distances[i]))
+			output.push_back(i);
+	}
+}
+
+GTR::ScenePartition::ScenePartition()
+{
+	enabled = false;
+	cell_size = 200;
+	load_radius = 600;
+	prediction_time = 1;
+	max_load_ms = 4;
+	memory_budget = 512 * 1024 * 1024;
+	resident_bytes = 0;
+	has_last_eye = false;
+}
+
+void GTR::ScenePartition::configure(cJSON* json)
+{
+	enabled = true;
+	cell_size = readJSONNumber(json, "cell_size", cell_size);
+	load_radius = readJSONNumber(json, "load_radius", load_radius);
+	prediction_time = readJSONNumber(json, "prediction_time", prediction_time);
+	max_load_ms = readJSONNumber(json, "max_load_ms", max_load_ms);
+	memory_budget = (size_t)readJSONNumber(json, "memory_budget_mb", memory_budget / (1024 * 1024)) * 1024 * 1024;
+}
+
+//the entities are deleted by the scene, the prefabs stay in the cache like when not streaming
+void GTR::ScenePartition::clear()
+{
+	enabled = false;
+	cells.clear();
+	cells_by_coord.clear();
+	prefab_users.clear();
+	mesh_users.clear();
+	resident_bytes = 0;
+	velocity = Vector3();
+	has_last_eye = false;
+}
+
+void GTR::ScenePartition::addEntity(PrefabEntity* entity)
+{
+	Vector3 pos = entity->model.getTranslation();
+	std::pair<int, int> coord((int)floor(pos.x / cell_size), (int)floor(pos.z / cell_size));
+	auto it = cells_by_coord.find(coord);
+	if (it == cells_by_coord.end())
+	{
+		sCell cell;
+		cell.x = coord.first;
+		cell.z = coord.second;
+		cell.loaded = false;
+		cell.wanted = false;
+		cell.distance = 0;
+		it = cells_by_coord.insert(std::make_pair(coord, (int)cells.size())).first;
+		cells.push_back(cell);
+	}
+	cells[it->second].entities.push_back(entity);
+}
+
+static bool compareCellsByDistance(const GTR::ScenePartition::sCell* a, const GTR::ScenePartition::sCell* b)
+{
+	return a->distance < b->distance;
+}
+
+void GTR::ScenePartition::update(Scene* scene, Camera* camera, float seconds_elapsed)
+{
+	if (!enabled || !cells.size())
+		return;
+
+	//predict where the camera will be from its velocity, smoothed so a single jump does not change everything
+	Vector3 eye = camera->eye;
+	if (has_last_eye && seconds_elapsed > 0)
+		velocity = velocity * 0.9 + (eye - last_eye) * (0.1 / seconds_elapsed);
+	last_eye = eye;
+	has_last_eye = true;
+	Vector3 predicted = eye + velocity * prediction_time;
+
+	//the cells near any of both positions are needed, the nearest to the predicted one are loaded first
+	float radius = load_radius + cell_size * 0.7071;	//from the center, so the cells touching the circle count
+	std::vector<sCell*> to_load;
+	for (int i = 0; i < cells.size(); ++i)
+	{
+		sCell& cell = cells[i];
+		Vector3 center((cell.x + 0.5) * cell_size, 0, (cell.z + 0.5) * cell_size);
+		cell.distance = (center - Vector3(predicted.x, 0, predicted.z)).length();
+		cell.wanted = cell.distance < radius || (center - Vector3(eye.x, 0, eye.z)).length() < radius;
+		if (cell.wanted && !cell.loaded)
+			to_load.push_back(&cell);
+	}
+	std::sort(to_load.begin(), to_load.end(), compareCellsByDistance);
+
+	//loading blocks the frame, so only while there is time left
+	long start = getTime();
+	for (int i = 0; i < to_load.size(); ++i)
+	{
+		if (i > 0 && getTime() - start > max_load_ms)
+			break;
+		loadCell(scene, *to_load[i]);
+	}
+
+	//the cells not needed stay loaded until the budget is exceeded, then the farthest go first
+	if (resident_bytes <= memory_budget)
+		return;
+	std::vector<sCell*> to_unload;
+	for (int i = 0; i < cells.size(); ++i)
+		if (cells[i].loaded && !cells[i].wanted)
+			to_unload.push_back(&cells[i]);
+	std::sort(to_unload.begin(), to_unload.end(), compareCellsByDistance);
+	for (int i = (int)to_unload.size() - 1; i >= 0 && resident_bytes > memory_budget; --i)
+		unloadCell(scene, *to_unload[i]);
+}
+
+void GTR::ScenePartition::loadCell(Scene* scene, sCell& cell)
+{
+	for (int i = 0; i < cell.entities.size(); ++i)
+	{
+		PrefabEntity* ent = cell.entities[i];
+		Prefab* prefab = GTR::Prefab::Get((std::string("data/") + ent->filename).c_str());
+		if (!prefab)
+			continue;
+		retainPrefab(prefab);
+		ent->prefab = prefab;
+		ent->updateNearestReflectionProbe();
+		scene->updateEntity(ent);
+	}
+	cell.loaded = true;
+}
+
+void GTR::ScenePartition::unloadCell(Scene* scene, sCell& cell)
+{
+	for (int i = 0; i < cell.entities.size(); ++i)
+	{
+		PrefabEntity* ent = cell.entities[i];
+		Prefab* prefab = ent->prefab;
+		if (!prefab)
+			continue;
+		ent->prefab = NULL;
+		scene->updateEntity(ent);
+		releasePrefab(prefab);
+	}
+	cell.loaded = false;
+}
+
+static void collectMeshes(GTR::Node* node, std::set<Mesh*>& meshes)
+{
+	if (node->mesh)
+		meshes.insert(node->mesh);
+	for (int i = 0; i < node->children.size(); ++i)
+		collectMeshes(node->children[i], meshes);
+}
+
+static size_t getMeshBytes(Mesh* mesh)
+{
+	return mesh->vertices.size() * sizeof(Vector3) + mesh->normals.size() * sizeof(Vector3) +
+		mesh->uvs.size() * sizeof(Vector2) + mesh->m_uvs1.size() * sizeof(Vector2) + mesh->colors.size() * sizeof(Vector4) +
+		mesh->interleaved.size() * sizeof(Mesh::tInterleaved) + mesh->m_indices.size() * sizeof(unsigned int);
+}
+
+void GTR::ScenePartition::retainPrefab(Prefab* prefab)
+{
+	if (prefab_users[prefab]++ > 0)
+		return;
+	std::set<Mesh*> meshes;
+	collectMeshes(&prefab->root, meshes);
+	for (auto it = meshes.begin(); it != meshes.end(); ++it)
+		if (mesh_users[*it]++ == 0)
+			resident_bytes += getMeshBytes(*it);
+}
+
+//the materials and textures are kept, they are shared by name and small compared to the meshes
+void GTR::ScenePartition::releasePrefab(Prefab* prefab)
+{
+	if (--prefab_users[prefab] > 0)
+		return;
+	prefab_users.erase(prefab);
+
+	std::set<Mesh*> meshes;
+	collectMeshes(&prefab->root, meshes);
+	for (auto it = meshes.begin(); it != meshes.end(); ++it)
+	{
+		Mesh* mesh = *it;
+		if (--mesh_users[mesh] > 0)
+			continue;
+		mesh_users.erase(mesh);
+		resident_bytes -= getMeshBytes(mesh);
+
+		//so the gltf creates it again the next time
+		auto found = Mesh::sMeshesLoaded.find(mesh->name);
+		if (found != Mesh::sMeshesLoaded.end() && found->second == mesh)
+			Mesh::sMeshesLoaded.erase(found);
+		delete mesh;
+	}
+
+	//removes itself from the prefabs cache
+	delete prefab;
+}
+
+void GTR::ScenePartition::renderInMenu()
+{
+#ifndef SKIP_IMGUI
+	int num_loaded = 0;
+	for (int i = 0; i < cells.size(); ++i)
+		num_loaded += cells[i].loaded;
+	ImGui::Text("Cells loaded: %d / %d", num_loaded, (int)cells.size());
+	ImGui::Text("Meshes: %.1f / %.1f MB", resident_bytes / (1024.0 * 1024.0), memory_budget / (1024.0 * 1024.0));
+	ImGui::SliderFloat("Load radius", &load_radius, cell_size, cell_size * 20);
+	ImGui::SliderFloat("Prediction time", &prediction_time, 0, 5);
+	ImGui::SliderFloat("Max load ms", &max_load_ms, 0, 30);
+#endif
+}
+
 GTR::BaseEntity* GTR::Scene::createEntity(std::string type)
 {
 	if (type == "PREFAB")
-		return new GTR::PrefabEntity();
+		return createEntity(PREFAB);
 	else if (type == "LIGHT")
-		return new GTR::LightEntity();
+		return createEntity(LIGHT);
 	else if (type == "IRRADIANCE")
-		return new GTR::IrradianceEntity();
+		return createEntity(IRRADIANCE);
 	else if (type == "DECAL")
-		return new GTR::DecalEntity();
+		return createEntity(DECAL);
+	else if (type == "SKINNED")
+		return createEntity(SKINNED);
+	else if (type == "CROWD")
+		return createEntity(CROWD);
 	else if (type == "REFLECTION_PROBE")
-		return new GTR::sReflectionProbe();
+		return createEntity(REFLECTION_PROBE);
 	return NULL;
 }
 
+GTR::BaseEntity* GTR::Scene::createEntity(eEntityType type)
+{
+	switch (type)
+	{
+	case PREFAB: return new GTR::PrefabEntity();
+	case LIGHT: return new GTR::LightEntity();
+	case IRRADIANCE: return new GTR::IrradianceEntity();
+	case DECAL: return new GTR::DecalEntity();
+	case SKINNED: return new GTR::SkinnedEntity();
+	case CROWD: return new GTR::CrowdEntity();
+	case REFLECTION_PROBE: return new GTR::sReflectionProbe();
+	default: return NULL;	//not created from the scene file
+	}
+}
+
 void GTR::Scene::saveIrradianceToDisk()
 {
 	std::cout << "Saving irradiance to file --> data/irradiance.bin ... ";
@@ -245,10 +913,29 @@ void GTR::PrefabEntity::configure(cJSON* json)
 	if (cJSON_GetObjectItem(json, "filename"))
 	{
 		filename = cJSON_GetObjectItem(json, "filename")->valuestring;
-		prefab = GTR::Prefab::Get((std::string("data/") + filename).c_str());
+		if (scene->partition.enabled)
+			scene->partition.addEntity(this);
+		else
+			prefab = GTR::Prefab::Get((std::string("data/") + filename).c_str());
 	}
 }
 
+void GTR::PrefabEntity::writeSnapshot(SceneSnapshotWriter& writer)
+{
+	writer.writeString(filename);
+}
+
+void GTR::PrefabEntity::readSnapshot(SceneSnapshotReader& reader)
+{
+	filename = reader.readString();
+	if (!filename.size())
+		return;
+	if (scene->partition.enabled)
+		scene->partition.addEntity(this);
+	else
+		prefab = GTR::Prefab::Get((std::string("data/") + filename).c_str());
+}
+
 // Calculate distance between two 3D points using the pythagoras theorem
 float distanceToProbe(float x1, float y1, float z1, float x2, float y2, float z2)
 {
@@ -436,6 +1123,40 @@ void GTR::LightEntity::configure(cJSON* json)
 	
 }
 
+void GTR::LightEntity::writeSnapshot(SceneSnapshotWriter& writer)
+{
+	writer.write((int)light_type);
+	writer.write(color);
+	writer.write(intensity);
+	writer.write(max_distance);
+	writer.write(cone_angle);
+	writer.write(area_size);
+	writer.write(spot_exponent);
+	writer.write(ortho_cam_size);
+	writer.write(target);
+	writer.write(shadow_bias);
+	writer.write((uint8)cast_shadow);
+	writer.write((uint8)is_volumetric);
+}
+
+void GTR::LightEntity::readSnapshot(SceneSnapshotReader& reader)
+{
+	light_type = (eLightType)reader.read<int>();
+	color = reader.read<Vector3>();
+	intensity = reader.read<float>();
+	max_distance = reader.read<float>();
+	cone_angle = reader.read<float>();
+	area_size = reader.read<float>();
+	spot_exponent = reader.read<float>();
+	ortho_cam_size = reader.read<float>();
+	target = reader.read<Vector3>();
+	shadow_bias = reader.read<float>();
+	cast_shadow = reader.read<uint8>() != 0;
+	is_volumetric = reader.read<uint8>() != 0;
+	//the model already has the orientation
+	updateCamera();
+}
+
 void GTR::LightEntity::renderInMenu()
 {
 #ifndef SKIP_IMGUI
@@ -583,6 +1304,22 @@ void GTR::IrradianceEntity::configure(cJSON* json)
 	}
 }
 
+void GTR::IrradianceEntity::writeSnapshot(SceneSnapshotWriter& writer)
+{
+	writer.write(start_pos);
+	writer.write(end_pos);
+	writer.write(size);
+	writer.write(dim);
+}
+
+void GTR::IrradianceEntity::readSnapshot(SceneSnapshotReader& reader)
+{
+	start_pos = reader.read<Vector3>();
+	end_pos = reader.read<Vector3>();
+	size = reader.read<float>();
+	dim = reader.read<Vector3>();
+}
+
 void GTR::IrradianceEntity::render(Shader* shader, Camera* camera)
 {
 	glEnable(GL_CULL_FACE);
@@ -690,9 +1427,9 @@ GTR::DecalEntity::DecalEntity()
 
 void GTR::DecalEntity::configure(cJSON* json)
 {
-	std::string file = readJSONString(json, "albedo", "");
-	if (file.size())
-		albedo = Texture::Get((std::string("data/") + file).c_str());
+	albedo_file = readJSONString(json, "albedo", "");
+	if (albedo_file.size())
+		albedo = Texture::Get((std::string("data/") + albedo_file).c_str());
 
 	if (cJSON_GetObjectItem(json, "angle"))
 	{
@@ -703,6 +1440,159 @@ void GTR::DecalEntity::configure(cJSON* json)
 	}
 }
 
+void GTR::DecalEntity::writeSnapshot(SceneSnapshotWriter& writer)
+{
+	writer.writeString(albedo_file);
+}
+
+void GTR::DecalEntity::readSnapshot(SceneSnapshotReader& reader)
+{
+	albedo_file = reader.readString();
+	if (albedo_file.size())
+		albedo = Texture::Get((std::string("data/") + albedo_file).c_str());
+}
+
+//characters with the same albedo share the material, so they can be drawn together
+static GTR::Material* getCharacterMaterial(const std::string& albedo)
+{
+	std::string material_name = "character:" + albedo;
+	GTR::Material* material = GTR::Material::Get(material_name.c_str());
+	if (!material)
+	{
+		material = new GTR::Material();
+		if (albedo.size())
+			material->color_texture.texture = Texture::Get((std::string("data/") + albedo).c_str());
+		material->registerMaterial(material_name.c_str());
+	}
+	return material;
+}
+
+GTR::SkinnedEntity::SkinnedEntity()
+{
+	entity_type = SKINNED;
+	mesh = NULL;
+	animation = NULL;
+	material = NULL;
+	animation_instance = -1;
+}
+
+void GTR::SkinnedEntity::configure(cJSON* json)
+{
+	mesh_file = readJSONString(json, "mesh", "");
+	animation_file = readJSONString(json, "animation", "");
+	albedo_file = readJSONString(json, "albedo", "");
+	loadAssets();
+}
+
+void GTR::SkinnedEntity::writeSnapshot(SceneSnapshotWriter& writer)
+{
+	writer.writeString(mesh_file);
+	writer.writeString(animation_file);
+	writer.writeString(albedo_file);
+}
+
+void GTR::SkinnedEntity::readSnapshot(SceneSnapshotReader& reader)
+{
+	mesh_file = reader.readString();
+	animation_file = reader.readString();
+	albedo_file = reader.readString();
+	loadAssets();
+}
+
+void GTR::SkinnedEntity::loadAssets()
+{
+	if (mesh_file.size())
+		mesh = Mesh::Get((std::string("data/") + mesh_file).c_str(), false);
+
+	if (animation_file.size())
+		animation = Animation::Get((std::string("data/") + animation_file).c_str());
+
+	material = getCharacterMaterial(albedo_file);
+}
+
+GTR::CrowdEntity::CrowdEntity()
+{
+	entity_type = CROWD;
+	mesh = NULL;
+	vertex_animation = NULL;
+	material = NULL;
+	fps = 30;
+	instances_vbo = 0;
+}
+
+void GTR::CrowdEntity::configure(cJSON* json)
+{
+	mesh_file = readJSONString(json, "mesh", "");
+	animation_file = readJSONString(json, "animation", "");
+	albedo_file = readJSONString(json, "albedo", "");
+	fps = readJSONNumber(json, "fps", fps);
+	if (!loadAssets())
+		return;
+
+	//a grid of characters looking in random directions and starting at random times
+	int columns = readJSONNumber(json, "columns", 10);
+	int rows = readJSONNumber(json, "rows", 10);
+	float spacing = readJSONNumber(json, "spacing", 2);
+	for (int i = 0; i < rows; ++i)
+		for (int j = 0; j < columns; ++j)
+		{
+			Matrix44 m;
+			m.translate((j - (columns - 1) * 0.5) * spacing, 0, (i - (rows - 1) * 0.5) * spacing);
+			m.rotate(random(2 * PI), Vector3(0, 1, 0));
+			instance_models.push_back(m);
+			time_offsets.push_back(random(vertex_animation->getDuration()));
+		}
+
+	//the baked bounds contain every frame
+	Vector3 center = (vertex_animation->min + vertex_animation->max) * 0.5;
+	float radius = (vertex_animation->max - vertex_animation->min).length() * 0.5;
+	bounding.center = center;
+	bounding.halfsize = Vector3((columns - 1) * 0.5 * spacing + radius, radius, (rows - 1) * 0.5 * spacing + radius);
+}
+
+//the instances are saved too, so the random layout is the same every time
+void GTR::CrowdEntity::writeSnapshot(SceneSnapshotWriter& writer)
+{
+	writer.writeString(mesh_file);
+	writer.writeString(animation_file);
+	writer.writeString(albedo_file);
+	writer.write(fps);
+	writer.writeVector(instance_models);
+	writer.writeVector(time_offsets);
+	writer.write(bounding);
+}
+
+void GTR::CrowdEntity::readSnapshot(SceneSnapshotReader& reader)
+{
+	mesh_file = reader.readString();
+	animation_file = reader.readString();
+	albedo_file = reader.readString();
+	fps = reader.read<float>();
+	reader.readVector(instance_models);
+	reader.readVector(time_offsets);
+	bounding = reader.read<BoundingBox>();
+	loadAssets();
+}
+
+bool GTR::CrowdEntity::loadAssets()
+{
+	if (!mesh_file.size() || !animation_file.size())
+		return false;
+	mesh = Mesh::Get((std::string("data/") + mesh_file).c_str(), false);
+	if (!mesh)
+		return false;
+
+	//baked the first time, then read from the .vat file
+	Animation* animation = Animation::Get((std::string("data/") + animation_file).c_str());
+	std::string vat_file = std::string("data/") + animation_file + ".vat";
+	vertex_animation = VertexAnimation::Get(vat_file.c_str(), mesh, animation, fps);
+	if (!vertex_animation)
+		return false;
+
+	material = getCharacterMaterial(albedo_file);
+	return true;
+}
+
 GTR::sReflectionProbe::sReflectionProbe()
 {
 	entity_type = REFLECTION_PROBE;
@@ -730,6 +1620,16 @@ void GTR::sReflectionProbe::configure(cJSON* json)
 	}
 }
 
+void GTR::sReflectionProbe::writeSnapshot(SceneSnapshotWriter& writer)
+{
+	writer.write(size);
+}
+
+void GTR::sReflectionProbe::readSnapshot(SceneSnapshotReader& reader)
+{
+	size = reader.read<float>();
+}
+
 GTR::ReflectionEntity::ReflectionEntity()
 {
 	entity_type = REFLECTION_ENTITY;
@@ -8,9 +8,14 @@
 #include "mesh.h"
 #include "sphericalharmonics.h"
 #include <string>
+#include <map>
+
+#define SCENE_BIN_VERSION 2
 
 //forward declaration
 class cJSON;
+class Animation;
+class VertexAnimation;
 
 
 //our namespace
@@ -24,11 +29,56 @@ namespace GTR {
 		REFLECTION_PROBE = 4,
 		REFLECTION_ENTITY = 5,
 		DECAL = 6,
-		IRRADIANCE = 7
+		IRRADIANCE = 7,
+		SKINNED = 8,
+		CROWD = 9
 	};
 
 	class Scene;
 	class Prefab;
+	class Material;
+	class LightEntity;
+	class sReflectionProbe;
+
+	//identifies an entity in the SceneComponents, stays valid while the entity exists
+	typedef int EntityHandle;
+
+	//the scene is saved in binary after reading its JSON, so the next time the file is just mapped (see Scene::load).
+	//the strings (names and asset paths) are stored once in a table and the entities reference them by index
+	class SceneSnapshotWriter
+	{
+	public:
+		std::vector<char> data;
+		std::vector<std::string> strings;
+		std::map<std::string, int> string_ids;
+
+		int addString(const std::string& str);
+		void write(const void* ptr, size_t size);
+		template<typename T> void write(const T& value) { write(&value, sizeof(T)); }
+		void writeString(const std::string& str) { write(addString(str)); }
+		template<typename T> void writeVector(const std::vector<T>& v) { write((int)v.size()); if (v.size()) write(&v[0], sizeof(T) * v.size()); }
+	};
+
+	//reads past the end or with invalid string ids set failed and return zeros (or ""), the file is checked after reading it
+	class SceneSnapshotReader
+	{
+	public:
+		const char* pos;
+		const char* end;
+		std::vector<const char*> strings;	//inside the mapped file
+		bool failed;
+
+		SceneSnapshotReader() : pos(NULL), end(NULL), failed(false) {}
+		void read(void* ptr, size_t size);
+		template<typename T> T read() { T value; read(&value, sizeof(T)); return value; }
+		const char* readString();
+		template<typename T> void readVector(std::vector<T>& v) {
+			int num = read<int>();
+			if (num < 0 || (size_t)num > (size_t)(end - pos) / sizeof(T)) { failed = true; num = 0; }
+			v.resize(num);
+			if (v.size()) read(&v[0], sizeof(T) * v.size());
+		}
+	};
 
 	//represents one element of the scene (could be lights, prefabs, cameras, etc)
 	class BaseEntity
@@ -39,10 +89,14 @@ namespace GTR {
 		eEntityType entity_type;
 		Matrix44 model;
 		bool visible;
-		BaseEntity() { entity_type = NONE; visible = true; }
+		EntityHandle handle;	//-1 until added to the scene
+		BaseEntity() { entity_type = NONE; visible = true; handle = -1; }
 		virtual ~BaseEntity() {}
 		virtual void renderInMenu();
 		virtual void configure(cJSON* json) {}
+		//the data that configure reads, the name, visibility and model are saved by the scene
+		virtual void writeSnapshot(SceneSnapshotWriter& writer) {}
+		virtual void readSnapshot(SceneSnapshotReader& reader) {}
 	};
 
 	//struct to store reflection probes info
@@ -53,6 +107,8 @@ namespace GTR {
 
 		sReflectionProbe();
 		virtual void configure(cJSON* json);
+		virtual void writeSnapshot(SceneSnapshotWriter& writer);
+		virtual void readSnapshot(SceneSnapshotReader& reader);
 	};
 
 	//represents one prefab in the scene
@@ -66,6 +122,8 @@ namespace GTR {
 		PrefabEntity();
 		virtual void renderInMenu();
 		virtual void configure(cJSON* json);
+		virtual void writeSnapshot(SceneSnapshotWriter& writer);
+		virtual void readSnapshot(SceneSnapshotReader& reader);
 		void updateNearestReflectionProbe();
 	};
 
@@ -103,6 +161,8 @@ namespace GTR {
 		void uploadToShader(Shader* shader, bool sendShadowMap = false);
 		virtual void renderInMenu();
 		virtual void configure(cJSON* json);
+		virtual void writeSnapshot(SceneSnapshotWriter& writer);
+		virtual void readSnapshot(SceneSnapshotReader& reader);
 		void updateCamera();
 		void renderShadowFBO(Shader* shader);
 		void renderLight(Camera* camera);
@@ -135,6 +195,8 @@ namespace GTR {
 
 		IrradianceEntity();
 		virtual void configure(cJSON* json);
+		virtual void writeSnapshot(SceneSnapshotWriter& writer);
+		virtual void readSnapshot(SceneSnapshotReader& reader);
 		void updateDelta();
 		void placeProbes();
 		void uploadToShader(Shader* shader);
@@ -158,10 +220,101 @@ namespace GTR {
 	class DecalEntity : public GTR::BaseEntity
 	{
 	public:
+		std::string albedo_file;
 		Texture* albedo;
 
 		DecalEntity();
 		virtual void configure(cJSON* json);
+		virtual void writeSnapshot(SceneSnapshotWriter& writer);
+		virtual void readSnapshot(SceneSnapshotReader& reader);
+	};
+
+	//animated character, the renderer computes its bones and draws all the ones sharing mesh and material together
+	class SkinnedEntity : public GTR::BaseEntity
+	{
+	public:
+		std::string mesh_file;
+		std::string animation_file;
+		std::string albedo_file;
+		Mesh* mesh;
+		Animation* animation;
+		Material* material;	//shared by the characters with the same albedo
+		int animation_instance;	//index in the animation system of the renderer, -1 until registered
+
+		SkinnedEntity();
+		virtual void configure(cJSON* json);
+		virtual void writeSnapshot(SceneSnapshotWriter& writer);
+		virtual void readSnapshot(SceneSnapshotReader& reader);
+		void loadAssets();
+	};
+
+	//many copies of a character playing a baked animation, each one with its own time offset
+	class CrowdEntity : public GTR::BaseEntity
+	{
+	public:
+		std::string mesh_file;
+		std::string animation_file;
+		std::string albedo_file;
+		float fps;	//of the baked animation
+		Mesh* mesh;
+		VertexAnimation* vertex_animation;
+		Material* material;
+		std::vector<Matrix44> instance_models;	//relative to the entity
+		std::vector<float> time_offsets;
+		BoundingBox bounding;	//of all the instances, relative to the entity
+		unsigned int instances_vbo;	//uploaded by the renderer the first time it is drawn
+
+		CrowdEntity();
+		virtual void configure(cJSON* json);
+		virtual void writeSnapshot(SceneSnapshotWriter& writer);
+		virtual void readSnapshot(SceneSnapshotReader& reader);
+		bool loadAssets();
+	};
+
+	//world partition: the prefabs are grouped in square cells of the XZ plane and only the cells around the camera
+	//have their prefab loaded. The nearest cells to where the camera is going are loaded first, a few every frame,
+	//and when the meshes use more memory than the budget the farthest cells not needed are unloaded
+	class ScenePartition
+	{
+	public:
+		struct sCell {
+			int x;
+			int z;
+			std::vector<PrefabEntity*> entities;
+			bool loaded;
+			bool wanted;	//in the radius this frame
+			float distance;	//to the predicted camera position
+		};
+
+		bool enabled;	//only if the scene has a "partition" object
+		float cell_size;
+		float load_radius;	//cells nearer than this to the camera or its predicted position are loaded
+		float prediction_time;	//seconds ahead the camera position is predicted
+		float max_load_ms;	//per frame, at least one cell is loaded
+		size_t memory_budget;	//bytes of the meshes loaded
+
+		std::vector<sCell> cells;
+		size_t resident_bytes;
+		Vector3 velocity;	//of the camera, smoothed
+
+		ScenePartition();
+		void configure(cJSON* json);
+		void clear();
+		void addEntity(PrefabEntity* entity);	//by its position, they dont change of cell after
+		void update(Scene* scene, Camera* camera, float seconds_elapsed);
+		void renderInMenu();
+
+	private:
+		std::map<std::pair<int, int>, int> cells_by_coord;
+		std::map<Prefab*, int> prefab_users;	//cells loaded using it
+		std::map<Mesh*, int> mesh_users;	//prefabs loaded using it, the gltf meshes can be shared by name
+		Vector3 last_eye;
+		bool has_last_eye;
+
+		void loadCell(Scene* scene, sCell& cell);
+		void unloadCell(Scene* scene, sCell& cell);
+		void retainPrefab(Prefab* prefab);
+		void releasePrefab(Prefab* prefab);
 	};
 
 	struct sIrrHeader {
@@ -172,6 +325,47 @@ namespace GTR {
 		int num_probes;
 	};
 
+	//the data of the entities used every frame, stored by component in contiguous arrays. The entity classes
+	//are the editor facade: after changing one, Scene::updateEntity copies its data here again.
+	//Removing moves the last element to the hole, the handles go through a table so they dont change
+	class SceneComponents
+	{
+	public:
+		//one element per entity
+		std::vector<BaseEntity*> entities;
+		std::vector<uint8> types;
+		std::vector<uint8> visible;
+		std::vector<Matrix44> models;
+		std::vector<BoundingBox> world_bounds;	//of the prefab, empty for the rest
+		std::vector<Prefab*> prefabs;	//NULL if not a prefab
+		std::vector<sReflectionProbe*> reflection_probes;	//nearest to the prefab
+
+		//one element per light
+		enum { LIGHT_CAST_SHADOW = 1, LIGHT_VOLUMETRIC = 2 };
+		std::vector<LightEntity*> light_entities;
+		std::vector<Vector3> light_positions;
+		std::vector<float> light_max_distances;
+		std::vector<uint8> light_types;
+		std::vector<uint8> light_flags;
+
+		EntityHandle add(BaseEntity* entity);
+		void remove(EntityHandle handle);
+		void update(EntityHandle handle);
+		int getIndex(EntityHandle handle) const { return handle_to_index[handle]; }
+		int size() const { return (int)entities.size(); }
+		void clear();
+
+		//indices in the light arrays of the lights that reach the frustum and have all the flags
+		void cullLights(Camera* camera, std::vector<int>& output, uint8 flags = 0) const;
+
+	private:
+		std::vector<int> handle_to_index;
+		std::vector<EntityHandle> index_to_handle;
+		std::vector<EntityHandle> free_handles;
+		std::vector<int> light_indices;	//per entity, -1 if not a light
+		std::vector<int> light_owners;	//per light, index of the entity
+	};
+
 	//contains all entities of the scene
 	class Scene
 	{
@@ -192,12 +386,18 @@ namespace GTR {
 		IrradianceEntity* irr;
 		ReflectionEntity* reflection;
 		std::vector<sReflectionProbe*> reflect_probes;
+		SceneComponents components;
+		ScenePartition partition;
 
 		void clear();
 		void addEntity(BaseEntity* entity);
+		void updateEntity(BaseEntity* entity);	//after editing it
 		void updatePrefabNearestReflectionProbe();
 		bool load(const char* filename);
+		bool loadSnapshot(const char* filename, long long source_time);
+		bool writeSnapshot(const char* filename, long long source_time);
 		BaseEntity* createEntity(std::string type);
+		BaseEntity* createEntity(eEntityType type);
 		void saveIrradianceToDisk();
 		bool readIrradianceFromDisk();
 	};
@@ -6,11 +6,63 @@
 #include <functional> 
 #include <cctype>
 #include <locale>
+#include <set>
 
 #include "texture.h"
 
 std::string Shader::s_shader_atlas_filename;
 std::map<std::string, std::string> Shader::s_shaders_atlas;
+bool Shader::s_use_binary_cache = true;
+
+#define SHADER_CACHE_MAGIC 0x43425348 //"HSBC"
+#define SHADER_CACHE_VERSION 1
+
+struct sProgramBinary {
+	unsigned long long hash;
+	unsigned int format;
+	std::vector<char> data;
+};
+static std::map<std::string, sProgramBinary> s_binary_cache;
+static bool s_binary_cache_loaded = false;
+static bool s_binary_cache_dirty = false;
+static long s_binary_cache_dirty_time = 0; //when the last program was added
+static int s_num_compiled = 0;
+static int s_num_cached = 0;
+static bool s_parallel_compile = false; //GL_KHR_parallel_shader_compile
+
+//to know what changed when reloading the atlas
+static std::map<std::string, unsigned long long> s_chunk_hashes; //of the chunk code without the includes
+static long long s_atlas_file_time = 0;
+
+#ifndef GL_COMPLETION_STATUS_KHR
+	#define GL_COMPLETION_STATUS_KHR 0x91B1
+#endif
+typedef void (APIENTRY * glMaxShaderCompilerThreadsKHR_func)(GLuint count);
+
+//macros must go after the #version line or the GLSL compiler will complain
+static std::string injectMacros(const std::string& code, const std::string& macros)
+{
+	if (macros.empty())
+		return code;
+	size_t pos = code.find("#version");
+	if (pos == std::string::npos)
+		return macros + "\n" + code;
+	pos = code.find('\n', pos);
+	if (pos == std::string::npos)
+		return code + "\n" + macros + "\n";
+	return code.substr(0, pos + 1) + macros + "\n" + code.substr(pos + 1);
+}
+
+//binaries only work with the same driver, so it is part of the hash
+static unsigned long long getDriverHash()
+{
+	static unsigned long long driver_hash = 0;
+	if (driver_hash)
+		return driver_hash;
+	std::string driver = std::string((const char*)glGetString(GL_VENDOR)) + (const char*)glGetString(GL_RENDERER) + (const char*)glGetString(GL_VERSION);
+	driver_hash = hashString(driver);
+	return driver_hash;
+}
 
 
 //typedef unsigned int GLhandle;
@@ -61,14 +113,19 @@ Shader::Shader()
 {
 	if(!Shader::s_ready)
 		Shader::init();
-	vs = fs = 0;
+	vs = fs = program = 0;
+	prev_vs = prev_fs = prev_program = 0;
+	prev_source_hash = 0;
 	compiled = false;
+	pending = false;
 	from_atlas = false;
+	source_hash = 0;
 }
 
 Shader::~Shader()
 {
 	release();
+	releasePrevious();
 }
 
 void Shader::setFilenames(const std::string& vsf, const std::string& psf)
@@ -97,8 +154,8 @@ bool Shader::load(const std::string& vsf, const std::string& psf, const char* ma
 	//printf("Fragment shader from memory:\n%s\n", psm.c_str());
 	if (macros)
 	{
-		vsm = macros + vsm;
-		psm = macros + psm;
+		vsm = injectMacros(vsm, macros);
+		psm = injectMacros(psm, macros);
 		this->macros = macros;
 	}
 
@@ -132,6 +189,24 @@ Shader* Shader::Get(const char* vsf, const char* psf, const char* macros)
 	return sh;
 }
 
+bool Shader::ReloadAtlasIfChanged()
+{
+	//check the file only twice per second
+	static long last_check = 0;
+	long now = getTime();
+	if (s_shader_atlas_filename.empty() || now - last_check < 500)
+		return false;
+	last_check = now;
+
+	long long file_time = getFileTime(s_shader_atlas_filename);
+	if (!file_time || file_time == s_atlas_file_time)
+		return false;
+
+	std::cout << " + Shader atlas modified, reloading" << std::endl;
+	LoadAtlas(s_shader_atlas_filename.c_str());
+	return true;
+}
+
 void Shader::ReloadAll()
 {
 	for( std::map<std::string,Shader*>::iterator it = s_Shaders.begin(); it!=s_Shaders.end();it++)
@@ -169,24 +244,52 @@ bool Shader::LoadAtlas(const char* filename)
 		return false;
 	}
 
+	long start_time = getTime();
+	s_num_compiled = s_num_cached = 0;
+	std::string cache_filename = std::string(filename) + ".cache";
+
+	if (s_use_binary_cache && !s_binary_cache_loaded)
+	{
+		LoadBinaryCache(cache_filename.c_str());
+		s_binary_cache_loaded = true;
+	}
+
 	//separate subfiles
 	s_shader_atlas_filename = filename;
+	s_atlas_file_time = getFileTime(filename);
 	std::vector<std::string> lines = tokenize(content, "\n");
 	std::string subfile_name = "";
 	std::string subfile_content = "";
+	unsigned long long subfile_hash = hashString("");
+	std::vector<std::string> subfile_includes;
+	std::set<std::string> changed_chunks; //changed or including one that changed
 
-	for (int i = 0; i < lines.size(); ++i)
+	for (int i = 0; i <= lines.size(); ++i)
 	{
-		std::string& line = lines[i];
-		std::string line_trimmed = trim(line);
-		if(line[0] == '\\')
+		if (i == lines.size() || lines[i][0] == '\\')
 		{
-			s_shaders_atlas[ subfile_name ] = subfile_content; //store previous one
-			subfile_name = trim(line.substr(1,std::string::npos));
+			//store previous one
+			s_shaders_atlas[ subfile_name ] = subfile_content;
+			bool changed = s_chunk_hashes.find(subfile_name) == s_chunk_hashes.end() || s_chunk_hashes[subfile_name] != subfile_hash;
+			for (int j = 0; j < subfile_includes.size() && !changed; ++j)
+				changed = changed_chunks.count(subfile_includes[j]) != 0;
+			if (changed)
+				changed_chunks.insert(subfile_name);
+			s_chunk_hashes[subfile_name] = subfile_hash;
+			if (i == lines.size())
+				break;
+
+			subfile_name = trim(lines[i].substr(1,std::string::npos));
 			subfile_content = "";
+			subfile_hash = hashString("");
+			subfile_includes.clear();
 			continue;
 		}
-		else if (line_trimmed[0] == '#')
+
+		std::string& line = lines[i];
+		std::string line_trimmed = trim(line);
+		subfile_hash = hashString(line, subfile_hash);
+		if (line_trimmed[0] == '#')
 		{
 			int pos = line_trimmed.find_first_of(' ');
 			if (pos != std::string::npos)
@@ -198,6 +301,7 @@ bool Shader::LoadAtlas(const char* filename)
 					if (param[0] == '\"')
 						param = param.substr(1, param.size() - 2);
 					auto it = s_shaders_atlas.find(param);
+					subfile_includes.push_back(param);
 					if (it != s_shaders_atlas.end())
 						subfile_content += it->second + "\n";
 					else
@@ -208,11 +312,12 @@ bool Shader::LoadAtlas(const char* filename)
 		}
 		subfile_content += line + "\n";
 	}
-	s_shaders_atlas[ subfile_name ] = subfile_content;
 
 	//compile shaders
 	std::string shaders = s_shaders_atlas[""];
 
+	std::vector<Shader*> issued;
+	int num_unchanged = 0;
 	lines = tokenize(shaders, "\n");
 	for (int i = 0; i < lines.size(); ++i)
 	{
@@ -231,17 +336,12 @@ bool Shader::LoadAtlas(const char* filename)
 		std::string macros = "";
 		if(pos3 != std::string::npos)
 			macros = line.substr(pos3+1);
-		std::string vs_code = s_shaders_atlas[vs_filename];
-		std::string fs_code = s_shaders_atlas[fs_filename];
-		if(!vs_code.size() || !fs_code.size())
+		if(!s_shaders_atlas[vs_filename].size() || !s_shaders_atlas[fs_filename].size())
 		{
 			std::cout << " * Error in shader atlas, couldnt find files for " << name << std::endl;
 			continue;
 		}
 
-		vs_code = macros + "\n" + vs_code;
-		fs_code = macros + "\n" + fs_code;
-
 		Shader* shader = NULL;
 		auto it = s_Shaders.find( name );
 		if(it == s_Shaders.end())
@@ -251,21 +351,283 @@ bool Shader::LoadAtlas(const char* filename)
 		}
 		else
 			shader = it->second;
-	
-		if (!shader->compileFromMemory(vs_code,fs_code))
+
+		//nothing to do if its chunks (or the ones they include) and its definition didnt change
+		if (shader->compiled && !changed_chunks.count(vs_filename) && !changed_chunks.count(fs_filename) &&
+			shader->vs_filename == vs_filename && shader->ps_filename == fs_filename && shader->macros == macros)
 		{
-			delete shader;
-			std::cout << " * Compilation error in shader at atlas: " << name << std::endl;
-            return false; //stop here
+			num_unchanged++;
 			continue;
 		}
 
-		shader->vs_filename = vs_filename;
-		shader->ps_filename = fs_filename;
-		shader->from_atlas = true;
-		std::cout << " + Shader from atlas: " << name << std::endl;
+		//first send all of them to the driver, then wait for them
+		shader->compileFromAtlas(name, vs_filename, fs_filename, macros, false);
+		if (shader->pending)
+			issued.push_back(shader);
+
+		//permutations use the same code, compile again the ones already in use
+		for (auto perm = shader->permutations.begin(); perm != shader->permutations.end(); ++perm)
+		{
+			Shader* perm_shader = perm->second;
+			if (perm_shader == shader)
+				continue;
+			perm_shader->compileFromAtlas(perm_shader->atlas_name, vs_filename, fs_filename, macros + "\n" + perm_shader->permutation_macros, false);
+			if (perm_shader->pending)
+				issued.push_back(perm_shader);
+		}
+	}
+
+	bool all_compiled = true;
+	for (int i = 0; i < issued.size(); ++i)
+	{
+		Shader* shader = issued[i];
+		if (shader->finishCompile())
+			continue;
+		std::cout << " * Compilation error in shader at atlas: " << shader->atlas_name << std::endl;
+		all_compiled = false;
+		if (shader->compiled) //the previous version is still working
+			continue;
+		auto it = s_Shaders.find(shader->atlas_name);
+		if (it != s_Shaders.end() && it->second == shader) //permutations stay, getPermutation will skip them
+		{
+			s_Shaders.erase(it);
+			delete shader;
+		}
+	}
+
+	if (s_use_binary_cache && s_binary_cache_dirty)
+		SaveBinaryCache(cache_filename.c_str());
+
+	std::cout << " + Shader atlas: " << s_num_compiled << " compiled, " << s_num_cached << " from cache, " << num_unchanged << " unchanged in " << (getTime() - start_time) << "ms" << std::endl;
+	return all_compiled;
+}
+
+bool Shader::compileFromAtlas(const std::string& name, const std::string& vs_filename, const std::string& fs_filename, const std::string& macros, bool wait)
+{
+	auto vs_it = s_shaders_atlas.find(vs_filename);
+	auto fs_it = s_shaders_atlas.find(fs_filename);
+	if (vs_it == s_shaders_atlas.end() || fs_it == s_shaders_atlas.end() || !vs_it->second.size() || !fs_it->second.size())
+	{
+		std::cout << " * Error in shader atlas, couldnt find files for " << name << std::endl;
+		return false;
+	}
+
+	std::string vs_code = injectMacros(vs_it->second, macros);
+	std::string fs_code = injectMacros(fs_it->second, macros);
+
+	unsigned long long hash = hashString(fs_code, hashString(vs_code, getDriverHash()));
+	if (compiled && source_hash == hash)
+		return true; //nothing changed since the last time
+
+	//the current program is used until the new one links, so an error in the atlas doesnt leave it without one
+	if (compiled)
+		keepPrevious();
+	else if (pending)
+		release();
+
+	this->atlas_name = name;
+	this->vs_filename = vs_filename;
+	this->ps_filename = fs_filename;
+	this->macros = macros;
+	this->from_atlas = true;
+
+	//try first with the binary from the cache
+	auto cached = s_binary_cache.find(name);
+	if (s_use_binary_cache && cached != s_binary_cache.end() && cached->second.hash == hash &&
+		compileFromBinary(cached->second.format, &cached->second.data[0], cached->second.data.size()))
+	{
+		s_num_cached++;
+		source_hash = hash;
+		releasePrevious();
+		return true;
+	}
+
+	//finishCompile stores the hash and the binary once it is linked
+	pending_hash = hash;
+	if (!issueCompile(vs_code, fs_code))
+	{
+		restorePrevious();
+		return false;
+	}
+	if (!wait)
+		return true;
+	return finishCompile();
+}
+
+Shader* Shader::getPermutation(unsigned int flags, const char* const* flag_names, int num_flags)
+{
+	auto it = permutations.find(flags);
+	if (it != permutations.end())
+		return getPermutation(flags, ""); //macros only needed the first time
+
+	//every flag becomes a constant, the atlas code checks PERMUTATION to use them instead of the uniforms
+	std::string perm_macros = "#define PERMUTATION\n";
+	for (int i = 0; i < num_flags; ++i)
+		perm_macros += std::string("#define ") + flag_names[i] + ((flags & (1 << i)) ? " true\n" : " false\n");
+	return getPermutation(flags, perm_macros);
+}
+
+Shader* Shader::getPermutation(unsigned int key, const std::string& perm_macros)
+{
+	auto it = permutations.find(key);
+	if (it != permutations.end())
+	{
+		Shader* shader = it->second;
+		if (shader->pending && shader->isReady())
+			shader->finishCompile(); //its binary is saved later by FlushBinaryCache
+		return shader->compiled ? shader : this; //the generic one while it compiles or if it failed
+	}
+
+	assert(from_atlas && "permutations only for shaders from the atlas");
+
+	//with parallel compilation the generic shader is used until the permutation is ready
+	Shader* shader = new Shader();
+	std::string name = atlas_name + "@" + std::to_string(key);
+	permutations[key] = shader;
+	shader->permutation_macros = perm_macros;
+	if (!shader->compileFromAtlas(name, vs_filename, ps_filename, macros + "\n" + perm_macros, !s_parallel_compile))
+		std::cout << " * Compilation error in shader permutation: " << name << std::endl;
+
+	return shader->compiled ? shader : this;
+}
+
+bool Shader::LoadBinaryCache(const char* filename)
+{
+	GLint num_formats = 0;
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &num_formats);
+	if (num_formats == 0)
+	{
+		glGetError(); //GL_INVALID_ENUM if the extension is missing
+		std::cout << " - Program binaries not supported by the driver, shader cache disabled" << std::endl;
+		s_use_binary_cache = false;
+		return false;
+	}
+
+	size_t size = 0;
+	char* data = (char*)mapFile(filename, size);
+	if (!data)
+		return false;
+
+	char* pos = data;
+	char* end = data + size;
+	unsigned int* header = (unsigned int*)pos;
+	if (size < sizeof(unsigned int) * 3 || header[0] != SHADER_CACHE_MAGIC || header[1] != SHADER_CACHE_VERSION)
+	{
+		std::cout << " - Shader cache has a wrong format, ignored: " << filename << std::endl;
+		unmapFile(data, size);
+		return false;
+	}
+	int num = header[2];
+	pos += sizeof(unsigned int) * 3;
+
+	//entries: name length, name, hash, format, data size, data
+	for (int i = 0; i < num; ++i)
+	{
+		unsigned int name_length = 0;
+		if (pos + sizeof(unsigned int) > end)
+			break;
+		memcpy(&name_length, pos, sizeof(unsigned int));
+		pos += sizeof(unsigned int);
+		if (pos + name_length + sizeof(unsigned long long) + sizeof(unsigned int) * 2 > end)
+			break;
+		std::string name(pos, name_length);
+		pos += name_length;
+
+		sProgramBinary& binary = s_binary_cache[name];
+		unsigned int data_size = 0;
+		memcpy(&binary.hash, pos, sizeof(unsigned long long));
+		pos += sizeof(unsigned long long);
+		memcpy(&binary.format, pos, sizeof(unsigned int));
+		pos += sizeof(unsigned int);
+		memcpy(&data_size, pos, sizeof(unsigned int));
+		pos += sizeof(unsigned int);
+		if (pos + data_size > end || data_size == 0)
+		{
+			s_binary_cache.erase(name);
+			break;
+		}
+		binary.data.assign(pos, pos + data_size);
+		pos += data_size;
+	}
+
+	unmapFile(data, size);
+	return true;
+}
+
+bool Shader::SaveBinaryCache(const char* filename)
+{
+	FILE* file = fopen(filename, "wb");
+	if (!file)
+	{
+		std::cout << " - Cannot write the shader cache: " << filename << std::endl;
+		return false;
+	}
+
+	unsigned int header[3] = { SHADER_CACHE_MAGIC, SHADER_CACHE_VERSION, (unsigned int)s_binary_cache.size() };
+	fwrite(header, sizeof(header), 1, file);
+	for (auto it = s_binary_cache.begin(); it != s_binary_cache.end(); ++it)
+	{
+		const sProgramBinary& binary = it->second;
+		unsigned int name_length = it->first.size();
+		unsigned int data_size = binary.data.size();
+		fwrite(&name_length, sizeof(unsigned int), 1, file);
+		fwrite(it->first.c_str(), name_length, 1, file);
+		fwrite(&binary.hash, sizeof(unsigned long long), 1, file);
+		fwrite(&binary.format, sizeof(unsigned int), 1, file);
+		fwrite(&data_size, sizeof(unsigned int), 1, file);
+		if (data_size)
+			fwrite(&binary.data[0], data_size, 1, file);
+	}
+	fclose(file);
+
+	s_binary_cache_dirty = false;
+	return true;
+}
+
+void Shader::FlushBinaryCache(bool force)
+{
+	if (!s_use_binary_cache || !s_binary_cache_dirty || s_shader_atlas_filename.empty())
+		return;
+	if (!force && getTime() - s_binary_cache_dirty_time < 2000)
+		return;
+	SaveBinaryCache((s_shader_atlas_filename + ".cache").c_str());
+}
+
+bool Shader::compileFromBinary(unsigned int format, const void* data, int size)
+{
+	program = glCreateProgram();
+	glProgramBinary(program, format, data, size);
+
+	GLint linked = 0;
+	glGetProgramiv(program, GL_LINK_STATUS, &linked);
+	if (!linked) //rejected by the driver (it was updated?), compile it from source
+	{
+		glGetError(); //the driver can flag an error when rejecting it
+		release();
+		return false;
 	}
 
+	compiled = true;
+	return true;
+}
+
+bool Shader::storeBinary(const std::string& name)
+{
+	GLint size = 0;
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &size);
+	if (size <= 0)
+		return false;
+
+	sProgramBinary& binary = s_binary_cache[name];
+	binary.hash = source_hash;
+	binary.data.resize(size);
+	GLenum format = 0;
+	glGetProgramBinary(program, size, NULL, &format, &binary.data[0]);
+	binary.format = format;
+	s_binary_cache_dirty = true;
+	s_binary_cache_dirty_time = getTime();
+
+	assert(glGetError() == GL_NO_ERROR);
 	return true;
 }
 
@@ -296,6 +658,14 @@ bool Shader::hasInfoLog() const
 // ******************************************
 
 bool Shader::compileFromMemory(const std::string& vsm, const std::string& psm)
+{
+	if (!issueCompile(vsm, psm))
+		return false;
+	return finishCompile();
+}
+
+//sends the code to the driver without waiting for it, finishCompile checks the result
+bool Shader::issueCompile(const std::string& vsm, const std::string& psm)
 {
 	if (glCreateProgram == 0)
 	{
@@ -306,32 +676,59 @@ bool Shader::compileFromMemory(const std::string& vsm, const std::string& psm)
 	program = glCreateProgram();
 	assert (glGetError() == GL_NO_ERROR);
 
-	if (!createVertexShaderObject(vsm))
-	{
-		printf("Vertex shader compilation failed\n");
-		return false;
-	}
+	createVertexShaderObject(vsm);
+	createFragmentShaderObject(psm);
 
-	if (!createFragmentShaderObject(psm))
-	{
-		printf("Fragment shader compilation failed\n");
-		return false;
-	}
+	if (s_use_binary_cache && s_binary_cache_loaded)
+		glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
 
 	glLinkProgram(program);
 	assert (glGetError() == GL_NO_ERROR);
 
+	pending_vs_code = vsm;
+	pending_fs_code = psm;
+	pending = true;
+	return true;
+}
+
+bool Shader::isReady()
+{
+	if (!pending || !s_parallel_compile)
+		return true;
+	GLint done = 0;
+	glGetProgramiv(program, GL_COMPLETION_STATUS_KHR, &done);
+	return done != 0;
+}
+
+bool Shader::finishCompile()
+{
+	if (!pending)
+		return compiled;
+	pending = false;
+
+	//blocks until the driver has finished with this one
 	GLint linked=0;
-    
 	glGetProgramiv(program,GL_LINK_STATUS,&linked);
 	assert(glGetError() == GL_NO_ERROR);
 
 	if (!linked)
 	{
-		saveProgramInfoLog(program);
+		if (!checkShaderObject(vs, pending_vs_code))
+			printf("Vertex shader compilation failed\n");
+		else if (!checkShaderObject(fs, pending_fs_code))
+			printf("Fragment shader compilation failed\n");
+		else
+			saveProgramInfoLog(program);
+		pending_vs_code.clear();
+		pending_fs_code.clear();
 		release();
+		if (restorePrevious())
+			std::cout << " - Using the previous version of the shader: " << atlas_name << std::endl;
 		return false;
 	}
+	pending_vs_code.clear();
+	pending_fs_code.clear();
+	releasePrevious();
 
 #ifdef _DEBUG
 	validate();
@@ -339,6 +736,15 @@ bool Shader::compileFromMemory(const std::string& vsm, const std::string& psm)
 
 	compiled = true;
 
+	if (from_atlas)
+	{
+		source_hash = pending_hash;
+		s_num_compiled++;
+		std::cout << " + Shader from atlas: " << atlas_name << std::endl;
+		if (s_use_binary_cache)
+			storeBinary(atlas_name);
+	}
+
 	return true;
 }
 
@@ -386,6 +792,15 @@ bool Shader::createShaderObject(unsigned int type, GLuint& handle, const std::st
 	glCompileShader(handle);
 	assert( glGetError() == GL_NO_ERROR );
 
+	//the status is checked later (checkShaderObject) so the driver can compile several at the same time
+	glAttachShader(program,handle);
+	assert( glGetError() == GL_NO_ERROR );
+
+	return true;
+}
+
+bool Shader::checkShaderObject(GLuint handle, const std::string& code)
+{
 	GLint compile=0;
 	glGetShaderiv(handle,GL_COMPILE_STATUS,&compile);
 	assert( glGetError() == GL_NO_ERROR );
@@ -395,16 +810,13 @@ bool Shader::createShaderObject(unsigned int type, GLuint& handle, const std::st
 	{
 		saveShaderInfoLog(handle);
         std::cout << "Shader code:\n " << std::endl;
-		std::vector<std::string> lines = split( fullcode, '\n' );
+		std::vector<std::string> lines = split( code, '\n' );
 		for( size_t i = 0; i < lines.size(); ++i)
 			std::cout << i << "  " << lines[i] << std::endl;
 
 		return false;
 	}
 
-	glAttachShader(program,handle);
-	assert( glGetError() == GL_NO_ERROR );
-
 	return true;
 }
 
@@ -435,6 +847,47 @@ void Shader::release()
 	locations.clear();
 
 	compiled = false;
+	pending = false;
+}
+
+void Shader::keepPrevious()
+{
+	releasePrevious();
+	prev_vs = vs;
+	prev_fs = fs;
+	prev_program = program;
+	prev_source_hash = source_hash;
+	vs = fs = program = 0;
+	locations.clear();
+	compiled = false;
+}
+
+void Shader::releasePrevious()
+{
+	if (prev_vs)
+		glDeleteShader(prev_vs);
+	if (prev_fs)
+		glDeleteShader(prev_fs);
+	if (prev_program)
+		glDeleteProgram(prev_program);
+	prev_vs = prev_fs = prev_program = 0;
+	prev_source_hash = 0;
+}
+
+//back to the program saved by keepPrevious, false if there wasnt one
+bool Shader::restorePrevious()
+{
+	if (!prev_program)
+		return false;
+	release();
+	vs = prev_vs;
+	fs = prev_fs;
+	program = prev_program;
+	source_hash = prev_source_hash;
+	prev_vs = prev_fs = prev_program = 0;
+	prev_source_hash = 0;
+	compiled = true;
+	return true;
 }
 
 
@@ -570,6 +1023,15 @@ void Shader::setTexture(const char* varname, Texture* tex, int slot)
 	glActiveTexture(GL_TEXTURE0 + slot);
 }
 
+void Shader::setUniformBlock(const char* varname, int binding)
+{
+	GLuint index = glGetUniformBlockIndex(program, varname);
+	if (index == GL_INVALID_INDEX)
+		return;
+	glUniformBlockBinding(program, index, binding);
+	assert(glGetError() == GL_NO_ERROR);
+}
+
 /*
 void Shader::setTexture(const char* varname, unsigned int tex)
 {
@@ -781,6 +1243,18 @@ void Shader::init()
 		IMPORT_GLEXT( glUniform4fv );
 		IMPORT_GLEXT( glUniformMatrix4fv );
 	#endif
+
+		//let the driver compile in its own threads, we only wait when checking the status
+		glMaxShaderCompilerThreadsKHR_func max_threads = NULL;
+		if (SDL_GL_ExtensionSupported("GL_KHR_parallel_shader_compile"))
+			max_threads = (glMaxShaderCompilerThreadsKHR_func)SDL_GL_GetProcAddress("glMaxShaderCompilerThreadsKHR");
+		else if (SDL_GL_ExtensionSupported("GL_ARB_parallel_shader_compile"))
+			max_threads = (glMaxShaderCompilerThreadsKHR_func)SDL_GL_GetProcAddress("glMaxShaderCompilerThreadsARB");
+		if (max_threads)
+		{
+			max_threads(0xFFFFFFFF); //as many as the driver wants
+			s_parallel_compile = true;
+		}
 	}
 	
 	firsttime = false;
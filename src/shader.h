@@ -40,6 +40,11 @@ public:
 
 	//internal functions
 	virtual bool compileFromMemory(const std::string& vsm, const std::string& psm);
+	//compileFromMemory in two steps, so several shaders can be compiled by the driver at the same time
+	bool issueCompile(const std::string& vsm, const std::string& psm);
+	bool finishCompile();
+	bool isReady(); //false while the driver is still compiling it (without waiting)
+	bool pending; //issued but not finished
 	virtual void release();
 	virtual void enable();
 	virtual void disable();
@@ -98,6 +103,8 @@ public:
 
 	//virtual void setTexture(const char* varname, const unsigned int tex) ;
 	virtual void setTexture(const char* varname, Texture* texture, int slot);
+	//uniform blocks read from a buffer bound to a binding point (glBindBufferBase)
+	virtual void setUniformBlock(const char* varname, int binding);
 
 	virtual int getAttribLocation(const char* varname);
 	virtual int getUniformLocation(const char* varname);
@@ -110,6 +117,7 @@ public:
 
 	static Shader* Get(const char* vsf, const char* psf = NULL, const char* macros = NULL);
 	static void ReloadAll();
+	static bool ReloadAtlasIfChanged(); //only the programs affected by the changed chunks are compiled again
 	static std::map<std::string,Shader*> s_Shaders;
 
 	//this is a way to load a single file that contains all the shaders 
@@ -118,8 +126,25 @@ public:
 	static std::string s_shader_atlas_filename;
 	static std::map<std::string, std::string> s_shaders_atlas; //stores strings, no shaders
 
+	//programs from the atlas are stored linked in a cache file (next to the atlas) and loaded from there
+	//when their source hasnt changed, so they dont have to be compiled again
+	static bool s_use_binary_cache;
+	static bool LoadBinaryCache(const char* filename);
+	static bool SaveBinaryCache(const char* filename);
+	//saves the cache if programs were added, but not while they keep coming (the permutations of the first frames)
+	static void FlushBinaryCache(bool force = false);
+	bool compileFromBinary(unsigned int format, const void* data, int size);
+	bool storeBinary(const std::string& name);
+
 	static Shader* getDefaultShader(std::string name);
 
+	//permutations: the same atlas program compiled with every flag defined as a constant (true/false),
+	//so the branches that depend on them are removed by the compiler. Compiled the first time they are used
+	Shader* getPermutation(unsigned int flags, const char* const* flag_names, int num_flags);
+	Shader* getPermutation(unsigned int key, const std::string& perm_macros); //any macros, identified by the key
+	std::map<unsigned int, Shader*> permutations;
+	std::string permutation_macros; //added to the macros of its base shader
+
 protected:
 
 	std::string info_log;
@@ -127,10 +152,28 @@ protected:
 	std::string ps_filename;
 	std::string macros;
 	bool from_atlas;
+	unsigned long long source_hash; //of the atlas code used to compile it, 0 if not from atlas
+	std::string atlas_name; //name used in the binary cache
+
+	unsigned long long pending_hash;
+	std::string pending_vs_code; //to show the errors
+	std::string pending_fs_code;
+
+	//the working program while a new version is compiled, restored if it fails (0 if none)
+	GLuint prev_vs;
+	GLuint prev_fs;
+	GLuint prev_program;
+	unsigned long long prev_source_hash;
+	void keepPrevious();
+	void releasePrevious();
+	bool restorePrevious();
+
+	bool compileFromAtlas(const std::string& name, const std::string& vs_filename, const std::string& fs_filename, const std::string& macros, bool wait = true);
 
 	bool createVertexShaderObject(const std::string& shader);
 	bool createFragmentShaderObject(const std::string& shader);
 	bool createShaderObject(unsigned int type, GLuint& handle, const std::string& shader);
+	bool checkShaderObject(GLuint handle, const std::string& code);
 	void saveShaderInfoLog(GLuint obj);
 	void saveProgramInfoLog(GLuint obj);
 
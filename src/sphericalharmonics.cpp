@@ -1,4 +1,5 @@
 #include "sphericalharmonics.h"
+#include <mutex>
 
 //system axis
 Vector3 cubemapFaceNormals[6][3] = {
@@ -15,6 +16,7 @@ Vector3 cubemapFaceNormals[6][3] = {
 const int sh_length = 9;
 std::vector< std::vector<Vector3> > cubeMapVecs;
 int cubeMapVecs_size = 0;
+std::mutex cubeMapVecs_mutex; //the probes are computed in jobs
 
 float areaElement(float x, float y) {
     return atan2(x * y, sqrtf(x * x + y * y + 1.0f));
@@ -49,6 +51,7 @@ SphericalHarmonics computeSH(FloatImage images[], bool degamma) {
     SphericalHarmonics sh;
 
     // generate cube map vectors
+    std::unique_lock<std::mutex> lock(cubeMapVecs_mutex);
     if (cubeMapVecs_size != size)
     {
         cubeMapVecs_size = size;
@@ -73,6 +76,7 @@ SphericalHarmonics computeSH(FloatImage images[], bool degamma) {
             cubeMapVecs.push_back(faceVecs);
         }
     }
+    lock.unlock();
 
     // generate spherical harmonics
     float weightAccum = 0;
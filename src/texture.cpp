@@ -61,6 +61,7 @@ std::map<std::string, Texture*> Texture::sTexturesLoaded;
 int Texture::default_mag_filter = GL_LINEAR;
 int Texture::default_min_filter = GL_LINEAR_MIPMAP_LINEAR;
 FBO* Texture::global_fbo = NULL;
+bool Texture::use_compact_targets = true;
 
 Texture::Texture()
 {
@@ -311,6 +312,18 @@ void Texture::upload(FloatImage* img)
 }
 
 
+unsigned int Texture::getTargetInternalFormat(unsigned int format, unsigned int type)
+{
+	if (!use_compact_targets || (type != GL_FLOAT && type != GL_HALF_FLOAT))
+		return 0;
+	//HDR color has no negative values, so it fits in the unsigned small floats
+	if (format == GL_RGB)
+		return GL_R11F_G11F_B10F;
+	if (format == GL_RGBA)
+		return GL_RGBA16F;
+	return 0;
+}
+
 //uploads the bytes of a texture to the VRAM
 void Texture::upload(unsigned int format, unsigned int type, bool mipmaps, Uint8* data, unsigned int internal_format)
 {
@@ -491,6 +504,42 @@ void Texture::uploadAsArray(unsigned int texture_size, bool mipmaps)
 }
 
 
+void Texture::createArray(unsigned int width, unsigned int height, unsigned int layers, unsigned int format, unsigned int type, bool mipmaps, unsigned int internal_format)
+{
+	assert(width && height && layers && "texture must have a size");
+
+	this->width = (float)width;
+	this->height = (float)height;
+	this->depth = (float)layers;
+	this->format = format;
+	this->type = type;
+	this->mipmaps = mipmaps && isPowerOfTwo(width) && isPowerOfTwo(height);
+
+	//Delete previous texture and ensure that previous bounded texture_id is not of another texture type
+	if (this->texture_id != 0)
+		clear();
+
+	this->texture_type = GL_TEXTURE_2D_ARRAY;
+
+	if (internal_format == 0 && type == GL_UNSIGNED_BYTE)
+		internal_format = format == GL_RGB ? GL_RGB8 : GL_RGBA8;
+	this->internal_format = internal_format;
+
+	glGenTextures(1, &texture_id); //we need to create an unique ID for the texture
+	glBindTexture(this->texture_type, texture_id);
+	//only the first level, the rest are allocated when generating the mipmaps
+	glTexImage3D(this->texture_type, 0, internal_format == 0 ? format : internal_format, width, height, layers, 0, format, type, NULL);
+
+	glTexParameteri(this->texture_type, GL_TEXTURE_MAG_FILTER, Texture::default_mag_filter);
+	glTexParameteri(this->texture_type, GL_TEXTURE_MIN_FILTER, this->mipmaps ? Texture::default_min_filter : GL_LINEAR);
+	glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_S, this->mipmaps ? GL_REPEAT : GL_CLAMP_TO_EDGE);
+	glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_T, this->mipmaps ? GL_REPEAT : GL_CLAMP_TO_EDGE);
+
+	glBindTexture(this->texture_type, 0);
+	assert(checkGLErrors() && "Error creating texture array");
+}
+
+
 void Texture::bind()
 {
 	//glEnable(this->texture_type); //enable the textures 
@@ -621,6 +670,37 @@ void Texture::copyTo(Texture* destination, Shader* shader)
 	glDepthFunc(GL_LESS);
 }
 
+void Texture::copyToLayer(Texture* destination, int layer)
+{
+	assert(destination && destination->texture_type == GL_TEXTURE_2D_ARRAY);
+	assert(layer >= 0 && layer < (int)destination->depth);
+	assert(width == destination->width && height == destination->height && "layers must have the same size");
+
+	//one framebuffer to read from the texture and another to write in the layer
+	static GLuint copy_fbos[2] = { 0, 0 };
+	if (copy_fbos[0] == 0)
+		glGenFramebuffers(2, copy_fbos);
+
+	//it can be called while rendering to another framebuffer, restored when done
+	GLint prev_read_fbo = 0;
+	GLint prev_draw_fbo = 0;
+	glGetIntegerv(GL_READ_FRAMEBUFFER_BINDING, &prev_read_fbo);
+	glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &prev_draw_fbo);
+
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, copy_fbos[0]);
+	glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture_id, 0);
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, copy_fbos[1]);
+	glFramebufferTextureLayer(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, destination->texture_id, 0, layer);
+
+	int w = (int)width;
+	int h = (int)height;
+	glBlitFramebuffer(0, 0, w, h, 0, 0, w, h, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, prev_read_fbo);
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, prev_draw_fbo);
+	assert(checkGLErrors() && "Error copying texture layer");
+}
+
 void Image::fromScreen(int width, int height)
 {
 	if (data && (width != this->width || height != this->height))
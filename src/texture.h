@@ -104,6 +104,11 @@ public:
 	static int default_min_filter;
 	static FBO* global_fbo;
 
+	//render targets with float precision are stored compact (R11G11B10F for RGB, RGBA16F for RGBA)
+	//unless they ask for full precision, returns 0 when the default format should be used
+	static bool use_compact_targets;
+	static unsigned int getTargetInternalFormat(unsigned int format, unsigned int type);
+
 	//a general struct to store all the information about a TGA file
 
 	//textures manager
@@ -148,6 +153,9 @@ public:
 	void uploadCubemap(unsigned int format = GL_RGB, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, Uint8** data = NULL, unsigned int internal_format = 0, int level = 0);
 	void uploadAsArray(unsigned int texture_size, bool mipmaps = true);
 
+	//empty GL_TEXTURE_2D_ARRAY, fill the layers using copyToLayer
+	void createArray(unsigned int width, unsigned int height, unsigned int layers, unsigned int format = GL_RGBA, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, unsigned int internal_format = 0);
+
 	void bind();
 	void unbind();
 
@@ -175,6 +183,8 @@ public:
 	void toViewport( Shader* shader = NULL );
 	//copy to another texture
 	void copyTo(Texture* destination, Shader* shader = NULL);
+	//copy the first level to one layer of a texture array (done in the GPU using a blit)
+	void copyToLayer(Texture* destination, int layer);
 
 	static FBO* getGlobalFBO(Texture* texture);
 	static Texture* getBlackTexture();
@@ -4,6 +4,9 @@
 	#include <windows.h>
 #else
 	#include <sys/time.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <fcntl.h>
 #endif
 
 #include "includes.h"
@@ -137,6 +140,86 @@ bool readFileBin(const std::string& filename, std::vector<unsigned char>& buffer
 	return true;
 }
 
+//maps the file in memory so the OS pages it in on demand (no copy to the heap)
+void* mapFile(const std::string& filename, size_t& size)
+{
+	size = 0;
+#ifdef WIN32
+	HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return NULL;
+	LARGE_INTEGER file_size;
+	if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0)
+	{
+		CloseHandle(file);
+		return NULL;
+	}
+	HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	CloseHandle(file);
+	if (mapping == NULL)
+		return NULL;
+	void* data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(mapping); //the view keeps the mapping alive
+	if (data == NULL)
+		return NULL;
+	size = (size_t)file_size.QuadPart;
+	return data;
+#else
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd == -1)
+		return NULL;
+	struct stat st;
+	if (fstat(fd, &st) == -1 || st.st_size == 0)
+	{
+		close(fd);
+		return NULL;
+	}
+	void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd); //the mapping keeps the file alive
+	if (data == MAP_FAILED)
+		return NULL;
+	size = (size_t)st.st_size;
+	return data;
+#endif
+}
+
+void unmapFile(void* data, size_t size)
+{
+	if (!data)
+		return;
+#ifdef WIN32
+	UnmapViewOfFile(data);
+#else
+	munmap(data, size);
+#endif
+}
+
+long long getFileTime(const std::string& filename)
+{
+#ifdef WIN32
+	WIN32_FILE_ATTRIBUTE_DATA data;
+	if (!GetFileAttributesExA(filename.c_str(), GetFileExInfoStandard, &data))
+		return 0;
+	return ((long long)data.ftLastWriteTime.dwHighDateTime << 32) | data.ftLastWriteTime.dwLowDateTime;
+#else
+	struct stat info;
+	if (stat(filename.c_str(), &info) != 0)
+		return 0;
+	return (long long)info.st_mtime;
+#endif
+}
+
+unsigned long long hashString(const std::string& str, unsigned long long seed)
+{
+	unsigned long long hash = seed;
+	for (size_t i = 0; i < str.size(); ++i)
+	{
+		hash ^= (unsigned char)str[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
 bool checkGLErrors()
 {
 	#ifndef _DEBUG
@@ -18,6 +18,10 @@ long getTime();
 float * snapshot();
 bool readFile(const std::string& filename, std::string& content);
 bool readFileBin(const std::string& filename, std::vector<unsigned char>& buffer);
+void* mapFile(const std::string& filename, size_t& size); //read only mapping of the whole file, NULL if not found
+void unmapFile(void* data, size_t size);
+long long getFileTime(const std::string& filename); //last modification, 0 if not found
+unsigned long long hashString(const std::string& str, unsigned long long seed = 14695981039346656037ULL); //FNV-1a, stable between runs
 
 //generic purposes fuctions
 void drawGrid();